@@ -0,0 +1,995 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "image.h"
+#include "matrix.h"
+#include "args.h"
+#include "bench.h"
+
+// Benchmarks every operator in image.h and matrix.h over a sweep of image
+// sizes, channel counts and matrix sizes, and prints the results as JSON:
+//
+//     uwimg bench [-sizes 128,512] [-msizes 32,128] [-reps 11]
+//                 [-budget 2] [-only name] [-out results.json]
+//
+// Each case runs up to -reps times, or fewer once it has used -budget
+// seconds, and reports median and p99 latency, throughput and peak RSS.
+
+typedef enum{ONCE, IMG, PAIR, MAT} bench_kind;
+
+typedef struct{
+    image im;           // input image, w x h x c
+    image im2;          // second image of a pair, shifted from im
+    image filter;       // gaussian filter, sigma 2
+    image S;            // structure matrix of im
+    image S5;           // time structure matrix of im2 and im
+    image v;            // optical flow of im2 and im
+    descriptor *d, *d2; // harris corners of im and im2
+    int dn, dn2;
+    match *m;           // matches between im and im2
+    int mn;
+    int *ci;            // pixel indexes of the corners in d
+    descriptor_index *ix, *kd;  // exact and k-d forest indexes of d2
+    matrix H;           // homography from im to im2
+    matrix a, b;        // n x n matrices
+    fmatrix fa, fb;     // a and b in single precision
+    layer l;            // n -> n layer
+    data dat;           // a and b as a dataset
+    const char *dir;    // scratch directory for file io
+    // outputs and scratch, freed after each rep
+    image res, tmp;
+    matrix mres, mtmp;
+    void *ptr;
+    descriptor *dres;
+    int dres_n;
+    data dres_data;
+    fmatrix fres;
+    descriptor_set sres;
+    remap_table *rtab;
+    dataset *ds;
+    flow_pyramid fp;
+    flow_session *fs;
+    image_u8 u8, u8res; // im in 8 bits, and 8 bit output
+} bench_input;
+
+typedef struct{
+    const char *name;
+    bench_kind kind;
+    int channels;                   // required channels, 0 for any
+    void (*prep)(bench_input *in);  // untimed setup before each rep
+    void (*run)(bench_input *in);
+} bench_case;
+
+// Functions declared in image.h or matrix.h that are not benchmarked
+static const char *skipped[] = {
+    "grayscale_to_rgb", "scale_image", "get_channel", "threshold_image",
+    "n_principal_components",       // declared but not implemented
+    "print_matrix", "test_matrix",  // only print
+    "optical_flow_webcam", "optical_flow_webcam_pyramid",   // need a camera
+    "image_channel", "image_row", "border_distance",    // inline accessors
+    "descriptor_index_point", "describe_index", "descriptor_set_view",
+    "make_descriptor_set",          // constant time or timed in describe_corners
+    "match_compare",                // qsort comparator, timed in match_descriptors
+    "select_corners",               // timed in harris_corners_top
+    "make_image_disk", "multiband_blend_band", "multiband_blend",
+    "panorama_image_blend",         // timed in combine_multiband and composite_images
+    "remap_cached", "free_remap_table",     // timed in cylindrical_project
+    "pyramid_flow", "sample_flow", "free_flow_pyramid",     // timed in optical_flow_pyramid
+    "make_flow_session", "free_flow_session",   // setup for flow_session_next
+    "pyramid_down_into", "box_filter_image_into",   // same work as the allocating versions
+    "parallel_for", "parallel_for_tiles", "set_num_threads", "set_tile_size",
+    "default_dataset_opts", "dataset_size", "close_dataset",    // timed with next_batch
+    "train_model_stream", "train_fmodel_stream", "accuracy_model_stream",
+    "accuracy_fmodel_stream",       // next_batch plus the layer cases
+    "make_fmatrix", "free_fmatrix", "copy_fmatrix", "random_fmatrix", "axpy_fmatrix",
+    "matrix_to_fmatrix", "fmatrix_to_matrix",   // same as the double versions
+    "activate_fmatrix", "gradient_fmatrix", "forward_flayer", "backward_flayer",
+    "update_flayer", "make_flayer", "forward_fmodel", "train_fmodel",
+    "accuracy_fmodel",              // float copies of the layer cases
+    "bin_open_write", "bin_write", "bin_close_write", "bin_parse_header",
+    "bin_read_header", "bin_verify", "bin_map", "bin_release", "bin_map_scratch",
+    "bin_evict", "release_image", "release_matrix",    // timed in the binary load, save and map cases
+    "make_image_u8", "free_image_u8", "save_image_u8",
+    "save_png_u8",                  // same encode as save_image and save_png
+    "open_video_stream", "get_image_from_stream", "make_window",
+    "show_image",                   // need a camera or a display
+};
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Resets the kernel's peak RSS counter so each case gets its own peak.
+// Without permission to do so the peak is cumulative over the run.
+static void reset_peak_rss()
+{
+    FILE *fp = fopen("/proc/self/clear_refs", "w");
+    if (!fp) return;
+    fputs("5", fp);
+    fclose(fp);
+}
+
+// returns: peak resident set size in kB since the last reset.
+static long peak_rss_kb()
+{
+    char line[256];
+    long kb = -1;
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (0 == strncmp(line, "VmHWM:", 6)) kb = atol(line + 6);
+        }
+        fclose(fp);
+    }
+    if (kb < 0) {
+        struct rusage u;
+        getrusage(RUSAGE_SELF, &u);
+        kb = u.ru_maxrss;
+    }
+    return kb;
+}
+
+// Smooth blobs plus block noise, so there are corners to find.
+// int dx: horizontal shift, to make the second image of a pair.
+static image make_synthetic_image(int w, int h, int c, int dx)
+{
+    image im = make_image(w, h, c);
+    int x, y, k;
+    for (k = 0; k < c; ++k) {
+        for (y = 0; y < h; ++y) {
+            for (x = 0; x < w; ++x) {
+                int sx = x + dx;
+                unsigned hash = (sx / 8) * 73856093u ^ (y / 8) * 19349663u ^ k * 83492791u;
+                hash = (hash ^ (hash >> 13)) * 1274126177u;
+                float noise = (hash >> 8 & 0xffff) / 65535.f;
+                float wave = sinf(sx * .05f + k) * cosf(y * .07f);
+                im.data[x + y*w + k*w*h] = .5f + .25f * wave + .25f * (noise - .5f);
+            }
+        }
+    }
+    return im;
+}
+
+// Loads an image with the requested number of channels.
+static image load_bench_image(const char *path, int c)
+{
+    image im = load_image((char *)path);
+    if (c == 1 && im.c == 3) {
+        image g = rgb_to_grayscale(im);
+        free_image(im);
+        return g;
+    }
+    return im;
+}
+
+// Keeps the compiler from dropping loops whose result is unused.
+static volatile float sink;
+
+static void prep_copy(bench_input *in) { in->tmp = copy_image(in->im); }
+static void prep_corners(bench_input *in)
+{
+    in->dres = harris_corner_detector(in->im, 2, 5, 3, &in->dres_n);
+}
+static void prep_matrix(bench_input *in) { in->mtmp = copy_matrix(in->a); }
+static void prep_data(bench_input *in)
+{
+    in->dres_data.X = copy_matrix(in->a);
+    in->dres_data.y = copy_matrix(in->b);
+}
+
+static void b_get_pixel(bench_input *in)
+{
+    image im = in->im;
+    int x, y, c;
+    float sum = 0;
+    for (c = 0; c < im.c; ++c) for (y = 0; y < im.h; ++y) for (x = 0; x < im.w; ++x) {
+        sum += get_pixel(im, x, y, c);
+    }
+    sink = sum;
+}
+static void b_set_pixel(bench_input *in)
+{
+    image im = in->tmp;
+    int x, y, c;
+    for (c = 0; c < im.c; ++c) for (y = 0; y < im.h; ++y) for (x = 0; x < im.w; ++x) {
+        set_pixel(im, x, y, c, .5f);
+    }
+}
+static void b_nn_interpolate(bench_input *in)
+{
+    image im = in->im;
+    int x, y, c;
+    float sum = 0;
+    for (c = 0; c < im.c; ++c) for (y = 0; y < im.h; ++y) for (x = 0; x < im.w; ++x) {
+        sum += nn_interpolate(im, x + .3f, y + .6f, c);
+    }
+    sink = sum;
+}
+static void b_bilinear_interpolate(bench_input *in)
+{
+    image im = in->im;
+    int x, y, c;
+    float sum = 0;
+    for (c = 0; c < im.c; ++c) for (y = 0; y < im.h; ++y) for (x = 0; x < im.w; ++x) {
+        sum += bilinear_interpolate(im, x + .3f, y + .6f, c);
+    }
+    sink = sum;
+}
+static void b_copy_image(bench_input *in) { in->res = copy_image(in->im); }
+static void b_make_image(bench_input *in) { in->res = make_image(in->im.w, in->im.h, in->im.c); }
+static void b_free_image(bench_input *in) { free_image(in->tmp); in->tmp.data = 0; }
+static void b_rgb_to_grayscale(bench_input *in) { in->res = rgb_to_grayscale(in->im); }
+static void b_rgb_to_hsv(bench_input *in) { rgb_to_hsv(in->tmp); }
+static void b_hsv_to_rgb(bench_input *in) { hsv_to_rgb(in->tmp); }
+static void b_shift_image(bench_input *in) { shift_image(in->tmp, 0, .1f); }
+static void b_clamp_image(bench_input *in) { clamp_image(in->tmp); }
+static void b_same_image(bench_input *in) { same_image(in->im, in->tmp, .002); }
+static void b_add_image(bench_input *in) { in->res = add_image(in->im, in->im); }
+static void b_sub_image(bench_input *in) { in->res = sub_image(in->im, in->im); }
+static void b_nn_resize(bench_input *in) { in->res = nn_resize(in->im, in->im.w*2, in->im.h*2); }
+static void b_bilinear_resize(bench_input *in) { in->res = bilinear_resize(in->im, in->im.w*2, in->im.h*2); }
+static void b_convolve_image(bench_input *in) { in->res = convolve_image(in->im, in->filter, 1); }
+static void b_feature_normalize(bench_input *in) { feature_normalize(in->tmp); }
+static void b_l1_normalize(bench_input *in) { l1_normalize(in->tmp); }
+static void b_sobel_image(bench_input *in)
+{
+    image *s = sobel_image(in->im);
+    in->res = s[0];
+    in->tmp = s[1];
+    free(s);
+}
+static void b_colorize_sobel(bench_input *in) { in->res = colorize_sobel(in->im); }
+static void b_smooth_image(bench_input *in) { in->res = smooth_image(in->im, 2); }
+static void b_smooth_image_box(bench_input *in) { in->res = smooth_image_method(in->im, 2, SMOOTH_BOX); }
+static void b_smooth_image_iir(bench_input *in) { in->res = smooth_image_method(in->im, 2, SMOOTH_IIR); }
+static void b_structure_matrix(bench_input *in) { in->res = structure_matrix(in->im, 2); }
+static void b_cornerness_response(bench_input *in) { in->res = cornerness_response(in->S); }
+static void b_harris_corner_detector(bench_input *in)
+{
+    in->dres = harris_corner_detector(in->im, 2, 5, 3, &in->dres_n);
+}
+static void b_free_descriptors(bench_input *in)
+{
+    free_descriptors(in->dres, in->dres_n);
+    in->dres = 0;
+}
+static void b_describe_corners(bench_input *in) { in->sres = describe_corners(in->im, in->ci, in->dn); }
+static void b_harris_corner_set(bench_input *in) { in->sres = harris_corner_set(in->im, 2, 5, 3); }
+static void b_harris_corners(bench_input *in)
+{
+    in->ptr = harris_corners(in->im, 2, 5, 3, &in->dres_n);
+}
+static void b_harris_corners_top(bench_input *in)
+{
+    in->ptr = harris_corners_top(in->im, 2, 3, 500, SELECT_GRID, &in->dres_n);
+}
+static void b_harris_corner_detector_top(bench_input *in)
+{
+    in->dres = harris_corner_detector_top(in->im, 2, 3, 500, SELECT_ANMS, &in->dres_n);
+}
+static void prep_response(bench_input *in) { in->tmp = cornerness_response(in->S); }
+static void b_nms_image(bench_input *in) { in->res = nms_image(in->tmp, 3); }
+static void b_nms_corners(bench_input *in) { in->ptr = nms_corners(in->tmp, 3, 5, &in->dres_n); }
+static void b_make_1d_gaussian(bench_input *in) { in->res = make_1d_gaussian(2); }
+static void b_make_remap_table(bench_input *in)
+{
+    in->rtab = make_remap_table(REMAP_CYLINDRICAL, in->im.w, in->im.h, in->im.w, 0, 0);
+}
+static void prep_remap_table(bench_input *in) { b_make_remap_table(in); }
+static void b_remap_image(bench_input *in) { in->res = remap_image(in->im, in->rtab); }
+static void b_mark_corners(bench_input *in) { mark_corners(in->tmp, in->d, in->dn); }
+static void b_detect_and_draw_corners(bench_input *in) { detect_and_draw_corners(in->tmp, 2, 5, 3); }
+static void b_cylindrical_project(bench_input *in) { in->res = cylindrical_project(in->im, in->im.w); }
+static void b_spherical_project(bench_input *in) { in->res = spherical_project(in->im, in->im.w); }
+static void b_undistort_image(bench_input *in) { in->res = undistort_image(in->im, in->im.w, -.1, .01); }
+static void b_make_integral_image(bench_input *in) { in->res = make_integral_image(in->im); }
+static void b_box_filter_image(bench_input *in) { in->res = box_filter_image(in->im, 15); }
+static void prep_u8(bench_input *in) { in->u8 = image_to_u8(in->im); }
+static void b_image_u8_to_float(bench_input *in) { in->res = image_u8_to_float(in->u8); }
+static void b_image_to_u8(bench_input *in) { in->u8res = image_to_u8(in->im); }
+static void b_nn_resize_u8(bench_input *in) { in->u8res = nn_resize_u8(in->u8, in->im.w*2, in->im.h*2); }
+static void b_bilinear_resize_u8(bench_input *in) { in->u8res = bilinear_resize_u8(in->u8, in->im.w*2, in->im.h*2); }
+static void b_rgb_to_grayscale_u8(bench_input *in) { in->u8res = rgb_to_grayscale_u8(in->u8); }
+static void b_box_filter_image_u8(bench_input *in) { in->u8res = box_filter_image_u8(in->u8, 15); }
+static void b_draw_flow(bench_input *in) { draw_flow(in->tmp, in->v, 8); }
+static void b_save_image(bench_input *in)
+{
+    char buff[256];
+    sprintf(buff, "%s/bench", in->dir);
+    save_image(in->im, buff);
+}
+static void b_save_png(bench_input *in)
+{
+    char buff[256];
+    sprintf(buff, "%s/bench", in->dir);
+    save_png(in->im, buff);
+}
+static void prep_png(bench_input *in)
+{
+    char buff[256];
+    sprintf(buff, "%s/bench", in->dir);
+    save_png(in->im, buff);
+}
+static void b_load_image(bench_input *in)
+{
+    char buff[256];
+    sprintf(buff, "%s/bench.png", in->dir);
+    in->res = load_image(buff);
+}
+static void b_save_image_binary(bench_input *in)
+{
+    char buff[256];
+    sprintf(buff, "%s/bench.bin", in->dir);
+    save_image_binary(in->im, buff);
+}
+static void prep_binary(bench_input *in)
+{
+    char buff[256];
+    sprintf(buff, "%s/bench.bin", in->dir);
+    save_image_binary(in->im, buff);
+}
+static void b_load_image_binary(bench_input *in)
+{
+    char buff[256];
+    sprintf(buff, "%s/bench.bin", in->dir);
+    in->res = load_image_binary(buff);
+}
+static void b_map_image_binary(bench_input *in)
+{
+    char buff[256];
+    sprintf(buff, "%s/bench.bin", in->dir);
+    in->res = map_image_binary(buff);
+}
+
+static void b_find_and_draw_matches(bench_input *in)
+{
+    image a = copy_image(in->im);
+    image b = copy_image(in->im2);
+    in->res = find_and_draw_matches(a, b, 2, 5, 3);
+    free_image(a);
+    free_image(b);
+}
+static void b_match_descriptors(bench_input *in)
+{
+    int mn;
+    in->ptr = match_descriptors(in->d, in->dn, in->d2, in->dn2, &mn);
+}
+static void b_match_descriptors_kdforest(bench_input *in)
+{
+    int mn;
+    descriptor_index *ix = make_descriptor_index(in->d2, in->dn2, INDEX_KDFOREST);
+    in->ptr = match_descriptors_index(in->d, in->dn, ix, 0, &mn);
+    free_descriptor_index(ix);
+}
+static void b_query_descriptor_index(bench_input *in)
+{
+    in->ptr = calloc(in->dn, sizeof(neighbors));
+    query_descriptor_index(in->ix, in->d, in->dn, in->ptr);
+}
+static void b_query_descriptor_index_kdforest(bench_input *in)
+{
+    in->ptr = calloc(in->dn, sizeof(neighbors));
+    query_descriptor_index(in->kd, in->d, in->dn, in->ptr);
+}
+static void b_model_inliers(bench_input *in) { model_inliers(in->H, in->m, in->mn, 2); }
+// Field panorama settings: 50000 iterations, no inlier cutoff
+static void b_RANSAC(bench_input *in) { in->mres = RANSAC_seeded(in->m, in->mn, 2, 50000, in->mn, 10); }
+static void b_combine_images(bench_input *in) { in->res = combine_images(in->im, in->im2, in->H); }
+static void b_combine_feather(bench_input *in) { in->res = combine_images_blend(in->im, in->im2, in->H, BLEND_FEATHER); }
+static void b_combine_multiband(bench_input *in) { in->res = combine_images_blend(in->im, in->im2, in->H, BLEND_MULTIBAND); }
+static void b_panorama_image(bench_input *in)
+{
+    in->res = panorama_image(in->im, in->im2, 2, 5, 3, 2, 1000, 50);
+}
+// The six Rainier images, out of order, loaded on first use.
+static image rainier[6];
+static void prep_rainier(bench_input *in)
+{
+    static const char *names[6] = {"data/Rainier1.png", "data/Rainier2.png", "data/Rainier5.png",
+        "data/Rainier6.png", "data/Rainier3.png", "data/Rainier4.png"};
+    int i;
+    if (rainier[0].data) return;
+    for (i = 0; i < 6; ++i) rainier[i] = load_image((char *)names[i]);
+}
+static void b_load_images(bench_input *in)
+{
+    char *names[6] = {"data/Rainier1.png", "data/Rainier2.png", "data/Rainier3.png",
+        "data/Rainier4.png", "data/Rainier5.png", "data/Rainier6.png"};
+    image ims[6];
+    int i;
+    load_images(names, 6, 0, ims);
+    for (i = 0; i < 6; ++i) free_image(ims[i]);
+}
+static void b_load_image_u8(bench_input *in)
+{
+    char buff[256];
+    sprintf(buff, "%s/bench.png", in->dir);
+    in->u8res = load_image_u8(buff);
+}
+static void b_load_images_u8(bench_input *in)
+{
+    char *names[6] = {"data/Rainier1.png", "data/Rainier2.png", "data/Rainier3.png",
+        "data/Rainier4.png", "data/Rainier5.png", "data/Rainier6.png"};
+    image_u8 ims[6];
+    int i;
+    load_images_u8(names, 6, ims);
+    for (i = 0; i < 6; ++i) free_image_u8(ims[i]);
+}
+static void b_save_images(bench_input *in)
+{
+    char buff[6][256];
+    char *names[6];
+    int i;
+    for (i = 0; i < 6; ++i) {
+        sprintf(buff[i], "%s/bench%d", in->dir, i);
+        names[i] = buff[i];
+    }
+    save_images(rainier, names, 6, 1);
+}
+// Their homographies from panorama_homographies, found on first use.
+static matrix rainier_H[6];
+static void prep_rainier_H(bench_input *in)
+{
+    prep_rainier(in);
+    if (!rainier_H[0].data && !rainier_H[1].data) {
+        panorama_homographies(rainier, 6, 2, 5, 3, 2, 10000, 30, 0, rainier_H);
+    }
+}
+// tryhw3.py's chain: each image joins the growing panorama in turn.
+static void b_panorama_chain(bench_input *in)
+{
+    image pan = copy_image(rainier[0]);
+    int i;
+    for (i = 1; i < 6; ++i) {
+        image next = panorama_image(pan, rainier[i], 2, 5, 3, 2, 10000, 30);
+        free_image(pan);
+        pan = next;
+    }
+    in->res = pan;
+}
+static void b_panorama_images(bench_input *in)
+{
+    in->res = panorama_images(rainier, 6, 2, 5, 3, 2, 10000, 30, 0, BLEND_NONE);
+}
+static void b_panorama_homographies(bench_input *in)
+{
+    matrix H[6];
+    int i;
+    panorama_homographies(rainier, 6, 2, 5, 3, 2, 10000, 30, 0, H);
+    for (i = 0; i < 6; ++i) free_matrix(H[i]);
+}
+static void b_composite_images(bench_input *in) { in->res = composite_images(rainier, rainier_H, 6, BLEND_NONE); }
+static void b_composite_multiband(bench_input *in) { in->res = composite_images(rainier, rainier_H, 6, BLEND_MULTIBAND); }
+static void b_time_structure_matrix(bench_input *in) { in->res = time_structure_matrix(in->im2, in->im, 15); }
+static void b_velocity_image(bench_input *in) { in->res = velocity_image(in->S5, 5); }
+static void b_velocity_confidence_image(bench_input *in) { in->res = velocity_confidence_image(in->S5, 5); }
+static void b_optical_flow_images(bench_input *in) { in->res = optical_flow_images(in->im2, in->im, 15, 8); }
+static void b_pyramid_down(bench_input *in) { in->res = pyramid_down(in->im); }
+static void b_make_flow_pyramid(bench_input *in) { in->fp = make_flow_pyramid(in->im, 0); }
+static void b_optical_flow_pyramid(bench_input *in) { in->res = optical_flow_pyramid(in->im2, in->im, 0, 15, 8); }
+static void prep_flow_session(bench_input *in)
+{
+    in->fs = make_flow_session(in->im.w, in->im.h, 0, 15, 3);
+    free_image(flow_session_next(in->fs, in->im, 8));
+}
+static void b_flow_session_next(bench_input *in) { in->res = flow_session_next(in->fs, in->im2, 8); }
+
+static void b_make_box_filter(bench_input *in) { in->res = make_box_filter(7); }
+static void b_make_highpass_filter(bench_input *in) { in->res = make_highpass_filter(); }
+static void b_make_sharpen_filter(bench_input *in) { in->res = make_sharpen_filter(); }
+static void b_make_emboss_filter(bench_input *in) { in->res = make_emboss_filter(); }
+static void b_make_gaussian_filter(bench_input *in) { in->res = make_gaussian_filter(2); }
+static void b_make_gx_filter(bench_input *in) { in->res = make_gx_filter(); }
+static void b_make_gy_filter(bench_input *in) { in->res = make_gy_filter(); }
+static void b_make_point(bench_input *in)
+{
+    int i;
+    float sum = 0;
+    for (i = 0; i < 1000; ++i) sum += make_point(i, i).x;
+    sink = sum;
+}
+static void b_project_point(bench_input *in)
+{
+    matrix H = make_translation_homography(3, 4);
+    int i;
+    float sum = 0;
+    for (i = 0; i < 1000; ++i) sum += project_point(H, make_point(i, i)).x;
+    free_matrix(H);
+    sink = sum;
+}
+static void b_compute_homography(bench_input *in)
+{
+    match m[4];
+    m[0].p = make_point(7.2, 1.3);  m[0].q = make_point(10, 10.9);
+    m[1].p = make_point(3, 3);      m[1].q = make_point(1.3, 7.3);
+    m[2].p = make_point(-.2, -3.4); m[2].q = make_point(.8, 2.6);
+    m[3].p = make_point(-3.2, 2.4); m[3].q = make_point(1.5, -4.2);
+    in->mres = compute_homography(m, 4);
+}
+static void b_make_identity_homography(bench_input *in) { in->mres = make_identity_homography(); }
+static void b_make_translation_homography(bench_input *in) { in->mres = make_translation_homography(1, 2); }
+static void b_load_classification_data(bench_input *in)
+{
+    char images[256], labels[256];
+    sprintf(images, "%s/images.list", in->dir);
+    sprintf(labels, "%s/labels.list", in->dir);
+    in->dres_data = load_classification_data(images, labels, 1);
+}
+static void b_open_dataset(bench_input *in)
+{
+    char images[256], labels[256];
+    sprintf(images, "%s/images.list", in->dir);
+    sprintf(labels, "%s/labels.list", in->dir);
+    in->ds = open_dataset(images, labels, 1, default_dataset_opts(4));
+}
+static void prep_dataset(bench_input *in) { b_open_dataset(in); }
+// An epoch of the 16 image dataset, 4 images a batch.
+static void b_next_batch(bench_input *in)
+{
+    int i;
+    for (i = 0; i < 4; ++i) free_data(next_batch(in->ds));
+}
+static void b_fgetl(bench_input *in)
+{
+    char images[256];
+    char *line;
+    sprintf(images, "%s/images.list", in->dir);
+    FILE *fp = fopen(images, "r");
+    if (!fp) return;
+    while ((line = fgetl(fp))) free(line);
+    fclose(fp);
+}
+
+static void b_make_matrix(bench_input *in) { in->mres = make_matrix(in->a.rows, in->a.cols); }
+static void b_free_matrix(bench_input *in) { free_matrix(in->mtmp); in->mtmp.data = 0; }
+static void b_copy_matrix(bench_input *in) { in->mres = copy_matrix(in->a); }
+static void b_mag_matrix(bench_input *in) { sink = mag_matrix(in->a); }
+static void b_sle_solve(bench_input *in) { in->ptr = sle_solve(in->mtmp, in->b.data[0]); }
+static void b_matrix_mult_matrix(bench_input *in) { in->mres = matrix_mult_matrix(in->a, in->b); }
+static void b_matrix_mult_transpose(bench_input *in) { in->mres = matrix_mult_transpose(in->a, in->b); }
+static void b_transpose_mult_matrix(bench_input *in) { in->mres = transpose_mult_matrix(in->a, in->b); }
+static void b_fmatrix_mult_fmatrix(bench_input *in) { in->fres = fmatrix_mult_fmatrix(in->fa, in->fb); }
+static void b_fmatrix_mult_transpose(bench_input *in) { in->fres = fmatrix_mult_transpose(in->fa, in->fb); }
+static void b_transpose_mult_fmatrix(bench_input *in) { in->fres = transpose_mult_fmatrix(in->fa, in->fb); }
+static void b_matrix_elmult_matrix(bench_input *in) { in->mres = matrix_elmult_matrix(in->a, in->b); }
+static void b_solve_system(bench_input *in) { in->mres = solve_system(in->a, in->b); }
+static void b_matrix_invert(bench_input *in) { in->mres = matrix_invert(in->a); }
+static void b_random_matrix(bench_input *in) { in->mres = random_matrix(in->a.rows, in->a.cols, 1); }
+static void b_transpose_matrix(bench_input *in) { in->mres = transpose_matrix(in->a); }
+static void b_axpy_matrix(bench_input *in) { in->mres = axpy_matrix(2, in->a, in->b); }
+static void b_activate_matrix(bench_input *in) { activate_matrix(in->mtmp, SOFTMAX); }
+static void b_gradient_matrix(bench_input *in) { gradient_matrix(in->a, LOGISTIC, in->mtmp); }
+static void b_forward_layer(bench_input *in) { forward_layer(&in->l, in->a); }
+static void b_backward_layer(bench_input *in) { in->mres = backward_layer(&in->l, in->mtmp); }
+static void b_update_layer(bench_input *in) { update_layer(&in->l, .01, .9, .01); }
+static void b_make_layer(bench_input *in)
+{
+    layer l = make_layer(in->a.cols, in->a.cols, RELU);
+    free_matrix(l.in);
+    free_matrix(l.out);
+    free_matrix(l.v);
+    free_matrix(l.dw);
+    in->mres = l.w;
+}
+static void b_save_matrix(bench_input *in)
+{
+    char buff[256];
+    sprintf(buff, "%s/bench.matrix", in->dir);
+    save_matrix(in->a, buff);
+}
+static void prep_matrix_file(bench_input *in)
+{
+    char buff[256];
+    sprintf(buff, "%s/bench.matrix", in->dir);
+    save_matrix(in->a, buff);
+}
+static void b_load_matrix(bench_input *in)
+{
+    char buff[256];
+    sprintf(buff, "%s/bench.matrix", in->dir);
+    in->mres = load_matrix(buff);
+}
+static void b_random_batch(bench_input *in) { in->dres_data = random_batch(in->dat, in->a.rows); }
+static void b_free_data(bench_input *in)
+{
+    free_data(in->dres_data);
+    in->dres_data.X.data = in->dres_data.y.data = 0;
+}
+
+static bench_case cases[] = {
+    {"get_pixel", IMG, 0, 0, b_get_pixel},
+    {"set_pixel", IMG, 0, prep_copy, b_set_pixel},
+    {"copy_image", IMG, 0, 0, b_copy_image},
+    {"rgb_to_grayscale", IMG, 3, 0, b_rgb_to_grayscale},
+    {"rgb_to_hsv", IMG, 3, prep_copy, b_rgb_to_hsv},
+    {"hsv_to_rgb", IMG, 3, prep_copy, b_hsv_to_rgb},
+    {"shift_image", IMG, 0, prep_copy, b_shift_image},
+    {"clamp_image", IMG, 0, prep_copy, b_clamp_image},
+    {"same_image", IMG, 0, prep_copy, b_same_image},
+    {"sub_image", IMG, 0, 0, b_sub_image},
+    {"add_image", IMG, 0, 0, b_add_image},
+    {"make_image", IMG, 0, 0, b_make_image},
+    {"load_image", IMG, 0, prep_png, b_load_image},
+    {"save_image", IMG, 0, 0, b_save_image},
+    {"save_png", IMG, 0, 0, b_save_png},
+    {"save_image_binary", IMG, 0, 0, b_save_image_binary},
+    {"load_image_binary", IMG, 0, prep_binary, b_load_image_binary},
+    {"load_images", ONCE, 0, 0, b_load_images},
+    {"save_images", ONCE, 0, prep_rainier, b_save_images},
+    {"load_image_u8", IMG, 0, prep_png, b_load_image_u8},
+    {"load_images_u8", ONCE, 0, 0, b_load_images_u8},
+    {"image_u8_to_float", IMG, 0, prep_u8, b_image_u8_to_float},
+    {"image_to_u8", IMG, 0, 0, b_image_to_u8},
+    {"nn_resize_u8", IMG, 0, prep_u8, b_nn_resize_u8},
+    {"bilinear_resize_u8", IMG, 0, prep_u8, b_bilinear_resize_u8},
+    {"rgb_to_grayscale_u8", IMG, 3, prep_u8, b_rgb_to_grayscale_u8},
+    {"map_image_binary", IMG, 0, prep_binary, b_map_image_binary},
+    {"free_image", IMG, 0, prep_copy, b_free_image},
+    {"nn_interpolate", IMG, 0, 0, b_nn_interpolate},
+    {"nn_resize", IMG, 0, 0, b_nn_resize},
+    {"bilinear_interpolate", IMG, 0, 0, b_bilinear_interpolate},
+    {"bilinear_resize", IMG, 0, 0, b_bilinear_resize},
+    {"convolve_image", IMG, 0, 0, b_convolve_image},
+    {"make_box_filter", ONCE, 0, 0, b_make_box_filter},
+    {"make_highpass_filter", ONCE, 0, 0, b_make_highpass_filter},
+    {"make_sharpen_filter", ONCE, 0, 0, b_make_sharpen_filter},
+    {"make_emboss_filter", ONCE, 0, 0, b_make_emboss_filter},
+    {"make_gaussian_filter", ONCE, 0, 0, b_make_gaussian_filter},
+    {"make_gx_filter", ONCE, 0, 0, b_make_gx_filter},
+    {"make_gy_filter", ONCE, 0, 0, b_make_gy_filter},
+    {"feature_normalize", IMG, 0, prep_copy, b_feature_normalize},
+    {"l1_normalize", IMG, 0, prep_copy, b_l1_normalize},
+    {"sobel_image", IMG, 0, 0, b_sobel_image},
+    {"colorize_sobel", IMG, 3, 0, b_colorize_sobel},
+    {"smooth_image", IMG, 0, 0, b_smooth_image},
+    {"smooth_image_box", IMG, 0, 0, b_smooth_image_box},
+    {"smooth_image_iir", IMG, 0, 0, b_smooth_image_iir},
+    {"make_point", ONCE, 0, 0, b_make_point},
+    {"project_point", ONCE, 0, 0, b_project_point},
+    {"compute_homography", ONCE, 0, 0, b_compute_homography},
+    {"structure_matrix", IMG, 0, 0, b_structure_matrix},
+    {"cornerness_response", IMG, 0, 0, b_cornerness_response},
+    {"nms_image", IMG, 0, prep_response, b_nms_image},
+    {"nms_corners", IMG, 0, prep_response, b_nms_corners},
+    {"harris_corners", IMG, 0, 0, b_harris_corners},
+    {"harris_corners_top", IMG, 0, 0, b_harris_corners_top},
+    {"harris_corner_detector_top", IMG, 0, 0, b_harris_corner_detector_top},
+    {"free_descriptors", IMG, 0, prep_corners, b_free_descriptors},
+    {"describe_corners", IMG, 0, 0, b_describe_corners},
+    {"harris_corner_set", IMG, 0, 0, b_harris_corner_set},
+    {"make_1d_gaussian", ONCE, 0, 0, b_make_1d_gaussian},
+    {"make_remap_table", IMG, 0, 0, b_make_remap_table},
+    {"remap_image", IMG, 0, prep_remap_table, b_remap_image},
+    {"cylindrical_project", IMG, 0, 0, b_cylindrical_project},
+    {"spherical_project", IMG, 0, 0, b_spherical_project},
+    {"undistort_image", IMG, 0, 0, b_undistort_image},
+    {"mark_corners", IMG, 3, prep_copy, b_mark_corners},
+    {"find_and_draw_matches", PAIR, 3, 0, b_find_and_draw_matches},
+    {"detect_and_draw_corners", IMG, 3, prep_copy, b_detect_and_draw_corners},
+    {"model_inliers", PAIR, 0, 0, b_model_inliers},
+    {"RANSAC", PAIR, 0, 0, b_RANSAC},
+    {"combine_images", PAIR, 0, 0, b_combine_images},
+    {"combine_feather", PAIR, 0, 0, b_combine_feather},
+    {"combine_multiband", PAIR, 0, 0, b_combine_multiband},
+    {"match_descriptors", PAIR, 0, 0, b_match_descriptors},
+    {"match_descriptors_kdforest", PAIR, 0, 0, b_match_descriptors_kdforest},
+    {"query_descriptor_index", PAIR, 0, 0, b_query_descriptor_index},
+    {"query_descriptor_index_kdforest", PAIR, 0, 0, b_query_descriptor_index_kdforest},
+    {"harris_corner_detector", IMG, 0, 0, b_harris_corner_detector},
+    {"panorama_image", PAIR, 0, 0, b_panorama_image},
+    {"panorama_chain", ONCE, 0, prep_rainier, b_panorama_chain},
+    {"panorama_images", ONCE, 0, prep_rainier, b_panorama_images},
+    {"panorama_homographies", ONCE, 0, prep_rainier, b_panorama_homographies},
+    {"composite_images", ONCE, 0, prep_rainier_H, b_composite_images},
+    {"composite_multiband", ONCE, 0, prep_rainier_H, b_composite_multiband},
+    {"make_integral_image", IMG, 0, 0, b_make_integral_image},
+    {"box_filter_image", IMG, 0, 0, b_box_filter_image},
+    {"box_filter_image_u8", IMG, 0, prep_u8, b_box_filter_image_u8},
+    {"time_structure_matrix", PAIR, 0, 0, b_time_structure_matrix},
+    {"velocity_image", PAIR, 0, 0, b_velocity_image},
+    {"velocity_confidence_image", PAIR, 0, 0, b_velocity_confidence_image},
+    {"optical_flow_images", PAIR, 0, 0, b_optical_flow_images},
+    {"pyramid_down", IMG, 0, 0, b_pyramid_down},
+    {"make_flow_pyramid", IMG, 0, 0, b_make_flow_pyramid},
+    {"optical_flow_pyramid", PAIR, 0, 0, b_optical_flow_pyramid},
+    {"flow_session_next", PAIR, 0, prep_flow_session, b_flow_session_next},
+    {"draw_flow", PAIR, 3, prep_copy, b_draw_flow},
+    {"load_classification_data", ONCE, 0, 0, b_load_classification_data},
+    {"free_data", MAT, 0, prep_data, b_free_data},
+    {"random_batch", MAT, 0, 0, b_random_batch},
+    {"fgetl", ONCE, 0, 0, b_fgetl},
+    {"open_dataset", ONCE, 0, 0, b_open_dataset},
+    {"next_batch", ONCE, 0, prep_dataset, b_next_batch},
+    {"activate_matrix", MAT, 0, prep_matrix, b_activate_matrix},
+    {"gradient_matrix", MAT, 0, prep_matrix, b_gradient_matrix},
+    {"forward_layer", MAT, 0, 0, b_forward_layer},
+    {"backward_layer", MAT, 0, prep_matrix, b_backward_layer},
+    {"update_layer", MAT, 0, 0, b_update_layer},
+    {"make_layer", MAT, 0, 0, b_make_layer},
+    {"load_matrix", MAT, 0, prep_matrix_file, b_load_matrix},
+    {"save_matrix", MAT, 0, 0, b_save_matrix},
+    {"make_identity_homography", ONCE, 0, 0, b_make_identity_homography},
+    {"make_translation_homography", ONCE, 0, 0, b_make_translation_homography},
+    {"free_matrix", MAT, 0, prep_matrix, b_free_matrix},
+    {"mag_matrix", MAT, 0, 0, b_mag_matrix},
+    {"make_matrix", MAT, 0, 0, b_make_matrix},
+    {"copy_matrix", MAT, 0, 0, b_copy_matrix},
+    {"sle_solve", MAT, 0, prep_matrix, b_sle_solve},
+    {"matrix_mult_matrix", MAT, 0, 0, b_matrix_mult_matrix},
+    {"matrix_mult_transpose", MAT, 0, 0, b_matrix_mult_transpose},
+    {"transpose_mult_matrix", MAT, 0, 0, b_transpose_mult_matrix},
+    {"fmatrix_mult_fmatrix", MAT, 0, 0, b_fmatrix_mult_fmatrix},
+    {"fmatrix_mult_transpose", MAT, 0, 0, b_fmatrix_mult_transpose},
+    {"transpose_mult_fmatrix", MAT, 0, 0, b_transpose_mult_fmatrix},
+    {"matrix_elmult_matrix", MAT, 0, 0, b_matrix_elmult_matrix},
+    {"solve_system", MAT, 0, 0, b_solve_system},
+    {"matrix_invert", MAT, 0, 0, b_matrix_invert},
+    {"random_matrix", MAT, 0, 0, b_random_matrix},
+    {"transpose_matrix", MAT, 0, 0, b_transpose_matrix},
+    {"axpy_matrix", MAT, 0, 0, b_axpy_matrix},
+};
+
+// Frees whatever a rep left behind.
+static void bench_cleanup(bench_input *in)
+{
+    release_image(in->res);     // can be a mapped view or a disk canvas
+    free_image(in->tmp);
+    free_matrix(in->mres);
+    free_matrix(in->mtmp);
+    free(in->ptr);
+    if (in->dres) free_descriptors(in->dres, in->dres_n);
+    free_data(in->dres_data);
+    free_fmatrix(in->fres);
+    free_descriptor_set(in->sres);
+    free_remap_table(in->rtab);
+    if (in->ds) close_dataset(in->ds);
+    if (in->fp.levels) free_flow_pyramid(in->fp);
+    free_flow_session(in->fs);
+    free_image_u8(in->u8);
+    free_image_u8(in->u8res);
+    memset(&in->res, 0, sizeof(image));
+    memset(&in->tmp, 0, sizeof(image));
+    memset(&in->mres, 0, sizeof(matrix));
+    memset(&in->mtmp, 0, sizeof(matrix));
+    memset(&in->dres_data, 0, sizeof(data));
+    memset(&in->fres, 0, sizeof(fmatrix));
+    memset(&in->sres, 0, sizeof(descriptor_set));
+    memset(&in->fp, 0, sizeof(flow_pyramid));
+    memset(&in->u8, 0, sizeof(image_u8));
+    memset(&in->u8res, 0, sizeof(image_u8));
+    in->rtab = 0;
+    in->ds = 0;
+    in->fs = 0;
+    in->ptr = 0;
+    in->dres = 0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(double *)a, y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct{
+    int reps;
+    double budget;
+    const char *only;
+    FILE *out;
+    int count;
+} bench_opts;
+
+// Times one case and prints its JSON record.
+static void run_case(bench_case *bc, bench_input *in, const char *source, bench_opts *o)
+{
+    if (o->only && !strstr(bc->name, o->only)) return;
+    // RANSAC needs at least 4 matches to fit a homography
+    if (bc->run == b_panorama_image && in->mn < 4) return;
+    double *t = calloc(o->reps, sizeof(double));
+    int n = 0;
+    double spent = 0;
+    reset_peak_rss();
+    while (n < o->reps && (n < 1 || spent < o->budget)) {
+        if (bc->prep) bc->prep(in);
+        double start = now();
+        bc->run(in);
+        t[n] = now() - start;
+        spent += t[n++];
+        bench_cleanup(in);
+    }
+    long rss = peak_rss_kb();
+    qsort(t, n, sizeof(double), compare_double);
+    double median = n % 2 ? t[n/2] : (t[n/2 - 1] + t[n/2]) / 2;
+    double p99 = t[(int)ceil(.99 * n) - 1];
+
+    fprintf(o->out, "%s\n    {\"name\": \"%s\", \"input\": \"%s\", ", o->count++ ? "," : "", bc->name, source);
+    if (bc->kind == MAT) {
+        double elems = (double)in->a.rows * in->a.cols;
+        fprintf(o->out, "\"rows\": %d, \"cols\": %d, ", in->a.rows, in->a.cols);
+        fprintf(o->out, "\"reps\": %d, \"median_ms\": %.6f, \"p99_ms\": %.6f, ", n, median*1e3, p99*1e3);
+        fprintf(o->out, "\"throughput\": %.3f, \"units\": \"Melem/s\", ", elems / median / 1e6);
+    } else if (bc->kind == ONCE) {
+        fprintf(o->out, "\"reps\": %d, \"median_ms\": %.6f, \"p99_ms\": %.6f, ", n, median*1e3, p99*1e3);
+        fprintf(o->out, "\"throughput\": %.3f, \"units\": \"calls/s\", ", 1 / median);
+    } else {
+        double pixels = (double)in->im.w * in->im.h;
+        fprintf(o->out, "\"w\": %d, \"h\": %d, \"c\": %d, ", in->im.w, in->im.h, in->im.c);
+        fprintf(o->out, "\"reps\": %d, \"median_ms\": %.6f, \"p99_ms\": %.6f, ", n, median*1e3, p99*1e3);
+        fprintf(o->out, "\"throughput\": %.3f, \"units\": \"Mpx/s\", ", pixels / median / 1e6);
+    }
+    fprintf(o->out, "\"peak_rss_kb\": %ld}", rss);
+    fflush(o->out);
+    fprintf(stderr, "%-28s %-22s %10.3f ms\n", bc->name, source, median*1e3);
+    free(t);
+}
+
+static void run_kind(bench_kind kind, int channels, bench_input *in, const char *source, bench_opts *o)
+{
+    int i;
+    for (i = 0; i < sizeof(cases)/sizeof(cases[0]); ++i) {
+        if (cases[i].kind != kind) continue;
+        if (cases[i].channels && cases[i].channels != channels) continue;
+        run_case(cases + i, in, source, o);
+    }
+}
+
+// Runs the image and image pair cases on im and its shifted copy im2.
+static void run_images(image im, image im2, const char *source, bench_opts *o)
+{
+    bench_input in = {0};
+    int i;
+    in.im = im;
+    in.im2 = im2;
+    in.filter = make_gaussian_filter(2);
+    in.S = structure_matrix(im, 2);
+    in.S5 = time_structure_matrix(im2, im, 15);
+    in.v = optical_flow_images(im2, im, 15, 8);
+    in.d = harris_corner_detector(im, 2, 5, 3, &in.dn);
+    in.d2 = harris_corner_detector(im2, 2, 5, 3, &in.dn2);
+    in.m = match_descriptors(in.d, in.dn, in.d2, in.dn2, &in.mn);
+    in.ci = calloc(in.dn, sizeof(int));
+    for (i = 0; i < in.dn; ++i) in.ci[i] = in.d[i].p.x + in.d[i].p.y*im.w;
+    in.ix = make_descriptor_index(in.d2, in.dn2, INDEX_EXACT);
+    in.kd = make_descriptor_index(in.d2, in.dn2, INDEX_KDFOREST);
+    in.H = make_translation_homography(im.w / 8, 0);
+    char dir[] = "/tmp/uwimg_benchXXXXXX";
+    in.dir = mkdtemp(dir) ? dir : "/tmp";
+
+    run_kind(IMG, im.c, &in, source, o);
+    run_kind(PAIR, im.c, &in, source, o);
+
+    char buff[300];
+    sprintf(buff, "rm -rf %s", dir);
+    if (in.dir == dir && system(buff)) fprintf(stderr, "could not remove %s\n", dir);
+    free_image(in.filter);
+    free_image(in.S);
+    free_image(in.S5);
+    free_image(in.v);
+    free_descriptors(in.d, in.dn);
+    free_descriptors(in.d2, in.dn2);
+    free(in.m);
+    free(in.ci);
+    free_descriptor_index(in.ix);
+    free_descriptor_index(in.kd);
+    free_matrix(in.H);
+}
+
+static void run_matrices(int n, bench_opts *o)
+{
+    char source[64];
+    char dir[] = "/tmp/uwimg_benchXXXXXX";
+    bench_input in = {0};
+    in.dir = mkdtemp(dir) ? dir : "/tmp";
+    in.a = random_matrix(n, n, 1);
+    in.b = random_matrix(n, n, 1);
+    in.fa = matrix_to_fmatrix(in.a);
+    in.fb = matrix_to_fmatrix(in.b);
+    in.l = make_layer(n, n, RELU);
+    in.dat.X = in.a;
+    in.dat.y = in.b;
+    forward_layer(&in.l, in.a);
+    sprintf(source, "random %dx%d", n, n);
+    run_kind(MAT, 0, &in, source, o);
+
+    char buff[300];
+    sprintf(buff, "rm -rf %s", dir);
+    if (in.dir == dir && system(buff)) fprintf(stderr, "could not remove %s\n", dir);
+    free_matrix(in.a);
+    free_matrix(in.b);
+    free_fmatrix(in.fa);
+    free_fmatrix(in.fb);
+    free_matrix(in.l.w);
+    free_matrix(in.l.v);
+    free_matrix(in.l.dw);
+    free_matrix(in.l.out);
+}
+
+// Writes a tiny labeled dataset for load_classification_data and fgetl.
+static void run_once(bench_opts *o)
+{
+    char dir[] = "/tmp/uwimg_benchXXXXXX";
+    char buff[300];
+    int i;
+    bench_input in = {0};
+    if (!mkdtemp(dir)) return;
+    in.dir = dir;
+    sprintf(buff, "%s/images.list", dir);
+    FILE *fp = fopen(buff, "w");
+    for (i = 0; fp && i < 16; ++i) fprintf(fp, "data/dogsmall.jpg\n");
+    if (fp) fclose(fp);
+    sprintf(buff, "%s/labels.list", dir);
+    fp = fopen(buff, "w");
+    if (fp) {
+        fprintf(fp, "dog\ncat\n");
+        fclose(fp);
+    }
+    run_kind(ONCE, 0, &in, "none", o);
+    sprintf(buff, "rm -rf %s", dir);
+    if (system(buff)) fprintf(stderr, "could not remove %s\n", dir);
+}
+
+// Parses a comma separated list of ints.
+// returns: number of ints read into v, at most max.
+static int parse_sizes(const char *s, int *v, int max)
+{
+    int n = 0;
+    while (s && *s && n < max) {
+        v[n] = atoi(s);
+        if (v[n] > 0) ++n;
+        s = strchr(s, ',');
+        if (s) ++s;
+    }
+    return n;
+}
+
+void run_benchmarks(int argc, char **argv)
+{
+    int sizes[16], msizes[16];
+    int i, c;
+    bench_opts o;
+    int nsizes = parse_sizes(find_char_arg(argc, argv, "-sizes", "128,512"), sizes, 16);
+    int nmsizes = parse_sizes(find_char_arg(argc, argv, "-msizes", "32,128"), msizes, 16);
+    char *out = find_char_arg(argc, argv, "-out", 0);
+    o.reps = find_int_arg(argc, argv, "-reps", 11);
+    o.budget = find_float_arg(argc, argv, "-budget", 2);
+    o.only = find_char_arg(argc, argv, "-only", 0);
+    o.out = out ? fopen(out, "w") : stdout;
+    o.count = 0;
+    if (!o.out) {
+        fprintf(stderr, "Couldn't open file %s\n", out);
+        return;
+    }
+    if (o.reps < 1) o.reps = 1;
+
+    fprintf(o.out, "{\n  \"threads\": %d,\n  \"tile_size\": %d,\n  \"skipped\": [", get_num_threads(), get_tile_size());
+    for (i = 0; i < sizeof(skipped)/sizeof(skipped[0]); ++i) {
+        fprintf(o.out, "%s\"%s\"", i ? ", " : "", skipped[i]);
+    }
+    fprintf(o.out, "],\n  \"results\": [");
+
+    run_once(&o);
+    for (c = 1; c <= 3; c += 2) {
+        for (i = 0; i < nsizes; ++i) {
+            image a = make_synthetic_image(sizes[i], sizes[i], c, 0);
+            image b = make_synthetic_image(sizes[i], sizes[i], c, sizes[i] / 8);
+            run_images(a, b, "synthetic", &o);
+            free_image(a);
+            free_image(b);
+        }
+        image a = load_bench_image("data/Rainier1.png", c);
+        image b = load_bench_image("data/Rainier2.png", c);
+        run_images(a, b, "data/Rainier1.png", &o);
+        free_image(a);
+        free_image(b);
+    }
+    for (i = 0; i < nmsizes; ++i) run_matrices(msizes[i], &o);
+
+    fprintf(o.out, "\n  ]\n}\n");
+    if (out) fclose(o.out);
+}
@@ -0,0 +1,6 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+void run_benchmarks(int argc, char **argv);
+
+#endif
@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "binfile.h"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// FNV-1a over 32 bit little endian words, then any trailing bytes. Word
+// steps are four times cheaper than bytes. Payloads are whole float or
+// double elements, so a payload written in several bin_write calls hashes
+// the same as in one.
+uint64_t bin_checksum(uint64_t sum, const void *p, size_t n)
+{
+    const unsigned char *b = p;
+    size_t i;
+    for(i = 0; i + 4 <= n; i += 4){
+        uint32_t w;
+        memcpy(&w, b + i, 4);
+        sum ^= w;
+        sum *= FNV_PRIME;
+    }
+    for(; i < n; ++i){
+        sum ^= b[i];
+        sum *= FNV_PRIME;
+    }
+    return sum;
+}
+
+// Writes a placeholder header and pads up to the payload. The real header
+// goes in once the payload is done and the checksum is known.
+// returns: 1 on success, 0 if the file can't be opened.
+int bin_open_write(bin_writer *w, const char *fname, bin_dtype dtype, int ndim, const int *dims)
+{
+    int i;
+    memset(&w->h, 0, sizeof(w->h));
+    w->fp = fopen(fname, "wb");
+    if(!w->fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return 0;
+    }
+    memcpy(w->h.magic, BIN_MAGIC, 8);
+    w->h.version = BIN_VERSION;
+    w->h.dtype = dtype;
+    w->h.ndim = ndim;
+    for(i = 0; i < ndim; ++i) w->h.dims[i] = dims[i];
+    w->h.flags = BIN_CHECKSUM;
+    w->h.data_offset = BIN_ALIGN;
+    w->h.checksum = FNV_OFFSET;
+
+    char pad[BIN_ALIGN] = {0};
+    fwrite(pad, 1, BIN_ALIGN, w->fp);
+    return 1;
+}
+
+void bin_write(bin_writer *w, const void *p, size_t n)
+{
+    fwrite(p, 1, n, w->fp);
+    w->h.data_bytes += n;
+    w->h.checksum = bin_checksum(w->h.checksum, p, n);
+}
+
+// returns: 1 if everything reached the file.
+int bin_close_write(bin_writer *w)
+{
+    fseek(w->fp, 0, SEEK_SET);
+    fwrite(&w->h, sizeof(w->h), 1, w->fp);
+    int ok = !ferror(w->fp);
+    ok = (fclose(w->fp) == 0) && ok;
+    return ok;
+}
+
+// Checks a header against the size of the file it came from.
+static int check_header(const bin_header *h, size_t size)
+{
+    if(memcmp(h->magic, BIN_MAGIC, 8)) return 0;
+    if(h->version > BIN_VERSION){
+        fprintf(stderr, "Binary file version %u is newer than supported %d\n", h->version, BIN_VERSION);
+        return 0;
+    }
+    if(h->data_offset < sizeof(bin_header) || h->data_offset > size || h->data_bytes > size - h->data_offset){
+        fprintf(stderr, "Binary file is truncated\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Reads a header out of the first bytes of a file.
+// returns: 1 for a valid header, 0 for anything else, e.g. a legacy file.
+int bin_parse_header(const void *buf, size_t size, bin_header *h)
+{
+    if(size < sizeof(bin_header)) return 0;
+    memcpy(h, buf, sizeof(bin_header));
+    return check_header(h, size);
+}
+
+// Like bin_parse_header for an open file. Leaves fp at the payload when
+// there is a header and back at the start otherwise.
+int bin_read_header(FILE *fp, bin_header *h)
+{
+    struct stat st;
+    if(fread(h, 1, sizeof(bin_header), fp) == sizeof(bin_header)
+            && fstat(fileno(fp), &st) == 0 && check_header(h, st.st_size)){
+        fseek(fp, h->data_offset, SEEK_SET);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_SET);
+    return 0;
+}
+
+// returns: 1 if the payload matches the stored checksum or there is none.
+int bin_verify(const bin_header *h, const void *payload)
+{
+    if(!(h->flags & BIN_CHECKSUM)) return 1;
+    if(bin_checksum(FNV_OFFSET, payload, h->data_bytes) == h->checksum) return 1;
+    fprintf(stderr, "Binary file checksum mismatch\n");
+    return 0;
+}
+
+// Live mappings, so bin_release can find a view's whole mapping.
+typedef struct mapping{
+    char *addr;
+    size_t size;
+    struct mapping *next;
+} mapping;
+
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static mapping *maps = 0;
+
+static void add_mapping(void *addr, size_t size)
+{
+    mapping *m = malloc(sizeof(mapping));
+    m->addr = addr;
+    m->size = size;
+    pthread_mutex_lock(&map_lock);
+    m->next = maps;
+    maps = m;
+    pthread_mutex_unlock(&map_lock);
+}
+
+// Maps a whole file copy-on-write: views can be modified in memory but
+// the file never changes. Pages load on first touch.
+// size_t *size: set to the file size.
+// returns: start of the mapping, or 0 on failure.
+void *bin_map(const char *fname, size_t *size)
+{
+    struct stat st;
+    int fd = open(fname, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return 0;
+    }
+    if(fstat(fd, &st) || st.st_size == 0){
+        close(fd);
+        return 0;
+    }
+    void *addr = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED){
+        fprintf(stderr, "Couldn't map file %s\n", fname);
+        return 0;
+    }
+
+    add_mapping(addr, st.st_size);
+    *size = st.st_size;
+    return addr;
+}
+
+// Maps size zeroed bytes backed by an unlinked temporary file in $TMPDIR
+// or /tmp, for buffers bigger than memory. Dirty pages are written back
+// to the file under memory pressure or by bin_evict. bin_release unmaps
+// it and the file goes away with the mapping.
+// returns: start of the mapping, or 0 on failure.
+void *bin_map_scratch(size_t size)
+{
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/uwimg_XXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if(fd < 0){
+        fprintf(stderr, "Couldn't create scratch file %s\n", path);
+        return 0;
+    }
+    unlink(path);
+    if(size == 0 || ftruncate(fd, size)){
+        fprintf(stderr, "Couldn't size scratch file to %zu bytes\n", size);
+        close(fd);
+        return 0;
+    }
+    void *addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED){
+        fprintf(stderr, "Couldn't map scratch file\n");
+        return 0;
+    }
+    add_mapping(addr, size);
+    return addr;
+}
+
+// Writes the whole pages in [p, p + n) of a scratch mapping back to its
+// file and drops them from memory. They read back from the file if
+// touched again.
+void bin_evict(void *p, size_t n)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t lo = ((uintptr_t)p + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t)p + n) & ~(page - 1);
+    if(hi <= lo) return;
+    msync((void *)lo, hi - lo, MS_SYNC);
+    madvise((void *)lo, hi - lo, MADV_DONTNEED);
+}
+
+// Unmaps the mapping that p points into, if any. Only release_image and
+// release_matrix call this, free_image and free_matrix never search.
+// returns: 1 if p was inside a mapping, 0 if it is ordinary memory.
+int bin_release(void *p)
+{
+    if(!p) return 0;
+    char *c = p;
+    mapping **link, *m = 0;
+    pthread_mutex_lock(&map_lock);
+    for(link = &maps; *link; link = &(*link)->next){
+        if(c >= (*link)->addr && c < (*link)->addr + (*link)->size){
+            m = *link;
+            *link = m->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+    if(!m) return 0;
+    munmap(m->addr, m->size);
+    free(m);
+    return 1;
+}
@@ -0,0 +1,60 @@
+#ifndef BINFILE_H
+#define BINFILE_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Versioned container for raw image and matrix dumps.
+//
+// A file is a 64 byte bin_header followed by the payload at data_offset,
+// which is a multiple of BIN_ALIGN so a mapped file can be used in place.
+// The payload is dense, row-major, little endian elements of dtype:
+// images store c planes of h rows of w floats, matrices rows of cols
+// doubles. dims holds (w, h, c) for images and (rows, cols) for matrices.
+// Files written before the header existed start straight with the int
+// dimensions; the loaders and mappers still accept those.
+
+#define BIN_MAGIC "UWIMGBIN"
+#define BIN_VERSION 1
+#define BIN_ALIGN 64
+
+// flags
+#define BIN_CHECKSUM 1      // checksum is bin_checksum of the payload
+
+typedef enum{
+    BIN_F32 = 1, BIN_F64 = 2
+} bin_dtype;
+
+typedef struct{
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t ndim;
+    uint32_t dims[4];
+    uint32_t flags;
+    uint64_t data_offset;
+    uint64_t data_bytes;
+    uint64_t checksum;
+} bin_header;
+
+// Streams a payload out behind a header, checksumming as it goes.
+typedef struct{
+    FILE *fp;
+    bin_header h;
+} bin_writer;
+
+int bin_open_write(bin_writer *w, const char *fname, bin_dtype dtype, int ndim, const int *dims);
+void bin_write(bin_writer *w, const void *p, size_t n);
+int bin_close_write(bin_writer *w);
+
+int bin_parse_header(const void *buf, size_t size, bin_header *h);
+int bin_read_header(FILE *fp, bin_header *h);
+uint64_t bin_checksum(uint64_t sum, const void *p, size_t n);
+int bin_verify(const bin_header *h, const void *payload);
+
+void *bin_map(const char *fname, size_t *size);
+int bin_release(void *p);
+void *bin_map_scratch(size_t size);
+void bin_evict(void *p, size_t n);
+
+#endif
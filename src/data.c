@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
 #include "image.h"
 #include "list.h"
 
@@ -43,17 +44,87 @@ list *get_lines(char *filename)
     return lines;
 }
 
+// Hash of the label names so a path's label is found without trying
+// every label in turn.
+typedef struct{
+    int k;
+    char **names;
+    int size;       // Power of two, at least twice k
+    int *slot;      // Label index + 1, 0 when empty
+} label_index;
+
+static unsigned hash_label(const char *s, int n)
+{
+    unsigned h = 2166136261u;
+    int i;
+    for(i = 0; i < n; ++i) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+static label_index make_label_index(char **names, int k)
+{
+    label_index li = {k, names, 2, 0};
+    while(li.size < 2*k) li.size *= 2;
+    li.slot = calloc(li.size, sizeof(int));
+    int i;
+    for(i = 0; i < k; ++i){
+        unsigned h = hash_label(names[i], strlen(names[i])) & (li.size-1);
+        while(li.slot[h]) h = (h + 1) & (li.size-1);
+        li.slot[h] = i + 1;
+    }
+    return li;
+}
+
+static void free_label_index(label_index li)
+{
+    int i;
+    for(i = 0; i < li.k; ++i) free(li.names[i]);
+    free(li.names);
+    free(li.slot);
+}
+
+// Sets the one-hot label for an image path. The label is normally the
+// last '_' separated token of the file name ("cifar/train/12_cat.png" is
+// "cat"), which is one hash lookup. Paths that don't follow that pattern
+// fall back to marking every label that appears anywhere in the path.
+// li: labels to look in
+// path: image path
+// y: row of li.k zeros to fill in
+static void set_label(label_index li, const char *path, double *y)
+{
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    const char *token = strrchr(name, '_');
+    token = token ? token + 1 : name;
+    const char *end = strchr(token, '.');
+    int n = end ? end - token : (int)strlen(token);
+
+    unsigned h = hash_label(token, n) & (li.size-1);
+    while(li.slot[h]){
+        char *label = li.names[li.slot[h]-1];
+        if(strncmp(label, token, n) == 0 && label[n] == '\0'){
+            y[li.slot[h]-1] = 1;
+            return;
+        }
+        h = (h + 1) & (li.size-1);
+    }
+    int i;
+    for(i = 0; i < li.k; ++i){
+        if(strstr(path, li.names[i])) y[i] = 1;
+    }
+}
+
 data load_classification_data(char *images, char *label_file, int bias)
 {
     list *image_list = get_lines(images);
     list *label_list = get_lines(label_file);
     int k = label_list->size;
-    char **labels = (char **)list_to_array(label_list);
+    label_index labels = make_label_index((char **)list_to_array(label_list), k);
+    free_list(label_list);
 
     int n = image_list->size;
     node *nd = image_list->front;
     int cols = 0;
-    int i;
     int count = 0;
     matrix X;
     matrix y = make_matrix(n, k);
@@ -64,26 +135,278 @@ data load_classification_data(char *images, char *label_file, int bias)
             cols = im.w*im.h*im.c;
             X = make_matrix(n, cols + (bias != 0));
         }
+        int i;
         for (i = 0; i < cols; ++i){
             X.data[count][i] = im.data[i];
         }
         if(bias) X.data[count][cols] = 1;
+        free_image(im);
 
-        for (i = 0; i < k; ++i){
-            if(strstr(path, labels[i])){
-                y.data[count][i] = 1;
-            }
-        }
+        set_label(labels, path, y.data[count]);
         ++count;
         nd = nd->next;
     }
+    free_list_contents(image_list);
     free_list(image_list);
+    free_label_index(labels);
     data d;
     d.X = X;
     d.y = y;
     return d;
 }
 
+// Streaming datasets: decode threads fill a ring of mini-batches while
+// the caller trains on the ones already decoded. Batch b holds rows
+// b*batch ... (b+1)*batch-1 of an endless sequence of epochs, so which
+// images land in which batch only depends on the seed, never on timing.
+
+// States of an image's slot in the uint8 cache.
+enum{
+    CACHE_EMPTY, CACHE_READY, CACHE_FILLING
+};
+
+struct dataset{
+    char **paths;
+    int n;
+    int cols;               // Pixels per image
+    int bias;
+    label_index labels;
+    dataset_opts opts;
+
+    unsigned char *pixels;  // n*cols decoded pixels when opts.cache_u8
+    unsigned char *cached;  // CACHE_* state of each image in pixels
+
+    data *ring;
+    int *ready;
+    long next_claim;        // Next batch a decode thread will make
+    long next_take;         // Next batch next_batch will hand out
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t freed;
+    pthread_t *threads;
+};
+
+static unsigned mix32(unsigned x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Position i of a random permutation of [0, n) picked by key. A small
+// Feistel network permutes the enclosing power of four and indices that
+// land outside [0, n) are walked forward until they fall inside, so no
+// permutation table is needed.
+static int permute_index(int i, int n, unsigned key)
+{
+    int half = 1;
+    while((1L << 2*half) < n) ++half;
+    unsigned mask = (1u << half) - 1;
+    unsigned x = i;
+    do{
+        unsigned l = x >> half;
+        unsigned r = x & mask;
+        int round;
+        for(round = 0; round < 4; ++round){
+            unsigned t = l ^ (mix32(r ^ (key + round*0x9e3779b9u)) & mask);
+            l = r;
+            r = t;
+        }
+        x = (l << half) | r;
+    } while(x >= (unsigned)n);
+    return x;
+}
+
+// Fills row with the pixels of image i, from the uint8 cache if it has it.
+// Decode threads claim an image's cache slot before filling it, so two
+// threads that miss on the same image never write its pixels together;
+// the one that loses the claim just decodes into its row. Images that
+// can't be read leave their row zero, rather than ending the process from
+// a decode thread.
+static void load_row(dataset *d, int i, double *row)
+{
+    int j;
+    unsigned char empty = CACHE_EMPTY;
+    if(d->pixels && __atomic_load_n(&d->cached[i], __ATOMIC_ACQUIRE) == CACHE_READY){
+        unsigned char *p = d->pixels + (size_t)i*d->cols;
+        for(j = 0; j < d->cols; ++j) row[j] = (float)(p[j]/255.);
+        return;
+    }
+    int fill = d->pixels && __atomic_compare_exchange_n(&d->cached[i], &empty, CACHE_FILLING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    image_u8 im = load_image_u8(d->paths[i]);
+    int size = im.w*im.h*im.c;
+    if(size != d->cols){
+        fprintf(stderr, "Image %s has %d values, expected %d\n", d->paths[i], size, d->cols);
+        if(size > d->cols) size = d->cols;
+    }
+    for(j = 0; j < size; ++j) row[j] = (float)(im.data[j]/255.);
+    for(; j < d->cols; ++j) row[j] = 0;
+    if(fill){
+        if(size == d->cols) memcpy(d->pixels + (size_t)i*d->cols, im.data, size);
+        __atomic_store_n(&d->cached[i], size == d->cols ? CACHE_READY : CACHE_EMPTY, __ATOMIC_RELEASE);
+    }
+    free_image_u8(im);
+}
+
+static data make_batch(dataset *d, long b)
+{
+    int batch = d->opts.batch;
+    data out;
+    out.X = make_matrix(batch, d->cols + (d->bias != 0));
+    out.y = make_matrix(batch, d->labels.k);
+    int r;
+    for(r = 0; r < batch; ++r){
+        long p = b*batch + r;
+        long epoch = p / d->n;
+        int i = p % d->n;
+        if(d->opts.shuffle){
+            unsigned key = mix32(d->opts.seed ^ mix32((unsigned)epoch + 1));
+            i = permute_index(i, d->n, key);
+        }
+        load_row(d, i, out.X.data[r]);
+        if(d->bias) out.X.data[r][d->cols] = 1;
+        set_label(d->labels, d->paths[i], out.y.data[r]);
+    }
+    return out;
+}
+
+static void *decode_thread(void *ptr)
+{
+    dataset *d = (dataset *)ptr;
+    int ring = d->opts.ring;
+    pthread_mutex_lock(&d->lock);
+    while(!d->quit){
+        long b = d->next_claim++;
+        // Batch b goes where batch b-ring was, wait for it to be taken.
+        while(!d->quit && b - d->next_take >= ring){
+            pthread_cond_wait(&d->freed, &d->lock);
+        }
+        if(d->quit) break;
+        pthread_mutex_unlock(&d->lock);
+        data out = make_batch(d, b);
+        pthread_mutex_lock(&d->lock);
+        d->ring[b % ring] = out;
+        d->ready[b % ring] = 1;
+        pthread_cond_broadcast(&d->filled);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+dataset_opts default_dataset_opts(int batch)
+{
+    dataset_opts opts;
+    opts.batch = batch;
+    opts.ring = 4;
+    opts.threads = 2;
+    opts.shuffle = 1;
+    opts.seed = 0;
+    opts.cache_u8 = 0;
+    return opts;
+}
+
+dataset *open_dataset(char *images, char *label_file, int bias, dataset_opts opts)
+{
+    list *image_list = get_lines(images);
+    list *label_list = get_lines(label_file);
+    if(!image_list->size){
+        fprintf(stderr, "No images in %s\n", images);
+        free_list(image_list);
+        free_list_contents(label_list);
+        free_list(label_list);
+        return 0;
+    }
+    if(opts.batch < 1) opts.batch = 1;
+    if(opts.ring < 1) opts.ring = 1;
+    if(opts.threads < 1) opts.threads = 1;
+
+    dataset *d = calloc(1, sizeof(dataset));
+    d->n = image_list->size;
+    d->paths = (char **)list_to_array(image_list);
+    d->labels = make_label_index((char **)list_to_array(label_list), label_list->size);
+    d->bias = bias;
+    d->opts = opts;
+    free_list(image_list);
+    free_list(label_list);
+
+    // The first readable image sets the row size
+    image_u8 first = {0};
+    int i;
+    for(i = 0; i < d->n && !first.data; ++i) first = load_image_u8(d->paths[i]);
+    if(!first.data){
+        fprintf(stderr, "No readable images in %s\n", images);
+        for(i = 0; i < d->n; ++i) free(d->paths[i]);
+        free(d->paths);
+        free_label_index(d->labels);
+        free(d);
+        return 0;
+    }
+    d->cols = first.w*first.h*first.c;
+    free_image_u8(first);
+    if(opts.cache_u8){
+        d->pixels = malloc((size_t)d->n*d->cols);
+        d->cached = calloc(d->n, 1);
+    }
+
+    d->ring = calloc(opts.ring, sizeof(data));
+    d->ready = calloc(opts.ring, sizeof(int));
+    pthread_mutex_init(&d->lock, 0);
+    pthread_cond_init(&d->filled, 0);
+    pthread_cond_init(&d->freed, 0);
+    d->threads = calloc(opts.threads, sizeof(pthread_t));
+    for(i = 0; i < opts.threads; ++i){
+        pthread_create(&d->threads[i], 0, decode_thread, d);
+    }
+    return d;
+}
+
+data next_batch(dataset *d)
+{
+    pthread_mutex_lock(&d->lock);
+    int slot = d->next_take % d->opts.ring;
+    while(!d->ready[slot]) pthread_cond_wait(&d->filled, &d->lock);
+    data out = d->ring[slot];
+    d->ready[slot] = 0;
+    ++d->next_take;
+    pthread_cond_broadcast(&d->freed);
+    pthread_mutex_unlock(&d->lock);
+    return out;
+}
+
+int dataset_size(dataset *d)
+{
+    return d->n;
+}
+
+void close_dataset(dataset *d)
+{
+    if(!d) return;
+    pthread_mutex_lock(&d->lock);
+    d->quit = 1;
+    pthread_cond_broadcast(&d->freed);
+    pthread_mutex_unlock(&d->lock);
+    int i;
+    for(i = 0; i < d->opts.threads; ++i) pthread_join(d->threads[i], 0);
+    for(i = 0; i < d->opts.ring; ++i){
+        if(d->ready[i]) free_data(d->ring[i]);
+    }
+    for(i = 0; i < d->n; ++i) free(d->paths[i]);
+    free(d->paths);
+    free_label_index(d->labels);
+    free(d->pixels);
+    free(d->cached);
+    free(d->ring);
+    free(d->ready);
+    free(d->threads);
+    pthread_cond_destroy(&d->filled);
+    pthread_cond_destroy(&d->freed);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
 
 char *fgetl(FILE *fp)
 {
@@ -0,0 +1,154 @@
+// Packed, cache-blocked GEMM, included by matrix.c once per element type.
+// The includer defines:
+//   GEMM_T      element type
+//   GEMM_M      matrix type with rows, cols and GEMM_T **data
+//   GEMM_NR     micro-kernel width, two SIMD vectors of GEMM_T
+//   GEMM_FN(x)  name for helper x in this instantiation
+// and gets GEMM_FN(mult)(ta, a, tb, b, c), which does c += op(a) * op(b)
+// where op transposes when ta/tb is set.
+//
+// A is packed MC x KC at a time (fits L2), B in KC x NR panels (fits L1),
+// and the micro-kernel keeps an MR x NR tile of C in registers. The kernel
+// is plain C with fixed trip counts, which the compiler vectorizes for
+// whatever SIMD the build enables.
+
+#define GEMM_MR 4
+#define GEMM_MC 96
+#define GEMM_KC 256
+#define GEMM_NC 2048
+
+// Packs the mc x kc block of op(a) at (i0, p0) into MR-row panels,
+// each stored column by column. Rows past mc are zero.
+static void GEMM_FN(pack_a)(GEMM_M a, int ta, int i0, int mc, int p0, int kc, GEMM_T *pack)
+{
+    int i, p, r;
+    for(i = 0; i < mc; i += GEMM_MR){
+        int mr = MIN(GEMM_MR, mc - i);
+        for(p = 0; p < kc; ++p){
+            for(r = 0; r < GEMM_MR; ++r){
+                GEMM_T v = 0;
+                if(r < mr) v = ta ? a.data[p0+p][i0+i+r] : a.data[i0+i+r][p0+p];
+                pack[r] = v;
+            }
+            pack += GEMM_MR;
+        }
+    }
+}
+
+// Packs the kc x nc block of op(b) at (p0, j0) into NR-column panels,
+// each stored row by row. Columns past nc are zero.
+static void GEMM_FN(pack_b)(GEMM_M b, int tb, int p0, int kc, int j0, int nc, GEMM_T *pack)
+{
+    int j, p, c;
+    for(j = 0; j < nc; j += GEMM_NR){
+        int nr = MIN(GEMM_NR, nc - j);
+        for(p = 0; p < kc; ++p){
+            if(!tb && nr == GEMM_NR){
+                memcpy(pack, b.data[p0+p] + j0 + j, GEMM_NR*sizeof(GEMM_T));
+            } else {
+                for(c = 0; c < GEMM_NR; ++c){
+                    GEMM_T v = 0;
+                    if(c < nr) v = tb ? b.data[j0+j+c][p0+p] : b.data[p0+p][j0+j+c];
+                    pack[c] = v;
+                }
+            }
+            pack += GEMM_NR;
+        }
+    }
+}
+
+// C[0:mr, 0:nr] += a * b for one packed A panel and one packed B panel.
+// c: row pointers already offset to the tile's first column.
+static void GEMM_FN(kernel)(int kc, const GEMM_T *a, const GEMM_T *b, GEMM_T **c, int mr, int nr)
+{
+    GEMM_T acc[GEMM_MR][GEMM_NR] = {{0}};
+    int p, r, j;
+    for(p = 0; p < kc; ++p){
+        for(r = 0; r < GEMM_MR; ++r){
+            for(j = 0; j < GEMM_NR; ++j){
+                acc[r][j] += a[r]*b[j];
+            }
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    for(r = 0; r < mr; ++r){
+        for(j = 0; j < nr; ++j){
+            c[r][j] += acc[r][j];
+        }
+    }
+}
+
+typedef struct{
+    GEMM_M a, c;
+    int ta;
+    int jc, nc, pc, kc;
+    GEMM_T *bpack;
+} GEMM_FN(job);
+
+// Multiplies MC-row blocks [b0, b1) of op(A) by the packed B block.
+// Every element of C is owned by one block, so results do not depend
+// on how blocks are spread over threads.
+static void GEMM_FN(blocks)(void *ctx, int b0, int b1)
+{
+    GEMM_FN(job) *job = ctx;
+    GEMM_T *apack = calloc(GEMM_MC*GEMM_KC, sizeof(GEMM_T));
+    GEMM_T *crow[GEMM_MR];
+    int blk, ir, jr, r;
+    for(blk = b0; blk < b1; ++blk){
+        int ic = blk*GEMM_MC;
+        int mc = MIN(GEMM_MC, job->c.rows - ic);
+        GEMM_FN(pack_a)(job->a, job->ta, ic, mc, job->pc, job->kc, apack);
+        for(jr = 0; jr < job->nc; jr += GEMM_NR){
+            int nr = MIN(GEMM_NR, job->nc - jr);
+            const GEMM_T *bp = job->bpack + (size_t)jr*job->kc;
+            for(ir = 0; ir < mc; ir += GEMM_MR){
+                int mr = MIN(GEMM_MR, mc - ir);
+                for(r = 0; r < mr; ++r) crow[r] = job->c.data[ic+ir+r] + job->jc + jr;
+                GEMM_FN(kernel)(job->kc, apack + (size_t)ir*job->kc, bp, crow, mr, nr);
+            }
+        }
+    }
+    free(apack);
+}
+
+// Operands are read through their row pointers, so shallow matrices and
+// matrices with swapped rows work too.
+static void GEMM_FN(mult)(int ta, GEMM_M a, int tb, GEMM_M b, GEMM_M c)
+{
+    int m = c.rows, n = c.cols, k = ta ? a.rows : a.cols;
+    int i, j, p;
+    if((double)m*n*k < 32*32*32){
+        // packing does not pay off for homographies and the like
+        for(i = 0; i < m; ++i){
+            for(p = 0; p < k; ++p){
+                GEMM_T aip = ta ? a.data[p][i] : a.data[i][p];
+                for(j = 0; j < n; ++j){
+                    c.data[i][j] += aip*(tb ? b.data[j][p] : b.data[p][j]);
+                }
+            }
+        }
+        return;
+    }
+
+    GEMM_FN(job) job;
+    job.a = a;
+    job.c = c;
+    job.ta = ta;
+    job.bpack = calloc((size_t)GEMM_KC*(MIN(GEMM_NC, n) + GEMM_NR), sizeof(GEMM_T));
+    int blocks = (m + GEMM_MC - 1)/GEMM_MC;
+    for(job.jc = 0; job.jc < n; job.jc += GEMM_NC){
+        job.nc = MIN(GEMM_NC, n - job.jc);
+        for(job.pc = 0; job.pc < k; job.pc += GEMM_KC){
+            job.kc = MIN(GEMM_KC, k - job.pc);
+            GEMM_FN(pack_b)(b, tb, job.pc, job.kc, job.jc, job.nc, job.bpack);
+            parallel_for_tiles(blocks, 1, GEMM_FN(blocks), &job);
+        }
+    }
+    free(job.bpack);
+}
+
+#undef GEMM_MR
+#undef GEMM_MC
+#undef GEMM_KC
+#undef GEMM_NC
@@ -12,37 +12,54 @@ float nn_interpolate(image im, float x, float y, int c)
     return get_pixel(im, roundf(x), roundf(y), c);
 }
 
-// Helper function, calculates the coordinates and calls the passed
-// Interpolation Function
-image interpolate_helper(image im, int w, int h, 
-    float (*func)(image, float, float, int))
+typedef struct{
+    image im, resized;
+    float scaleX, offX, scaleY, offY;
+    float (*func)(image, float, float, int);
+} resize_job;
+
+// Fills rows [y0, y1) of the resized image.
+static void interpolate_rows(void *ctx, int y0, int y1)
 {
-    // Make a new image
-    image resized = make_image(w, h, im.c);
-    
-    // what is the scale and offset?
-    float scaleX = 1.0f + (im.w - w) / w;
-    float offX = (im.w - w) / (2.0f * w);
-    float scaleY = 1.0f + (im.h - h) / h;
-    float offY = (im.h - h) / (2.0f * h);
-    
-    // Loop through each px
+    resize_job *job = ctx;
+    image resized = job->resized;
     int c, x, y;
     for (c = 0; c < resized.c; c++) {
-        for (x = 0; x < resized.w; x++) {
-            for (y = 0; y < resized.h; y++) {
+        for (y = y0; y < y1; y++) {
+            float *row = resized.data + c*resized.w*resized.h + y*resized.w;
+            for (x = 0; x < resized.w; x++) {
                 // call the passed interpolation function
-                float nearest = func(
-                    im, 
-                    x * scaleX + offX,
-                    y * scaleY + offY, 
+                row[x] = job->func(
+                    job->im,
+                    x * job->scaleX + job->offX,
+                    y * job->scaleY + job->offY,
                     c
                 );
-                set_pixel(resized, x, y, c, nearest);
             }
         }
     }
-    return resized;
+}
+
+// Helper function, calculates the coordinates and calls the passed
+// Interpolation Function
+image interpolate_helper(image im, int w, int h, 
+    float (*func)(image, float, float, int))
+{
+    resize_job job;
+    job.im = im;
+    job.func = func;
+    // Make a new image
+    job.resized = make_image(w, h, im.c);
+    
+    // what is the scale and offset?
+    job.scaleX = 1.0f + (im.w - w) / w;
+    job.offX = (im.w - w) / (2.0f * w);
+    job.scaleY = 1.0f + (im.h - h) / h;
+    job.offY = (im.h - h) / (2.0f * h);
+    
+    // Rows are independent, so split them across threads
+    parallel_for(h, interpolate_rows, &job);
+    return job.resized;
 }
 
 image nn_resize(image im, int w, int h)
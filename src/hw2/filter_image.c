@@ -9,6 +9,11 @@
 #include <math.h>
 #include <assert.h>
 #include "image.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #define TWOPI 6.2831853
 
 typedef struct{
@@ -27,42 +32,19 @@ tuple* filterCords(image im) {
     return res;
 }
 
-// helper method applys filter to one pixel
-float convolvePixel(image im, image filter, int x, int y, int filterChannel, 
-    int imageChannel, tuple* cords) {
-    float res = 0;
-    int fChanOffset = filter.h * filter.w * filterChannel;
-    // find the sum at each corresponding pixel in the filter
-    for (int i = 0; i < filter.w * filter.w; i++) {
-        // Get the original pixel at filter location
-        float orig = get_pixel(im, x + cords[i].x, y + cords[i].y, imageChannel);
-        // multiply by filter
-        orig *= filter.data[i + fChanOffset];
-        // add to final result
-        res += orig;
-    }
-    return res;
-}
-
 void l1_normalize(image im)
 {
     // Find the sum of all values in im for each channel
-    int x, y, c;
-    float sum[3] = {0, 0, 0};
+    // and divide each value by the sum for that channel
+    int i, c;
     for (c = 0; c < im.c; c++) {
-        for (x = 0; x < im.w; x++) {
-            for (y = 0; y < im.h; y++) {
-                sum[c] += get_pixel(im, x, y, c);
-            }
+        float *p = image_channel(im, c);
+        float sum = 0;
+        for (i = 0; i < im.w * im.h; i++) {
+            sum += p[i];
         }
-    }
-    // now divide each value by the sum for that channel
-    for (c = 0; c < im.c; c++) {
-        for (x = 0; x < im.w; x++) {
-            for (y = 0; y < im.h; y++) {
-                float val = get_pixel(im, x, y, c);
-                set_pixel(im, x, y, c, val / sum[c]);
-            }
+        for (i = 0; i < im.w * im.h; i++) {
+            p[i] /= sum;
         }
     }
 }
@@ -70,48 +52,225 @@ void l1_normalize(image im)
 image make_box_filter(int w)
 {
     image im = make_image(w, w, 1);
-    int x, y;
+    int i;
     // fill with 1's then normalize
-    for (y = 0; y < im.h; y++) {
-        for (x = 0; x < im.w; x++) {
-            set_pixel(im, x, y, 0, 1.0f);
-        }
+    for (i = 0; i < w * w; i++) {
+        im.data[i] = 1.0f;
     }
     l1_normalize(im);
     return im;
 }
 
+// Multiply-accumulate one row: dst[i] += k * src[i] for i in [0, n).
+// This is the inner loop of every convolution pass, so it gets SIMD.
+static void row_axpy(float *dst, const float *src, float k, int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    __m256 vk = _mm256_set1_ps(k);
+    for (; i + 8 <= n; i += 8) {
+        __m256 prod = _mm256_mul_ps(vk, _mm256_loadu_ps(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), prod));
+    }
+#elif defined(__ARM_NEON)
+    float32x4_t vk = vdupq_n_f32(k);
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(dst + i, vmlaq_f32(vld1q_f32(dst + i), vk, vld1q_f32(src + i)));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] += k * src[i];
+    }
+}
+
+// Channel 0 of a filter, plus its 1d factors when it is separable.
+typedef struct{
+    int w, h;
+    int separable;
+    float *taps;    // h rows of w taps
+    float *col;     // h taps, vertical factor
+    float *row;     // w taps, horizontal factor
+} conv_kernel;
+
+// Checks if a filter is rank one, i.e. filter = col * row.
+// Gaussian, box and the sobel filters all are.
+static conv_kernel make_conv_kernel(image filter)
+{
+    conv_kernel k;
+    k.w = filter.w;
+    k.h = filter.h;
+    k.taps = filter.data;
+    k.col = calloc(k.h, sizeof(float));
+    k.row = calloc(k.w, sizeof(float));
+    k.separable = 0;
+
+    // pivot on the largest tap so the factors are well conditioned
+    int i, j;
+    int pi = 0, pj = 0;
+    float big = 0;
+    for (i = 0; i < k.h; i++) {
+        for (j = 0; j < k.w; j++) {
+            if (fabsf(k.taps[i*k.w + j]) > big) {
+                big = fabsf(k.taps[i*k.w + j]);
+                pi = i;
+                pj = j;
+            }
+        }
+    }
+    if (big == 0) return k;
+
+    float pivot = k.taps[pi*k.w + pj];
+    for (i = 0; i < k.h; i++) k.col[i] = k.taps[i*k.w + pj];
+    for (j = 0; j < k.w; j++) k.row[j] = k.taps[pi*k.w + j] / pivot;
+
+    float tol = big * 1e-5f;
+    for (i = 0; i < k.h; i++) {
+        for (j = 0; j < k.w; j++) {
+            if (fabsf(k.col[i] * k.row[j] - k.taps[i*k.w + j]) > tol) return k;
+        }
+    }
+    k.separable = 1;
+    return k;
+}
+
+static void free_conv_kernel(conv_kernel k)
+{
+    free(k.col);
+    free(k.row);
+}
+
+// Convolves one row with a 1d filter using clamp padding.
+// Only the first and last few pixels need to clamp, the interior is a
+// straight run of row_axpy calls.
+static void convolve_row_1d(const float *src, float *dst, int w, const float *f, int n)
+{
+    int r = n / 2;
+    int lo = MIN(r, w);
+    int hi = MAX(lo, w - (n - 1 - r));
+    int x, j;
+
+    memset(dst, 0, w * sizeof(float));
+    for (j = 0; j < n; j++) {
+        row_axpy(dst + lo, src + lo + j - r, f[j], hi - lo);
+    }
+    for (x = 0; x < w; x++) {
+        if (x == lo) x = hi;
+        if (x >= w) break;
+        float sum = 0;
+        for (j = 0; j < n; j++) {
+            sum += f[j] * src[MIN(MAX(x + j - r, 0), w - 1)];
+        }
+        dst[x] = sum;
+    }
+}
+
+// Convolves one row of a plane with a full 2d filter using clamp padding.
+static void convolve_row_2d(const float *src, float *dst, int w, int h, int y, conv_kernel k)
+{
+    int rx = k.w / 2;
+    int ry = k.h / 2;
+    int lo = MIN(rx, w);
+    int hi = MAX(lo, w - (k.w - 1 - rx));
+    int x, i, j;
+
+    memset(dst, 0, w * sizeof(float));
+    for (i = 0; i < k.h; i++) {
+        const float *srow = src + MIN(MAX(y + i - ry, 0), h - 1) * w;
+        for (j = 0; j < k.w; j++) {
+            row_axpy(dst + lo, srow + lo + j - rx, k.taps[i*k.w + j], hi - lo);
+        }
+        for (x = 0; x < w; x++) {
+            if (x == lo) x = hi;
+            if (x >= w) break;
+            float sum = 0;
+            for (j = 0; j < k.w; j++) {
+                sum += k.taps[i*k.w + j] * srow[MIN(MAX(x + j - rx, 0), w - 1)];
+            }
+            dst[x] += sum;
+        }
+    }
+}
+
+// Number of floats of scratch convolve_plane needs for a band of rows.
+static int conv_scratch_size(conv_kernel k, int w, int rows)
+{
+    return k.separable ? (rows + k.h - 1) * w : 0;
+}
+
+// Convolves rows [y0, y1) of a w x h plane.
+// Separable kernels run as a horizontal pass over the band plus its
+// halo of k.h - 1 rows into scratch, then a vertical pass out of it.
+static void convolve_plane(const float *src, float *dst, int w, int h, conv_kernel k,
+    int y0, int y1, float *scratch)
+{
+    int y, i;
+    if (!k.separable) {
+        for (y = y0; y < y1; y++) {
+            convolve_row_2d(src, dst + y*w, w, h, y, k);
+        }
+        return;
+    }
+    int ry = k.h / 2;
+    for (y = y0 - ry; y < y1 + k.h - 1 - ry; y++) {
+        const float *srow = src + MIN(MAX(y, 0), h - 1) * w;
+        convolve_row_1d(srow, scratch + (y - y0 + ry) * w, w, k.row, k.w);
+    }
+    for (y = y0; y < y1; y++) {
+        float *drow = dst + y*w;
+        memset(drow, 0, w * sizeof(float));
+        for (i = 0; i < k.h; i++) {
+            row_axpy(drow, scratch + (y - y0 + i) * w, k.col[i], w);
+        }
+    }
+}
+
+typedef struct{
+    image src, dst;
+    conv_kernel k;
+} convolve_job;
+
+// Convolves a band of rows in every channel, the halo comes from src.
+static void convolve_rows(void *ctx, int y0, int y1)
+{
+    convolve_job *job = ctx;
+    image src = job->src;
+    int size = src.w * src.h;
+    int c;
+    float *scratch = calloc(conv_scratch_size(job->k, src.w, y1 - y0), sizeof(float));
+    for (c = 0; c < src.c; c++) {
+        convolve_plane(src.data + c*size, job->dst.data + c*size, src.w, src.h,
+            job->k, y0, y1, scratch);
+    }
+    free(scratch);
+}
+
 image convolve_image(image im, image filter, int preserve)
 {
     // assert the method is called correctly
     assert(filter.c == 1 || filter.c == im.c);
-    int x, y, c;
-    c = preserve ? im.c : 1;
-
-    // Setup output and cords for filter offsets
-    tuple* fCords = filterCords(filter);
-    image output = make_image(im.w, im.h, c);
-
-    // Apply filter to each pixel in im
-    for (x = 0; x < output.w; x++) {
-        for (y = 0; y < output.h; y++) {
-            for (c = 0; c < im.c; c++) {
-                // if only 1 filter channel use 0 else stay in sync
-                int filterChannel = filter.c ? 0 : c;
-                float finalPix = convolvePixel(im, filter, x, y, filterChannel, c, fCords);
-                if (preserve) {
-                    set_pixel(output, x, y, c, finalPix);
-                } else {
-                    // make_image() clears out data, so we can safely read
-                    float prev = get_pixel(output, x, y, 0);
-                    set_pixel(output, x, y, 0, finalPix + prev);
-                }
-            }
+    int c;
+    int size = im.w * im.h;
+
+    // Without preserve the output is the sum over channels of each channel
+    // convolved, which is the same as convolving the sum of the channels.
+    image src = im;
+    if (!preserve && im.c > 1) {
+        src = make_image(im.w, im.h, 1);
+        for (c = 0; c < im.c; c++) {
+            row_axpy(src.data, im.data + c*size, 1.0f, size);
         }
     }
 
-    free(fCords);
-    return output;
+    // Every channel uses the first filter channel
+    convolve_job job;
+    job.src = src;
+    job.dst = make_image(im.w, im.h, src.c);
+    job.k = make_conv_kernel(filter);
+    parallel_for(im.h, convolve_rows, &job);
+
+    free_conv_kernel(job.k);
+    if (src.data != im.data) free_image(src);
+    return job.dst;
 }
 
 image make_highpass_filter()
@@ -285,17 +444,14 @@ image colorize_sobel(image im)
 
     // note: want to manipulate RGB values, so 3 channels in the result image
     image result = make_image(sim[0].w, sim[0].h, 3);
-    for (int x = 0; x < result.w; x++) {
-        for (int y = 0; y < result.h; y++) {
-            // calculate and set hue with angle (note: angle is same thing as gradient direction)
-            float hue = get_pixel(sim[1], x, y, 0);
-            set_pixel(result, x, y, 0, hue);
-            // calculate and set saturation and value (note: satVal comes from magnitude)
-            float satVal = get_pixel(sim[0], x, y, 0);
-            set_pixel(result, x, y, 1, satVal);
-            set_pixel(result, x, y, 2, satVal);
-        }
-    }
+    int size = result.w * result.h * sizeof(float);
+    // hue from angle (note: angle is same thing as gradient direction)
+    memcpy(image_channel(result, 0), sim[1].data, size);
+    // saturation and value (note: satVal comes from magnitude)
+    memcpy(image_channel(result, 1), sim[0].data, size);
+    memcpy(image_channel(result, 2), sim[0].data, size);
+    free_image(sim[0]);
+    free_image(sim[1]);
     free(sim);
 
     hsv_to_rgb(result);
@@ -0,0 +1,479 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include "image.h"
+#include "parallel.h"
+#include "binfile.h"
+
+// Multi-band blending (Burt and Adelson) of the overlap between a and the
+// warped b, and compositing of whole panoramas. Work is cut into
+// BLEND_TILE squares, each blended on its own with BLEND_APRON pixels of
+// context, so memory grows with the tile size and not with the overlap
+// or the canvas.
+#define BLEND_LEVELS 4
+#define BLEND_TILE 256
+// Reach of BLEND_LEVELS levels of 5 tap filters: 2 + 4 + 8 + 16 pixels.
+#define BLEND_APRON 32
+
+static const float k5[5] = {1/16.f, 4/16.f, 6/16.f, 4/16.f, 1/16.f};
+
+static inline int clampi(int v, int lo, int hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// Blurs with the 5 tap binomial filter and drops every other row and
+// column, one step down a Gaussian pyramid. Borders are clamped.
+// returns: the (w+1)/2 x (h+1)/2 image.
+image pyramid_down(image im)
+{
+    int w = (im.w + 1)/2, h = (im.h + 1)/2;
+    image tmp = make_image(w, im.h, im.c);
+    image out = make_image(w, h, im.c);
+    pyramid_down_into(im, tmp, out);
+    free_image(tmp);
+    return out;
+}
+
+// pyramid_down into buffers the caller keeps.
+// image tmp: scratch, (w+1)/2 x h with im's channels.
+// image out: (w+1)/2 x (h+1)/2 with im's channels.
+void pyramid_down_into(image im, image tmp, image out)
+{
+    int w = out.w, h = out.h;
+    int x, y, c, k;
+    for(c = 0; c < im.c; ++c){
+        for(y = 0; y < im.h; ++y){
+            float *src = image_row(im, y, c), *dst = image_row(tmp, y, c);
+            for(x = 0; x < w; ++x){
+                float sum = 0;
+                for(k = 0; k < 5; ++k) sum += k5[k]*src[clampi(2*x + k - 2, 0, im.w - 1)];
+                dst[x] = sum;
+            }
+        }
+        for(y = 0; y < h; ++y){
+            float *dst = image_row(out, y, c);
+            memset(dst, 0, w*sizeof(float));
+            for(k = 0; k < 5; ++k){
+                float *src = image_row(tmp, clampi(2*y + k - 2, 0, im.h - 1), c);
+                for(x = 0; x < w; ++x) dst[x] += k5[k]*src[x];
+            }
+        }
+    }
+}
+
+// Upsamples to w x h by inserting zeros and filtering with twice the
+// 5 tap kernel in each direction, the inverse step of pyramid_down.
+static image pyr_up(image im, int w, int h)
+{
+    image tmp = make_image(w, im.h, im.c);
+    image out = make_image(w, h, im.c);
+    int x, y, c, k;
+    for(c = 0; c < im.c; ++c){
+        for(y = 0; y < im.h; ++y){
+            float *src = image_row(im, y, c), *dst = image_row(tmp, y, c);
+            for(x = 0; x < w; ++x){
+                float sum = 0;
+                for(k = (x & 1) ? 1 : 0; k < 5; k += 2){
+                    sum += k5[k]*src[clampi((x + k - 2)/2, 0, im.w - 1)];
+                }
+                dst[x] = 2*sum;
+            }
+        }
+        for(y = 0; y < h; ++y){
+            float *dst = image_row(out, y, c);
+            for(k = (y & 1) ? 1 : 0; k < 5; k += 2){
+                float *src = image_row(tmp, clampi((y + k - 2)/2, 0, im.h - 1), c);
+                for(x = 0; x < w; ++x) dst[x] += 2*k5[k]*src[x];
+            }
+        }
+    }
+    free_image(tmp);
+    return out;
+}
+
+// Blends n images by their masks, which sum to 1 at every pixel, level by
+// level of their Laplacian pyramids down to BLEND_LEVELS levels.
+// returns: the blended image.
+static image blend_pyramid(image *ims, image *masks, int n, int level)
+{
+    image a = ims[0];
+    int i, c, k;
+    if(level == BLEND_LEVELS || a.w < 2 || a.h < 2){
+        image out = make_image(a.w, a.h, a.c);
+        for(k = 0; k < n; ++k){
+            for(c = 0; c < a.c; ++c){
+                float *p = image_channel(ims[k], c), *po = image_channel(out, c);
+                for(i = 0; i < a.w*a.h; ++i) po[i] += masks[k].data[i]*p[i];
+            }
+        }
+        return out;
+    }
+    image *g = calloc(2*n, sizeof(image)), *gm = g + n;
+    for(k = 0; k < n; ++k){
+        g[k] = pyramid_down(ims[k]);
+        gm[k] = pyramid_down(masks[k]);
+    }
+    image low = blend_pyramid(g, gm, n, level + 1);
+    image out = pyr_up(low, a.w, a.h);
+    free_image(low);
+    // out = up(blended lower levels) + blend of this level's band pass
+    for(k = 0; k < n; ++k){
+        image up = pyr_up(g[k], a.w, a.h);
+        for(c = 0; c < a.c; ++c){
+            float *p = image_channel(ims[k], c), *q = image_channel(up, c);
+            float *po = image_channel(out, c);
+            for(i = 0; i < a.w*a.h; ++i) po[i] += masks[k].data[i]*(p[i] - q[i]);
+        }
+        free_image(up);
+        free_image(g[k]);
+        free_image(gm[k]);
+    }
+    free(g);
+    return out;
+}
+
+// Multi-band blends same sized images.
+// image *ims: the images, with every pixel filled in, e.g. from the
+//             others where an image has no data.
+// image *masks: one channel weights for each image, summing to 1 at
+//               every pixel. Usually 1 on one side of a seam, 0 elsewhere.
+// int n: number of images.
+// returns: the blended image.
+image multiband_blend(image *ims, image *masks, int n)
+{
+    return blend_pyramid(ims, masks, n, 0);
+}
+
+// bilinear_interpolate at (x, y) >= 0, reading im directly when the 2x2
+// neighbourhood is inside it.
+static inline float sample_pixel(image im, float x, float y, int c)
+{
+    int xi = x, yi = y;
+    if(xi + 1 >= im.w || yi + 1 >= im.h) return bilinear_interpolate(im, x, y, c);
+    const float *p = im.data + xi + (size_t)im.w*(yi + (size_t)im.h*c);
+    float d1 = x - xi, d3 = y - yi;
+    return (p[0]*(1 - d1) + p[1]*d1)*(1 - d3) + (p[im.w]*(1 - d1) + p[im.w+1]*d1)*d3;
+}
+
+typedef struct{
+    image a, b, c;
+    const double *h;    // Homography from a's coordinates to b's
+    int dx, dy;         // Offset of c from a's coordinates
+    int x0, x1;         // Overlap columns, in a's coordinates
+    int y0, y1;         // Rows of the current band that overlap
+} blend_job;
+
+// Blends tiles [t0, t1) of the band: fills the tile plus its apron with
+// a's pixels and b's warped ones, picks the seam where b's pixels are
+// further from b's border than a's are from a's, and writes the blended
+// core wherever either image has data.
+static void blend_tiles(void *ctx, int t0, int t1)
+{
+    blend_job *job = (blend_job *)ctx;
+    image a = job->a, b = job->b, c = job->c;
+    const double *h = job->h;
+    int t, x, y, k;
+    for(t = t0; t < t1; ++t){
+        int cx0 = job->x0 + t*BLEND_TILE, cx1 = MIN(cx0 + BLEND_TILE, job->x1);
+        int ex0 = cx0 - BLEND_APRON, ey0 = job->y0 - BLEND_APRON;
+        int w = cx1 - cx0 + 2*BLEND_APRON, hh = job->y1 - job->y0 + 2*BLEND_APRON;
+        image t2[2] = {make_image(w, hh, c.c), make_image(w, hh, c.c)};
+        image m2[2] = {make_image(w, hh, 1), make_image(w, hh, 1)};
+        image ta = t2[0], tb = t2[1];
+        unsigned char *valid = calloc(w*hh, 1);
+        for(y = 0; y < hh; ++y){
+            for(x = 0; x < w; ++x){
+                int ax = ex0 + x, ay = ey0 + y;
+                int i = x + y*w;
+                int in_a = ax >= 0 && ax < a.w && ay >= 0 && ay < a.h;
+                double pw = h[6]*ax + h[7]*ay + h[8];
+                float bx = (h[0]*ax + h[1]*ay + h[2])/pw;
+                float by = (h[3]*ax + h[4]*ay + h[5])/pw;
+                int in_b = pw > 0 && bx >= 0 && bx < b.w && by >= 0 && by < b.h;
+                for(k = 0; k < c.c; ++k){
+                    float va = in_a ? PIXEL(a, ax, ay, MIN(k, a.c - 1)) : 0;
+                    float vb = in_b ? sample_pixel(b, bx, by, k) : va;
+                    ta.data[i + k*w*hh] = in_a ? va : vb;
+                    tb.data[i + k*w*hh] = vb;
+                }
+                float wa = in_a ? border_distance(ax, ay, a.w, a.h) : 0;
+                float wb = in_b ? border_distance(bx, by, b.w, b.h) : 0;
+                m2[1].data[i] = wb > wa;
+                m2[0].data[i] = 1 - m2[1].data[i];
+                valid[i] = in_a || in_b;
+            }
+        }
+        image out = multiband_blend(t2, m2, 2);
+        for(k = 0; k < c.c; ++k){
+            for(y = BLEND_APRON; y < hh - BLEND_APRON; ++y){
+                float *dst = image_row(c, ey0 + y - job->dy, k) + ex0 - job->dx;
+                float *src = image_row(out, y, k);
+                for(x = BLEND_APRON; x < w - BLEND_APRON; ++x){
+                    if(valid[x + y*w]) dst[x] = src[x];
+                }
+            }
+        }
+        free(valid);
+        free_image(out);
+        free_image(ta);
+        free_image(tb);
+        free_image(m2[0]);
+        free_image(m2[1]);
+    }
+}
+
+// Multi-band blends the overlap of a and the warped b within a band of
+// rows of the canvas.
+// image a, b: images being combined.
+// image c: canvas, a pasted at (-dx, -dy) and b already warped in.
+// const double *h: row-major homography from a's coordinates to b's.
+// int dx, dy: offset of c from a's coordinates.
+// int x0, x1, y0, y1: the overlap, in a's coordinates.
+// int r0, r1: band of canvas rows to blend.
+void multiband_blend_band(image a, image b, image c, const double *h, int dx, int dy,
+    int x0, int x1, int y0, int y1, int r0, int r1)
+{
+    blend_job job;
+    job.a = a;
+    job.b = b;
+    job.c = c;
+    job.h = h;
+    job.dx = dx;
+    job.dy = dy;
+    job.x0 = MAX(x0, 0);
+    job.x1 = MIN(x1, a.w);
+    job.y0 = MAX(MAX(y0, 0), r0 + dy);
+    job.y1 = MIN(MIN(y1, a.h), r1 + dy);
+    if(job.x1 <= job.x0 || job.y1 <= job.y0) return;
+    int tiles = (job.x1 - job.x0 + BLEND_TILE - 1)/BLEND_TILE;
+    parallel_for_tiles(tiles, 1, blend_tiles, &job);
+}
+
+typedef struct{
+    image im;
+    double h[9];            // Homography from canvas to image coordinates
+    int x0, y0, x1, y1;     // Bounding box of the image in the canvas
+} composite_src;
+
+typedef struct{
+    image c;
+    composite_src *src;
+    int n;
+    blend_method blend;
+    int r0, r1;             // Band of canvas rows being filled
+} composite_job;
+
+// Where canvas pixel (x, y) lands in s, and how far inside s it is.
+// returns: 1 if it lands inside s.
+static inline int composite_sample(const composite_src *s, int x, int y, float *sx, float *sy, float *w)
+{
+    if(x < s->x0 || x >= s->x1 || y < s->y0 || y >= s->y1) return 0;
+    const double *h = s->h;
+    double pw = h[6]*x + h[7]*y + h[8];
+    *sx = (h[0]*x + h[1]*y + h[2])/pw;
+    *sy = (h[3]*x + h[4]*y + h[5])/pw;
+    if(!(pw > 0 && *sx >= 0 && *sx < s->im.w && *sy >= 0 && *sy < s->im.h)) return 0;
+    *w = border_distance(*sx, *sy, s->im.w, s->im.h);
+    return 1;
+}
+
+// Fills tiles [t0, t1) of a band of the canvas. Each pixel takes the
+// image it is deepest inside, a blend of all of them weighted by depth,
+// or a multi-band blend across the seams of the first choice.
+static void composite_tiles(void *ctx, int t0, int t1)
+{
+    composite_job *job = (composite_job *)ctx;
+    image c = job->c;
+    int apron = job->blend == BLEND_MULTIBAND ? BLEND_APRON : 0;
+    int *idx = calloc(job->n, sizeof(int));
+    int t, x, y, k, s;
+    for(t = t0; t < t1; ++t){
+        int cx0 = t*BLEND_TILE, cx1 = MIN(cx0 + BLEND_TILE, c.w);
+        int ex0 = cx0 - apron, ey0 = job->r0 - apron;
+        int w = cx1 - cx0 + 2*apron, hh = job->r1 - job->r0 + 2*apron;
+        int m = 0;
+        for(s = 0; s < job->n; ++s){
+            composite_src *src = job->src + s;
+            if(src->x0 < ex0 + w && src->x1 > ex0 && src->y0 < ey0 + hh && src->y1 > ey0) idx[m++] = s;
+        }
+        if(!m) continue;
+
+        if(job->blend == BLEND_FEATHER){
+            for(y = 0; y < hh; ++y){
+                for(x = 0; x < w; ++x){
+                    float sx, sy, wt, total = 0;
+                    for(s = 0; s < m; ++s){
+                        if(composite_sample(job->src + idx[s], ex0 + x, ey0 + y, &sx, &sy, &wt)) total += wt;
+                    }
+                    if(total == 0) continue;
+                    for(s = 0; s < m; ++s){
+                        composite_src *src = job->src + idx[s];
+                        if(!composite_sample(src, ex0 + x, ey0 + y, &sx, &sy, &wt)) continue;
+                        for(k = 0; k < c.c; ++k){
+                            PIXEL(c, ex0 + x, ey0 + y, k) += wt/total*sample_pixel(src->im, sx, sy, MIN(k, src->im.c - 1));
+                        }
+                    }
+                }
+            }
+            continue;
+        }
+
+        // The deepest image at each pixel, and its value.
+        image base = make_image(w, hh, c.c);
+        int *label = malloc(w*hh*sizeof(int));
+        for(y = 0; y < hh; ++y){
+            for(x = 0; x < w; ++x){
+                float sx, sy, wt, best = 0, bx = 0, by = 0;
+                int i = x + y*w;
+                label[i] = -1;
+                for(s = 0; s < m; ++s){
+                    if(composite_sample(job->src + idx[s], ex0 + x, ey0 + y, &sx, &sy, &wt) && wt > best){
+                        best = wt;
+                        bx = sx;
+                        by = sy;
+                        label[i] = s;
+                    }
+                }
+                if(label[i] < 0) continue;
+                image im = job->src[idx[label[i]]].im;
+                for(k = 0; k < c.c; ++k) base.data[i + k*w*hh] = sample_pixel(im, bx, by, MIN(k, im.c - 1));
+            }
+        }
+        image out = base;
+        if(job->blend == BLEND_MULTIBAND && m > 1){
+            // Each image fills in from base where it has no data, so only
+            // the seams between images show up in its band pass.
+            image *ims = calloc(2*m, sizeof(image)), *masks = ims + m;
+            for(s = 0; s < m; ++s){
+                composite_src *src = job->src + idx[s];
+                ims[s] = copy_image(base);
+                masks[s] = make_image(w, hh, 1);
+                for(y = 0; y < hh; ++y){
+                    for(x = 0; x < w; ++x){
+                        float sx, sy, wt;
+                        int i = x + y*w;
+                        // Masks have to sum to 1 even where nothing
+                        // lands, or the low bands fade at the edges.
+                        masks[s].data[i] = label[i] == s || (label[i] < 0 && s == 0);
+                        if(label[i] == s || !composite_sample(src, ex0 + x, ey0 + y, &sx, &sy, &wt)) continue;
+                        for(k = 0; k < c.c; ++k) ims[s].data[i + k*w*hh] = sample_pixel(src->im, sx, sy, MIN(k, src->im.c - 1));
+                    }
+                }
+            }
+            out = multiband_blend(ims, masks, m);
+            for(s = 0; s < m; ++s){
+                free_image(ims[s]);
+                free_image(masks[s]);
+            }
+            free(ims);
+        }
+        for(k = 0; k < c.c; ++k){
+            for(y = apron; y < hh - apron; ++y){
+                float *dst = image_row(c, ey0 + y, k) + ex0;
+                float *src = image_row(out, y, k);
+                for(x = apron; x < w - apron; ++x){
+                    if(label[x + y*w] >= 0) dst[x] = src[x];
+                }
+            }
+        }
+        if(out.data != base.data) free_image(out);
+        free_image(base);
+        free(label);
+    }
+    free(idx);
+}
+
+// Composites images into one canvas in a single pass, each warped by its
+// homography from a shared reference frame.
+// image *ims: images to combine.
+// matrix *H: homography from reference to image coordinates for each
+//            image. Images with an empty matrix are left out.
+// int n: number of images.
+// blend_method blend: BLEND_NONE takes each pixel from the image it is
+//                     deepest inside, BLEND_FEATHER averages images
+//                     weighted by depth, BLEND_MULTIBAND blends across the
+//                     seams BLEND_NONE picks.
+// returns: the panorama, backed by a scratch file if it is too big for
+//          memory. Free it with release_image.
+image composite_images(image *ims, matrix *H, int n, blend_method blend)
+{
+    composite_src *src = calloc(n, sizeof(composite_src));
+    double left = INFINITY, top = INFINITY, right = -INFINITY, bottom = -INFINITY;
+    int i, k, m = 0, channels = 1;
+    for(i = 0; i < n; ++i){
+        if(!H[i].data) continue;
+        matrix Hinv = matrix_invert(H[i]);
+        if(!Hinv.data) continue;
+        image im = ims[i];
+        point corners[4] = {make_point(0, 0), make_point(im.w, 0), make_point(0, im.h), make_point(im.w, im.h)};
+        double x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+        int front = 1;
+        for(k = 0; k < 4; ++k){
+            double x = corners[k].x, y = corners[k].y;
+            double w = Hinv.data[2][0]*x + Hinv.data[2][1]*y + Hinv.data[2][2];
+            if(w <= 0) front = 0;
+            double px = (Hinv.data[0][0]*x + Hinv.data[0][1]*y + Hinv.data[0][2])/w;
+            double py = (Hinv.data[1][0]*x + Hinv.data[1][1]*y + Hinv.data[1][2])/w;
+            x0 = MIN(x0, px); x1 = MAX(x1, px);
+            y0 = MIN(y0, py); y1 = MAX(y1, py);
+        }
+        free_matrix(Hinv);
+        if(!front){
+            fprintf(stderr, "image %d wraps behind the reference, leaving it out\n", i);
+            continue;
+        }
+        src[m].im = im;
+        for(k = 0; k < 9; ++k) src[m].h[k] = H[i].data[k/3][k%3];
+        // Bounding box in reference coordinates for now.
+        src[m].x0 = floor(x0) - 1; src[m].x1 = ceil(x1) + 1;
+        src[m].y0 = floor(y0) - 1; src[m].y1 = ceil(y1) + 1;
+        left = MIN(left, x0); right = MAX(right, x1);
+        top = MIN(top, y0); bottom = MAX(bottom, y1);
+        channels = MAX(channels, im.c);
+        ++m;
+    }
+    // Canvases whose pixels can't be counted in an int are from a broken H.
+    double fw = ceil(right) - floor(left), fh = ceil(bottom) - floor(top);
+    if(!m || !(fw > 0 && fh > 0 && fw*fh*channels < INT_MAX)){
+        fprintf(stderr, "output too big, stopping\n");
+        free(src);
+        return make_image(0, 0, 0);
+    }
+    int dx = floor(left), dy = floor(top);
+    int w = fw, h = fh;
+    for(i = 0; i < m; ++i){
+        // Shift into canvas coordinates: image = H*(canvas + (dx, dy)).
+        double *g = src[i].h;
+        g[2] += g[0]*dx + g[1]*dy;
+        g[5] += g[3]*dx + g[4]*dy;
+        g[8] += g[6]*dx + g[7]*dy;
+        src[i].x0 -= dx; src[i].x1 -= dx;
+        src[i].y0 -= dy; src[i].y1 -= dy;
+    }
+
+    int disk = (size_t)w*h > CANVAS_RAM_PIXELS;
+    image c = disk ? make_image_disk(w, h, channels) : make_image(w, h, channels);
+    if(!c.data){
+        free(src);
+        return c;
+    }
+    composite_job job;
+    job.c = c;
+    job.src = src;
+    job.n = m;
+    job.blend = blend;
+    for(job.r0 = 0; job.r0 < h; job.r0 = job.r1){
+        job.r1 = MIN(job.r0 + BLEND_TILE, h);
+        parallel_for_tiles((w + BLEND_TILE - 1)/BLEND_TILE, 1, composite_tiles, &job);
+        if(disk){
+            for(k = 0; k < c.c; ++k){
+                bin_evict(image_row(c, job.r0, k), (size_t)(job.r1 - job.r0)*w*sizeof(float));
+            }
+        }
+    }
+    free(src);
+    return c;
+}
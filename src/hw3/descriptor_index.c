@@ -0,0 +1,437 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+#include "parallel.h"
+
+// Randomized k-d forest settings (Silpa-Anan and Hartley, as in FLANN).
+#define KD_TREES 4      // Trees, each split on randomly chosen dimensions
+#define KD_LEAF 8       // Most descriptors in a leaf
+#define KD_TOP_DIMS 5   // Split dimension is picked among this many highest variance
+#define KD_SAMPLES 128  // Descriptors sampled to estimate the variances
+#define KD_CHECKS 128   // Descriptors compared per query before giving up
+
+typedef struct{
+    int dim;            // Split dimension, -1 for a leaf
+    float split;
+    int child[2];       // Nodes below and above split
+    int start, end;     // Leaf range in the tree's order
+} kd_node;
+
+struct descriptor_index{
+    index_method method;
+    int n;
+    int dims;           // Descriptor length
+    int stride;         // Row length, dims padded to a multiple of 8 with zeros
+    float *data;        // n rows of stride floats, contiguous
+    point *p;           // Where each descriptor came from
+    descriptor_set set; // Where data and p live
+    int owns_set;       // Whether free_descriptor_index frees it
+    kd_node *nodes;
+    int nnodes;
+    int roots[KD_TREES];
+    int *order;         // KD_TREES permutations of [0, n), one per tree
+};
+
+static unsigned long long splitmix64(unsigned long long *s)
+{
+    unsigned long long z = (*s += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// L1 distance between two padded rows; the fixed multiple of 8 lets the
+// compiler run it as straight SIMD with no remainder loop.
+static inline float l1_row(const float *a, const float *b, int stride)
+{
+    float total = 0;
+    int k;
+    for(k = 0; k < stride; ++k) total += fabsf(a[k] - b[k]);
+    return total;
+}
+
+static inline void add_neighbor(neighbors *nb, int i, float d)
+{
+    if(d < nb->d1){
+        nb->i2 = nb->i1; nb->d2 = nb->d1;
+        nb->i1 = i;      nb->d1 = d;
+    } else if(d < nb->d2){
+        nb->i2 = i;      nb->d2 = d;
+    }
+}
+
+static int add_node(descriptor_index *ix)
+{
+    // Each split adds two nodes and leaves hold up to KD_LEAF rows, so a
+    // tree has fewer than 2n nodes; nodes was sized for that up front.
+    kd_node *nd = &ix->nodes[ix->nnodes];
+    memset(nd, 0, sizeof(kd_node));
+    nd->dim = -1;
+    return ix->nnodes++;
+}
+
+// Builds the subtree over order[start, end) and returns its node.
+static int build_kd(descriptor_index *ix, int *order, int start, int end, unsigned long long *rng)
+{
+    int node = add_node(ix);
+    int n = end - start;
+    if(n <= KD_LEAF){
+        ix->nodes[node].start = start;
+        ix->nodes[node].end = end;
+        return node;
+    }
+
+    // Mean and variance of each dimension over a sample of the range.
+    int dims = ix->dims;
+    double *mean = calloc(2*dims, sizeof(double));
+    double *var = mean + dims;
+    int samples = n < KD_SAMPLES ? n : KD_SAMPLES;
+    int i, k;
+    for(i = 0; i < samples; ++i){
+        const float *row = ix->data + (size_t)order[start + (long)i*n/samples]*ix->stride;
+        for(k = 0; k < dims; ++k){
+            mean[k] += row[k];
+            var[k] += row[k]*row[k];
+        }
+    }
+    for(k = 0; k < dims; ++k){
+        mean[k] /= samples;
+        var[k] = var[k]/samples - mean[k]*mean[k];
+    }
+
+    // Pick at random among the KD_TOP_DIMS most spread out dimensions.
+    int top[KD_TOP_DIMS];
+    int ntop = 0;
+    for(k = 0; k < dims; ++k){
+        int j = ntop < KD_TOP_DIMS ? ntop++ : KD_TOP_DIMS;
+        while(j > 0 && var[top[j-1]] < var[k]){
+            if(j < KD_TOP_DIMS) top[j] = top[j-1];
+            --j;
+        }
+        if(j < KD_TOP_DIMS) top[j] = k;
+    }
+    int dim = top[splitmix64(rng) % ntop];
+    float split = mean[dim];
+    free(mean);
+
+    // Partition the range around the mean.
+    int lo = start, hi = end - 1;
+    while(lo <= hi){
+        if(ix->data[(size_t)order[lo]*ix->stride + dim] < split) ++lo;
+        else {
+            int t = order[lo]; order[lo] = order[hi]; order[hi] = t;
+            --hi;
+        }
+    }
+    if(lo == start || lo == end){
+        // Every sampled row had the same value there, keep the range whole.
+        ix->nodes[node].start = start;
+        ix->nodes[node].end = end;
+        return node;
+    }
+    int below = build_kd(ix, order, start, lo, rng);
+    int above = build_kd(ix, order, lo, end, rng);
+    ix->nodes[node].dim = dim;
+    ix->nodes[node].split = split;
+    ix->nodes[node].child[0] = below;
+    ix->nodes[node].child[1] = above;
+    return node;
+}
+
+// Packs descriptors into an index to query many times.
+// descriptor *d: descriptors of one image, all the same length.
+// int n: number of descriptors.
+// index_method method: INDEX_EXACT for brute force, INDEX_KDFOREST for
+//                      approximate search over KD_TREES randomized trees.
+// returns: the index, free with free_descriptor_index, or 0 if the
+//          descriptors differ in length.
+descriptor_index *make_descriptor_index(descriptor *d, int n, index_method method)
+{
+    int i;
+    for(i = 0; i < n; ++i){
+        if(d[i].n != d[0].n){
+            fprintf(stderr, "Descriptor %d has length %d, expected %d\n", i, d[i].n, d[0].n);
+            return 0;
+        }
+    }
+    descriptor_set set = make_descriptor_set(n, n ? d[0].n : 0);
+    for(i = 0; i < n; ++i){
+        memcpy(set.data + (size_t)i*set.stride, d[i].data, set.d*sizeof(float));
+        set.p[i] = d[i].p;
+    }
+    descriptor_index *ix = make_descriptor_index_set(set, method);
+    ix->owns_set = 1;
+    return ix;
+}
+
+// Same as make_descriptor_index but searches the set in place. The set
+// has to outlive the index.
+descriptor_index *make_descriptor_index_set(descriptor_set s, index_method method)
+{
+    descriptor_index *ix = calloc(1, sizeof(descriptor_index));
+    ix->method = method;
+    ix->set = s;
+    ix->n = s.n;
+    ix->dims = s.d;
+    ix->stride = s.stride;
+    ix->data = s.data;
+    ix->p = s.p;
+    int i, t;
+    int n = s.n;
+    if(method == INDEX_KDFOREST && n){
+        ix->nodes = calloc((size_t)KD_TREES*2*n, sizeof(kd_node));
+        ix->order = calloc((size_t)KD_TREES*n, sizeof(int));
+        unsigned long long rng = 0x5eed;
+        for(t = 0; t < KD_TREES; ++t){
+            int *order = ix->order + (size_t)t*n;
+            for(i = 0; i < n; ++i) order[i] = i;
+            ix->roots[t] = build_kd(ix, order, 0, n, &rng);
+        }
+    }
+    return ix;
+}
+
+// Frees an index made by make_descriptor_index.
+void free_descriptor_index(descriptor_index *ix)
+{
+    if(!ix) return;
+    if(ix->owns_set) free_descriptor_set(ix->set);
+    free(ix->nodes);
+    free(ix->order);
+    free(ix);
+}
+
+// The point descriptor i of the index was taken at.
+point descriptor_index_point(descriptor_index *ix, int i)
+{
+    return ix->p[i];
+}
+
+// Rows of the index scanned per pass and queries sharing each pass. A
+// block stays in L1 while every query of the batch runs over it.
+#define EXACT_ROWS 64
+#define EXACT_QUERIES 8
+
+// Exact top-2 for nq padded queries by scanning every row. Rows go four
+// at a time so each load of a query feeds four distances.
+static void query_exact(descriptor_index *ix, const float *q, int nq, neighbors *out)
+{
+    int stride = ix->stride;
+    int b, i, j, k;
+    for(j = 0; j < nq; ++j){
+        neighbors none = {-1, -1, INFINITY, INFINITY};
+        out[j] = none;
+    }
+    for(b = 0; b < ix->n; b += EXACT_ROWS){
+        int end = MIN(b + EXACT_ROWS, ix->n);
+        for(j = 0; j < nq; ++j){
+            const float *qj = q + (size_t)j*stride;
+            for(i = b; i + 4 <= end; i += 4){
+                const float *r = ix->data + (size_t)i*stride;
+                float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+                for(k = 0; k < stride; ++k){
+                    s0 += fabsf(qj[k] - r[k]);
+                    s1 += fabsf(qj[k] - r[k + stride]);
+                    s2 += fabsf(qj[k] - r[k + 2*stride]);
+                    s3 += fabsf(qj[k] - r[k + 3*stride]);
+                }
+                add_neighbor(&out[j], i, s0);
+                add_neighbor(&out[j], i+1, s1);
+                add_neighbor(&out[j], i+2, s2);
+                add_neighbor(&out[j], i+3, s3);
+            }
+            for(; i < end; ++i){
+                add_neighbor(&out[j], i, l1_row(qj, ix->data + (size_t)i*stride, stride));
+            }
+        }
+    }
+}
+
+// Min-heap of branches not taken, ordered by how far the query is from
+// their split plane.
+typedef struct{
+    float bound;
+    int node;
+} kd_branch;
+
+typedef struct{
+    kd_branch *b;
+    int n, size;
+} kd_heap;
+
+static void heap_push(kd_heap *h, float bound, int node)
+{
+    if(h->n == h->size){
+        h->size = h->size ? 2*h->size : 64;
+        h->b = realloc(h->b, h->size*sizeof(kd_branch));
+    }
+    int i = h->n++;
+    while(i > 0 && h->b[(i-1)/2].bound > bound){
+        h->b[i] = h->b[(i-1)/2];
+        i = (i-1)/2;
+    }
+    h->b[i].bound = bound;
+    h->b[i].node = node;
+}
+
+static kd_branch heap_pop(kd_heap *h)
+{
+    kd_branch top = h->b[0];
+    kd_branch last = h->b[--h->n];
+    int i = 0;
+    while(2*i + 1 < h->n){
+        int c = 2*i + 1;
+        if(c + 1 < h->n && h->b[c+1].bound < h->b[c].bound) ++c;
+        if(h->b[c].bound >= last.bound) break;
+        h->b[i] = h->b[c];
+        i = c;
+    }
+    if(h->n) h->b[i] = last;
+    return top;
+}
+
+// Scratch space one thread reuses across queries.
+typedef struct{
+    kd_heap heap;
+    int *stamp;         // Query number that last compared each row
+    int query;
+} kd_scratch;
+
+// Best-bin-first search over every tree at once: descend each tree to a
+// leaf, then keep reopening the closest branch not taken, in any tree,
+// until KD_CHECKS rows have been compared.
+static neighbors query_kdforest(descriptor_index *ix, const float *q, kd_scratch *s)
+{
+    neighbors nb = {-1, -1, INFINITY, INFINITY};
+    int checks = 0;
+    int t, i;
+    ++s->query;
+    s->heap.n = 0;
+    for(t = 0; t < KD_TREES; ++t) heap_push(&s->heap, 0, ix->roots[t]);
+    while(s->heap.n && checks < KD_CHECKS){
+        int node = heap_pop(&s->heap).node;
+        kd_node *nd = &ix->nodes[node];
+        while(nd->dim >= 0){
+            float diff = q[nd->dim] - nd->split;
+            int side = diff >= 0;
+            heap_push(&s->heap, fabsf(diff), nd->child[!side]);
+            nd = &ix->nodes[nd->child[side]];
+        }
+        // Leaves index into the order of the tree they belong to.
+        int tree = 0;
+        while(tree + 1 < KD_TREES && node >= ix->roots[tree+1]) ++tree;
+        const int *order = ix->order + (size_t)tree*ix->n;
+        for(i = nd->start; i < nd->end; ++i){
+            int r = order[i];
+            if(s->stamp[r] == s->query) continue;
+            s->stamp[r] = s->query;
+            add_neighbor(&nb, r, l1_row(q, ix->data + (size_t)r*ix->stride, ix->stride));
+            ++checks;
+        }
+    }
+    return nb;
+}
+
+typedef struct{
+    descriptor_index *ix;
+    descriptor *q;
+    neighbors *out;
+} query_job;
+
+static void query_rows(void *ctx, int start, int end)
+{
+    query_job *job = (query_job *)ctx;
+    descriptor_index *ix = job->ix;
+    float *q = calloc((size_t)EXACT_QUERIES*ix->stride, sizeof(float));
+    kd_scratch s = {{0}};
+    if(ix->method == INDEX_KDFOREST) s.stamp = calloc(ix->n, sizeof(int));
+    int i, j;
+    for(i = start; i < end; i += EXACT_QUERIES){
+        int nq = MIN(EXACT_QUERIES, end - i);
+        for(j = 0; j < nq; ++j){
+            descriptor d = job->q[i+j];
+            memcpy(q + (size_t)j*ix->stride, d.data, ix->dims*sizeof(float));
+        }
+        if(ix->method == INDEX_KDFOREST && ix->n){
+            for(j = 0; j < nq; ++j) job->out[i+j] = query_kdforest(ix, q + (size_t)j*ix->stride, &s);
+        } else {
+            query_exact(ix, q, nq, job->out + i);
+        }
+    }
+    free(s.stamp);
+    free(s.heap.b);
+    free(q);
+}
+
+// Finds the two nearest indexed descriptors to each query, in parallel.
+// descriptor_index *ix: index to search.
+// descriptor *q: query descriptors.
+// int n: number of queries.
+// neighbors *out: filled with n results. If any query's length differs
+//                 from the index's, every result is empty (i1 = i2 = -1).
+void query_descriptor_index(descriptor_index *ix, descriptor *q, int n, neighbors *out)
+{
+    int i;
+    for(i = 0; ix->n && i < n; ++i){
+        if(q[i].n != ix->dims){
+            fprintf(stderr, "Query %d has length %d, index has %d\n", i, q[i].n, ix->dims);
+            neighbors none = {-1, -1, INFINITY, INFINITY};
+            for(i = 0; i < n; ++i) out[i] = none;
+            return;
+        }
+    }
+    query_job job = {ix, q, out};
+    parallel_for_tiles(n, 32, query_rows, &job);
+}
+
+// Matches descriptors against an index of another image's descriptors.
+// descriptor *a: descriptors to match.
+// int an: number of descriptors in a.
+// descriptor_index *b: index of the other image's descriptors, or 0 for
+//                     an index that couldn't be made, which matches nothing.
+// float ratio: keep only matches closer than ratio times the second best
+//              (Lowe's ratio test, e.g. .8), or 0 to keep all.
+// int *mn: pointer to number of matches found, to be filled in by function.
+// returns: matches sorted by distance, at most one per descriptor in b,
+//          none if the lengths of a and b differ.
+match *match_descriptors_index(descriptor *a, int an, descriptor_index *b, float ratio, int *mn)
+{
+    if(!b){
+        *mn = 0;
+        return 0;
+    }
+    neighbors *nb = calloc(an, sizeof(neighbors));
+    query_descriptor_index(b, a, an, nb);
+
+    // We will have at most an matches.
+    match *m = calloc(an, sizeof(match));
+    int i, count = 0;
+    for(i = 0; i < an; ++i){
+        if(nb[i].i1 < 0) continue;
+        if(ratio > 0 && nb[i].i2 >= 0 && !(nb[i].d1 < ratio*nb[i].d2)) continue;
+        m[count].ai = i;
+        m[count].bi = nb[i].i1;
+        m[count].p = a[i].p;
+        m[count].q = b->p[nb[i].i1];
+        m[count].distance = nb[i].d1;
+        ++count;
+    }
+    free(nb);
+
+    // Matches should be injective (one-to-one): sort by distance and keep
+    // the first match to each element of b, tracked in a bitmap.
+    qsort(m, count, sizeof(match), &match_compare);
+    unsigned *seen = calloc((b->n + 31)/32, sizeof(unsigned));
+    int kept = 0;
+    for(i = 0; i < count; ++i){
+        int bi = m[i].bi;
+        if(seen[bi/32] & (1u << bi%32)) continue;
+        seen[bi/32] |= 1u << bi%32;
+        m[kept++] = m[i];
+    }
+    free(seen);
+    *mn = kept;
+    return m;
+}
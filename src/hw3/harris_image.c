@@ -7,23 +7,79 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
+#include "parallel.h"
 #include <time.h>
 
 #define NEG -999999.0f
 
-// Frees an array of descriptors.
+// Descriptor arrays are allocated in one block behind a header holding
+// the set their data lives in, so freeing an array needs nothing but the
+// array.
+typedef struct{
+    descriptor_set set;
+} view_header;
+
+static view_header *view_of(descriptor *d)
+{
+    return (view_header *)d - 1;
+}
+
+// Frees an array of descriptors made by descriptor_set_view, or returned
+// by harris_corner_detector, and the set its data lives in.
 // descriptor *d: the array.
 // int n: number of elements in array.
 void free_descriptors(descriptor *d, int n)
 {
+    if(!d) return;
+    view_header *v = view_of(d);
+    free_descriptor_set(v->set);
+    free(v);
+}
+
+// Makes an empty descriptor set with room for n descriptors of d floats.
+// Rows are padded with zeros to a multiple of 8 floats and the block is
+// 32 byte aligned, so whole rows load as SIMD vectors.
+descriptor_set make_descriptor_set(int n, int d)
+{
+    descriptor_set s = {0};
+    s.n = n;
+    s.d = d;
+    s.stride = (d + 7) & ~7;
+    size_t size = (size_t)n*s.stride*sizeof(float);
+    if(size && posix_memalign((void **)&s.data, 32, size)) s.data = 0;
+    if(s.data) memset(s.data, 0, size);
+    s.p = calloc(n, sizeof(point));
+    return s;
+}
+
+// Frees the block and points of a descriptor set.
+void free_descriptor_set(descriptor_set s)
+{
+    free(s.data);
+    free(s.p);
+}
+
+// Wraps a set as the descriptor array the rest of the API takes. Each
+// descriptor's data points into the set's block. The view takes the set
+// over: free_descriptors(view, s.n) frees both.
+// descriptor_set s: set to view.
+// returns: array of s.n descriptors.
+descriptor *descriptor_set_view(descriptor_set s)
+{
+    view_header *v = calloc(1, sizeof(view_header) + (size_t)s.n*sizeof(descriptor));
+    v->set = s;
+    descriptor *d = (descriptor *)(v + 1);
     int i;
-    for(i = 0; i < n; ++i){
-        free(d[i].data);
+    for(i = 0; i < s.n; ++i){
+        d[i].p = s.p[i];
+        d[i].n = s.d;
+        d[i].data = s.data + (size_t)i*s.stride;
     }
-    free(d);
+    return d;
 }
 
 // Create a feature descriptor for an index in an image.
@@ -40,6 +96,9 @@ descriptor describe_index(image im, int i)
     d.n = w*w*im.c;
     int c, dx, dy;
     int count = 0;
+    int x = i%im.w, y = i/im.w;
+    // Only windows that hang over the border need clamped reads
+    int inside = x >= w/2 && y >= w/2 && x + (w-1)/2 < im.w && y + (w-1)/2 < im.h;
     // If you want you can experiment with other descriptors
     // This subtracts the central value from neighbors
     // to compensate some for exposure/lighting changes.
@@ -47,7 +106,7 @@ descriptor describe_index(image im, int i)
         float cval = im.data[c*im.w*im.h + i];
         for(dx = -w/2; dx < (w+1)/2; ++dx){
             for(dy = -w/2; dy < (w+1)/2; ++dy){
-                float val = get_pixel(im, i%im.w+dx, i/im.w+dy, c);
+                float val = inside ? PIXEL(im, x+dx, y+dy, c) : get_pixel(im, x+dx, y+dy, c);
                 d.data[count++] = cval - val;
             }
         }
@@ -55,6 +114,57 @@ descriptor describe_index(image im, int i)
     return d;
 }
 
+typedef struct{
+    image im;
+    int *indexes;
+    descriptor_set s;
+} describe_job;
+
+// Describes corners [i0, i1) of a describe_job, one channel at a time
+// across the whole range so a single plane is read at once.
+static void describe_rows(void *ctx, int i0, int i1)
+{
+    describe_job *job = (describe_job *)ctx;
+    image im = job->im;
+    descriptor_set s = job->s;
+    int w = 5;
+    int c, i, dx, dy;
+    for(c = 0; c < im.c; ++c){
+        float *plane = image_channel(im, c);
+        for(i = i0; i < i1; ++i){
+            int index = job->indexes[i];
+            int x = index%im.w, y = index/im.w;
+            int inside = x >= w/2 && y >= w/2 && x + (w-1)/2 < im.w && y + (w-1)/2 < im.h;
+            float cval = plane[index];
+            float *out = s.data + (size_t)i*s.stride + c*w*w;
+            for(dx = -w/2; dx < (w+1)/2; ++dx){
+                for(dy = -w/2; dy < (w+1)/2; ++dy){
+                    float val = inside ? plane[index + dx + dy*im.w] : get_pixel(im, x+dx, y+dy, c);
+                    *out++ = cval - val;
+                }
+            }
+        }
+    }
+    for(i = i0; i < i1; ++i){
+        s.p[i] = make_point(job->indexes[i]%im.w, job->indexes[i]/im.w);
+    }
+}
+
+// Describes many pixels at once, the batched form of describe_index.
+// image im: source image.
+// int *indexes: pixel indexes to describe.
+// int n: number of indexes.
+// returns: set with the descriptor of indexes[i] in row i.
+descriptor_set describe_corners(image im, int *indexes, int n)
+{
+    describe_job job;
+    job.im = im;
+    job.indexes = indexes;
+    job.s = make_descriptor_set(n, 5*5*im.c);
+    parallel_for_tiles(n, 64, describe_rows, &job);
+    return job.s;
+}
+
 // Marks the spot of a point in an image.
 // image im: image to mark.
 // ponit p: spot to mark in the image.
@@ -90,8 +200,232 @@ void mark_corners(image im, descriptor *d, int n)
 // returns: single row image of the filter.
 image make_1d_gaussian(float sigma)
 {
-    // TODO: optional, make separable 1d Gaussian.
-    return make_image(1,1,1);
+    // same support as make_gaussian_filter: next odd integer from 6*sigma
+    int size = 6 * sigma;
+    if (size % 2 == 0) size += 1;
+    image g = make_image(size, 1, 1);
+    for (int i = 0; i < size; i++) {
+        float x = i - size/2;
+        g.data[i] = exp(-x*x / (2.0f * sigma * sigma));
+    }
+    l1_normalize(g);
+    return g;
+}
+
+typedef struct{
+    image im;
+    int r[3];
+} box3_job;
+
+// Widths of three box filters whose combined variance matches sigma^2
+// (Kovesi, "Fast almost-Gaussian filtering"), stored as radii.
+static void box3_radii(float sigma, int *r)
+{
+    int n = 3;
+    int wl = sqrtf(12.0f*sigma*sigma/n + 1);
+    if (wl % 2 == 0) wl--;
+    int wu = wl + 2;
+    int m = roundf((12.0f*sigma*sigma - n*wl*wl - 4*n*wl - 3*n) / (-4.0f*wl - 4));
+    for (int i = 0; i < n; i++) r[i] = (i < m ? wl : wu) / 2;
+}
+
+// Three sliding-window box passes along rows [r0, r1), rows indexed
+// across channels. Windows are truncated at the border and averaged
+// over the pixels they cover, like box_filter_image.
+static void box3_rows(void *ctx, int r0, int r1)
+{
+    box3_job *job = ctx;
+    int w = job->im.w;
+    float *src = calloc(w, sizeof(float));
+    for (int row = r0; row < r1; row++) {
+        float *v = job->im.data + (size_t)row*w;
+        for (int p = 0; p < 3; p++) {
+            int r = job->r[p];
+            memcpy(src, v, w*sizeof(float));
+            double sum = 0;
+            for (int x = 0; x < r && x < w; x++) sum += src[x];
+            // edges where the window is clipped, then the full-window interior
+            int lo = MIN(r + 1, w), hi = MAX(w - r, lo);
+            for (int x = 0; x < lo; x++) {
+                if (x + r < w) sum += src[x + r];
+                v[x] = sum / (MIN(x + r, w - 1) + 1);
+            }
+            double norm = 1.0 / (2*r + 1);
+            for (int x = lo; x < hi; x++) {
+                sum += src[x + r] - src[x - r - 1];
+                v[x] = sum * norm;
+            }
+            for (int x = hi; x < w; x++) {
+                if (x - r - 1 >= 0) sum -= src[x - r - 1];
+                v[x] = sum / (w - MAX(x - r, 0));
+            }
+        }
+    }
+    free(src);
+}
+
+// Same passes down columns [x0, x1), sliding a whole row segment at a
+// time so the inner loops stay contiguous.
+static void box3_cols(void *ctx, int x0, int x1)
+{
+    box3_job *job = ctx;
+    image im = job->im;
+    int n = x1 - x0;
+    float *src = calloc((size_t)n*im.h, sizeof(float));
+    double *sum = calloc(n, sizeof(double));
+    for (int c = 0; c < im.c; c++) {
+        for (int p = 0; p < 3; p++) {
+            int r = job->r[p];
+            for (int y = 0; y < im.h; y++) {
+                memcpy(src + (size_t)y*n, image_row(im, y, c) + x0, n*sizeof(float));
+            }
+            memset(sum, 0, n*sizeof(double));
+            for (int y = 0; y < r && y < im.h; y++) {
+                for (int i = 0; i < n; i++) sum[i] += src[(size_t)y*n + i];
+            }
+            for (int y = 0; y < im.h; y++) {
+                if (y + r < im.h) {
+                    float *add = src + (size_t)(y + r)*n;
+                    for (int i = 0; i < n; i++) sum[i] += add[i];
+                }
+                if (y - r - 1 >= 0) {
+                    float *sub = src + (size_t)(y - r - 1)*n;
+                    for (int i = 0; i < n; i++) sum[i] -= sub[i];
+                }
+                float norm = 1.0f / (MIN(y + r, im.h - 1) - MAX(y - r, 0) + 1);
+                float *v = image_row(im, y, c) + x0;
+                for (int i = 0; i < n; i++) v[i] = sum[i] * norm;
+            }
+        }
+    }
+    free(src);
+    free(sum);
+}
+
+// Approximates a Gaussian with three box filters. Each pass keeps a running
+// window sum, so cost does not grow with sigma.
+static image smooth_box(image im, float sigma)
+{
+    box3_job job;
+    job.im = copy_image(im);
+    box3_radii(sigma, job.r);
+    parallel_for(im.h*im.c, box3_rows, &job);
+    parallel_for(im.w, box3_cols, &job);
+    return job.im;
+}
+
+// Recursive Gaussian coefficients, normalized by b0 (Young & van Vliet 1995).
+typedef struct{
+    float B, b1, b2, b3;
+} iir_coeffs;
+
+static iir_coeffs make_iir_coeffs(float sigma)
+{
+    float q = sigma >= 2.5f ? 0.98711f*sigma - 0.96330f
+                            : 3.97156f - 4.14554f*sqrtf(1 - 0.26891f*sigma);
+    float q2 = q*q, q3 = q2*q;
+    float b0 = 1.57825f + 2.44413f*q + 1.4281f*q2 + 0.422205f*q3;
+    iir_coeffs k;
+    k.b1 = (2.44413f*q + 2.85619f*q2 + 1.26661f*q3) / b0;
+    k.b2 = -(1.4281f*q2 + 1.26661f*q3) / b0;
+    k.b3 = 0.422205f*q3 / b0;
+    k.B = 1 - (k.b1 + k.b2 + k.b3);
+    return k;
+}
+
+typedef struct{
+    image im;
+    iir_coeffs k;
+} iir_job;
+
+// Runs the causal then anti-causal filter along rows [r0, r1) of every
+// channel, in place. Rows are indexed across channels (r = y + h*c).
+// The state before each end is the edge value, matching clamp padding.
+static void iir_rows(void *ctx, int r0, int r1)
+{
+    iir_job *job = ctx;
+    iir_coeffs k = job->k;
+    int n = job->im.w;
+    for (int r = r0; r < r1; r++) {
+        float *v = job->im.data + (size_t)r*n;
+        float w1 = v[0], w2 = v[0], w3 = v[0];
+        for (int i = 0; i < n; i++) {
+            float w = k.B*v[i] + k.b1*w1 + k.b2*w2 + k.b3*w3;
+            v[i] = w;
+            w3 = w2; w2 = w1; w1 = w;
+        }
+        w1 = w2 = w3 = v[n-1];
+        for (int i = n-1; i >= 0; i--) {
+            float w = k.B*v[i] + k.b1*w1 + k.b2*w2 + k.b3*w3;
+            v[i] = w;
+            w3 = w2; w2 = w1; w1 = w;
+        }
+    }
+}
+
+// Same filter down columns [x0, x1), walking whole row segments so the
+// inner loop stays contiguous.
+static void iir_cols(void *ctx, int x0, int x1)
+{
+    iir_job *job = ctx;
+    iir_coeffs k = job->k;
+    image im = job->im;
+    for (int c = 0; c < im.c; c++) {
+        for (int y = 0; y < im.h; y++) {
+            float *v = image_row(im, y, c);
+            float *p1 = image_row(im, MAX(y-1, 0), c);
+            float *p2 = image_row(im, MAX(y-2, 0), c);
+            float *p3 = image_row(im, MAX(y-3, 0), c);
+            for (int x = x0; x < x1; x++) {
+                v[x] = k.B*v[x] + k.b1*p1[x] + k.b2*p2[x] + k.b3*p3[x];
+            }
+        }
+        for (int y = im.h-1; y >= 0; y--) {
+            float *v = image_row(im, y, c);
+            float *p1 = image_row(im, MIN(y+1, im.h-1), c);
+            float *p2 = image_row(im, MIN(y+2, im.h-1), c);
+            float *p3 = image_row(im, MIN(y+3, im.h-1), c);
+            for (int x = x0; x < x1; x++) {
+                v[x] = k.B*v[x] + k.b1*p1[x] + k.b2*p2[x] + k.b3*p3[x];
+            }
+        }
+    }
+}
+
+// Recursive Gaussian: four multiply-adds per pixel per pass, whatever sigma.
+static image smooth_iir(image im, float sigma)
+{
+    iir_job job;
+    job.im = copy_image(im);
+    job.k = make_iir_coeffs(sigma);
+    parallel_for(im.h*im.c, iir_rows, &job);
+    parallel_for(im.w, iir_cols, &job);
+    return job.im;
+}
+
+// Smooths an image with a Gaussian using the chosen backend.
+// image im: image to smooth.
+// float sigma: std dev. for Gaussian.
+// smooth_method method: SMOOTH_EXACT convolves with a separable Gaussian,
+//     cost grows with sigma. SMOOTH_BOX approximates it with three box
+//     filters, SMOOTH_IIR with a recursive filter; both are constant cost
+//     per pixel. The recursive filter is only defined for sigma >= .5,
+//     smaller sigmas fall back to the exact filter.
+// returns: smoothed image.
+image smooth_image_method(image im, float sigma, smooth_method method)
+{
+    if (method == SMOOTH_BOX) return smooth_box(im, sigma);
+    if (method == SMOOTH_IIR && sigma >= .5f) return smooth_iir(im, sigma);
+
+    image gx = make_1d_gaussian(sigma);
+    image gy = make_image(1, gx.w, 1);
+    memcpy(gy.data, gx.data, gx.w*sizeof(float));
+    image t = convolve_image(im, gx, 1);
+    image s = convolve_image(t, gy, 1);
+    free_image(gx);
+    free_image(gy);
+    free_image(t);
+    return s;
 }
 
 // Smooths an image using separable Gaussian filter.
@@ -100,15 +434,24 @@ image make_1d_gaussian(float sigma)
 // returns: smoothed image.
 image smooth_image(image im, float sigma)
 {
-    if(1){
-        image g = make_gaussian_filter(sigma);
-        image s = convolve_image(im, g, 1);
-        free_image(g);
-        return s;
-    } else {
-        // TODO: optional, use two convolutions with 1d gaussian filter.
-        // If you implement, disable the above if check.
-        return copy_image(im);
+    return smooth_image_method(im, sigma, SMOOTH_EXACT);
+}
+
+// Fills rows [y0, y1) of S with the gradient products.
+static void structure_rows(void *ctx, int y0, int y1)
+{
+    image *ims = ctx;
+    image Ix = ims[0], Iy = ims[1], S = ims[2];
+    float *xx = image_channel(S, 0);
+    float *yy = image_channel(S, 1);
+    float *xy = image_channel(S, 2);
+    int i;
+    for (i = y0 * S.w; i < y1 * S.w; i++) {
+        float xDer = Ix.data[i];
+        float yDer = Iy.data[i];
+        xx[i] = xDer * xDer;
+        yy[i] = yDer * yDer;
+        xy[i] = xDer * yDer;
     }
 }
 
@@ -120,22 +463,45 @@ image smooth_image(image im, float sigma)
 image structure_matrix(image im, float sigma)
 {
     // Make derivative images
-    image Ix = convolve_image(im, make_gx_filter(), 0);
-    image Iy = convolve_image(im, make_gy_filter(), 0);
-    image S = make_image(im.w, im.h, 3);
+    image gx = make_gx_filter();
+    image gy = make_gy_filter();
+    image ims[3];
+    ims[0] = convolve_image(im, gx, 0);
+    ims[1] = convolve_image(im, gy, 0);
+    ims[2] = make_image(im.w, im.h, 3);
 
     // fill in corresponding measures
-    for (int x = 0; x < im.w; x++) {
-        for (int y = 0; y < im.h; y++) {
-            float xDer = get_pixel(Ix, x, y, 0);
-            float yDer = get_pixel(Iy, x, y, 0);
-            set_pixel(S, x, y, 0, xDer * xDer);
-            set_pixel(S, x, y, 1, yDer * yDer);
-            set_pixel(S, x, y, 2, xDer * yDer);
-        }
-    }
+    parallel_for(im.h, structure_rows, ims);
+
     // apply gausian blur to this image to create structure matrix
-    return smooth_image(S, sigma);
+    image S = smooth_image(ims[2], sigma);
+    free_image(gx);
+    free_image(gy);
+    free_image(ims[0]);
+    free_image(ims[1]);
+    free_image(ims[2]);
+    return S;
+}
+
+// Fills rows [y0, y1) of the response map R.
+static void cornerness_rows(void *ctx, int y0, int y1)
+{
+    image *ims = ctx;
+    image S = ims[0], R = ims[1];
+    float *xx = image_channel(S, 0);
+    float *yy = image_channel(S, 1);
+    float *xys = image_channel(S, 2);
+    int i;
+    // We'll use formulation det(S) - alpha * trace(S)^2, alpha = .06.   
+    for (i = y0 * S.w; i < y1 * S.w; i++) {
+        // computer determinant and trace then plug into function.
+        float x2 = xx[i];
+        float y2 = yy[i];
+        float xy = xys[i];
+        float det = x2 * y2 - xy * xy;
+        float trace = x2 + y2;
+        R.data[i] = det - 0.06f * trace * trace;
+    }
 }
 
 // Estimate the cornerness of each pixel given a structure matrix S.
@@ -143,91 +509,593 @@ image structure_matrix(image im, float sigma)
 // returns: a response map of cornerness calculations.
 image cornerness_response(image S)
 {
-    image R = make_image(S.w, S.h, 1);
+    image ims[2] = {S, make_image(S.w, S.h, 1)};
+    parallel_for(S.h, cornerness_rows, ims);
+    return ims[1];
+}
 
-    // We'll use formulation det(S) - alpha * trace(S)^2, alpha = .06.   
-    for (int x = 0; x < R.w; x++) {
-        for (int y = 0; y < R.h; y++) {
-            // computer determinant and trace then plug into function.
-            float x2 = get_pixel(S, x, y, 0);
-            float y2 = get_pixel(S, x, y, 1);
-            float xy = get_pixel(S, x, y, 2);
-            float det = x2 * y2 - xy * xy;
-            float trace = x2 + y2;
-            set_pixel(R, x, y, 0, det - 0.06f * trace * trace);
+// Rows of output each task of nms_corners and harris_corners works on.
+#define HARRIS_BAND 64
+
+// Running maximum over windows of 2r+1 values, clipped at the ends:
+// dst[i] = max(src[i-r .. i+r]) over the values that exist. Van Herk /
+// Gil-Werman: with the input padded by r on each side and cut into blocks
+// of 2r+1, every window spans the end of one block and the start of the
+// next, so it is the max of a suffix max and a prefix max. That is about
+// 3 comparisons per value whatever r is.
+// float *scratch: room for 3*(n + 2r) floats.
+static void running_max(const float *src, float *dst, int n, int r, float *scratch)
+{
+    int k = 2*r + 1, m = n + 2*r, b, i;
+    float *p = scratch, *g = scratch + m, *h = scratch + 2*m;
+    for (i = 0; i < r; i++) p[i] = p[m - 1 - i] = -FLT_MAX;
+    memcpy(p + r, src, n*sizeof(float));
+    for (b = 0; b < m; b += k) {
+        int e = MIN(b + k, m);
+        g[b] = p[b];
+        for (i = b + 1; i < e; i++) g[i] = MAX(g[i-1], p[i]);
+        h[e-1] = p[e-1];
+        for (i = e - 2; i >= b; i--) h[i] = MAX(h[i+1], p[i]);
+    }
+    for (i = 0; i < n; i++) dst[i] = MAX(h[i], g[i + k - 1]);
+}
+
+// Corners found by one band of rows, a growing list.
+typedef struct{
+    int *i;             // pixel indexes
+    float *v;           // their responses
+    int n, cap;
+} corner_list;
+
+static void push_corner(corner_list *l, int i, float v)
+{
+    if (l->n == l->cap) {
+        l->cap = MAX(2*l->cap, 64);
+        l->i = realloc(l->i, l->cap*sizeof(int));
+        l->v = realloc(l->v, l->cap*sizeof(float));
+    }
+    l->i[l->n] = i;
+    l->v[l->n++] = v;
+}
+
+// Joins the lists of each band in band order and frees them.
+// float **v: set to the responses, unless null.
+// returns: the pixel indexes.
+static int *gather_bands(corner_list *bands, int nb, int *n, float **v)
+{
+    int total = 0, b;
+    for (b = 0; b < nb; b++) total += bands[b].n;
+    int *indexes = malloc((total ? total : 1)*sizeof(int));
+    if (v) *v = malloc((total ? total : 1)*sizeof(float));
+    *n = 0;
+    for (b = 0; b < nb; b++) {
+        if (bands[b].n) {
+            memcpy(indexes + *n, bands[b].i, bands[b].n*sizeof(int));
+            if (v) memcpy(*v + *n, bands[b].v, bands[b].n*sizeof(float));
         }
+        *n += bands[b].n;
+        free(bands[b].i);
+        free(bands[b].v);
+    }
+    return indexes;
+}
+
+typedef struct{
+    image im, mx;       // responses and their neighbourhood maxima
+    int w;
+    float thresh;
+    corner_list *found; // maxima of each band
+} nms_job;
+
+// Maxima along rows [y0, y1).
+static void max_rows(void *ctx, int y0, int y1)
+{
+    nms_job *job = ctx;
+    int w = job->im.w;
+    float *scratch = calloc((size_t)3*(w + 2*job->w), sizeof(float));
+    for (int y = y0; y < y1; y++) {
+        running_max(image_row(job->im, y, 0), image_row(job->mx, y, 0), w, job->w, scratch);
+    }
+    free(scratch);
+}
+
+// The same down columns [x0, x1) of mx, in place, with whole row segments
+// as the values so the inner loops stay contiguous.
+static void max_cols(void *ctx, int x0, int x1)
+{
+    nms_job *job = ctx;
+    image mx = job->mx;
+    int n = x1 - x0, r = job->w, k = 2*r + 1, m = mx.h + 2*r;
+    float *g = calloc((size_t)2*m*n + n, sizeof(float));
+    float *h = g + (size_t)m*n, *pad = h + (size_t)m*n;
+    int b, i, x;
+    for (x = 0; x < n; x++) pad[x] = -FLT_MAX;
+    for (b = 0; b < m; b += k) {
+        int e = MIN(b + k, m);
+        for (i = b; i < e; i++) {
+            float *p = i >= r && i < mx.h + r ? image_row(mx, i - r, 0) + x0 : pad;
+            float *gi = g + (size_t)i*n;
+            if (i == b) memcpy(gi, p, n*sizeof(float));
+            else for (x = 0; x < n; x++) gi[x] = MAX(gi[x - n], p[x]);   // row i - 1
+        }
+        for (i = e - 1; i >= b; i--) {
+            float *p = i >= r && i < mx.h + r ? image_row(mx, i - r, 0) + x0 : pad;
+            float *hi = h + (size_t)i*n;
+            if (i == e - 1) memcpy(hi, p, n*sizeof(float));
+            else for (x = 0; x < n; x++) hi[x] = MAX(hi[x + n], p[x]);   // row i + 1
+        }
+    }
+    for (i = 0; i < mx.h; i++) {
+        float *dst = image_row(mx, i, 0) + x0;
+        float *a = h + (size_t)i*n, *c = g + (size_t)(i + k - 1)*n;
+        for (x = 0; x < n; x++) dst[x] = MAX(a[x], c[x]);
+    }
+    free(g);
+}
+
+// Largest response within w pixels of each pixel, separably.
+static void max_filter(nms_job *job)
+{
+    job->mx = make_image(job->im.w, job->im.h, 1);
+    parallel_for(job->im.h, max_rows, job);
+    parallel_for(job->im.w, max_cols, job);
+}
+
+// Turns rows [y0, y1) of mx into the suppressed responses.
+static void suppress_rows(void *ctx, int y0, int y1)
+{
+    nms_job *job = ctx;
+    float *v = image_row(job->im, y0, 0), *mx = image_row(job->mx, y0, 0);
+    for (size_t i = 0; i < (size_t)(y1 - y0)*job->im.w; i++) {
+        mx[i] = mx[i] > v[i] ? NEG : v[i];
     }
-    return R;
 }
 
 // Perform non-max supression on an image of feature responses.
+// A response survives if nothing within w pixels is larger.
 // image im: 1-channel image of feature responses.
 // int w: distance to look for larger responses.
 // returns: image with only local-maxima responses within w pixels.
 image nms_image(image im, int w)
 {
-    image r = copy_image(im);
-    int width = 2 * w + 1;
-    int size = width * width;
-    // Perform NMS on the response map.
-    // for every pixel in the image:
-    for (int x = 0; x < im.w; x++) {
-        for (int y = 0; y < im.h; y++) {
-            float val = get_pixel(im, x, y, 0);
-            // for neighbors within w:
-            for (int i = 0; i < size; i++) {
-                int offX = i % width - w;
-                int offY = i / width - w;
-                float nVal = get_pixel(im, x + offX, y + offY, 0);
-                // if neighbor response greater set response to be very low 
-                if (nVal > val) {
-                    set_pixel(r, x, y, 0, NEG);
-                    break;
+    nms_job job;
+    job.im = im;
+    job.w = w;
+    max_filter(&job);
+    parallel_for(im.h, suppress_rows, &job);
+    return job.mx;
+}
+
+static void nms_bands(void *ctx, int b0, int b1)
+{
+    nms_job *job = ctx;
+    image im = job->im;
+    for (int b = b0; b < b1; b++) {
+        for (int i = b*HARRIS_BAND*im.w; i < MIN((b + 1)*HARRIS_BAND, im.h)*im.w; i++) {
+            float v = im.data[i];
+            if (v > job->thresh && !(job->mx.data[i] > v)) push_corner(&job->found[b], i, v);
+        }
+    }
+}
+
+// Non-max suppression that only returns the survivors, the pixels over
+// thresh in nms_image(im, w).
+// image im: 1-channel image of feature responses.
+// int w: distance to look for larger responses.
+// float thresh: smallest response to keep.
+// int *n: set to the number of survivors.
+// returns: their pixel indexes in raster order.
+int *nms_corners(image im, int w, float thresh, int *n)
+{
+    int bands = (im.h + HARRIS_BAND - 1) / HARRIS_BAND;
+    nms_job job;
+    job.im = im;
+    job.w = w;
+    job.thresh = thresh;
+    job.found = calloc(bands, sizeof(corner_list));
+    max_filter(&job);
+    parallel_for_tiles(bands, 1, nms_bands, &job);
+    int *indexes = gather_bands(job.found, bands, n, 0);
+    free(job.found);
+    free_image(job.mx);
+    return indexes;
+}
+
+// The fused Harris pipeline keeps each stage's rows in a small ring, row r
+// in slot r % size, so a band needs a few dozen rows of scratch rather
+// than whole images of gradients, products and responses.
+typedef struct{
+    image im;
+    float *g;           // 1d Gaussian taps
+    int gr;             // their radius
+    float thresh;
+    int nms;
+    corner_list *found; // corners of each band
+} harris_job;
+
+static inline float *ring_row(float *ring, int size, int len, int r)
+{
+    return ring + (size_t)(r % size)*len;
+}
+
+// Sum of the channels of row y, what convolve_image filters when it
+// doesn't preserve channels.
+static void channel_sum_row(image im, int y, float *dst)
+{
+    memcpy(dst, image_row(im, y, 0), im.w*sizeof(float));
+    for (int c = 1; c < im.c; c++) {
+        float *src = image_row(im, y, c);
+        for (int x = 0; x < im.w; x++) dst[x] += src[x];
+    }
+}
+
+// Sobel gradients of row b from rows a above and c below, clamped at the
+// ends like convolve_image, then their products smoothed along the row
+// into out's three channels.
+// float *tmp: scratch for 5 rows.
+static void product_row(const float *a, const float *b, const float *c, int w,
+    const float *g, int gr, float *tmp, float *out)
+{
+    float *ix = tmp, *iy = tmp + w, *p = tmp + 2*w;
+    for (int x = 0; x < w; x++) {
+        int l = MAX(x - 1, 0), r = MIN(x + 1, w - 1);
+        ix[x] = (a[r] - a[l]) + 2*(b[r] - b[l]) + (c[r] - c[l]);
+        iy[x] = (c[l] + 2*c[x] + c[r]) - (a[l] + 2*a[x] + a[r]);
+    }
+    for (int x = 0; x < w; x++) {
+        p[x] = ix[x]*ix[x];
+        p[x + w] = iy[x]*iy[x];
+        p[x + 2*w] = ix[x]*iy[x];
+    }
+    int lo = MIN(gr, w), hi = MAX(lo, w - gr);
+    for (int k = 0; k < 3; k++) {
+        float *src = p + k*w, *dst = out + k*w;
+        for (int x = lo; x < hi; x++) {
+            float sum = 0;
+            for (int j = -gr; j <= gr; j++) sum += g[j + gr]*src[x + j];
+            dst[x] = sum;
+        }
+        for (int x = 0; x < w; x++) {
+            if (x == lo) x = hi;
+            if (x >= w) break;
+            float sum = 0;
+            for (int j = -gr; j <= gr; j++) sum += g[j + gr]*src[MIN(MAX(x + j, 0), w - 1)];
+            dst[x] = sum;
+        }
+    }
+}
+
+// Finds the corners of one band of rows. Each stage fills its ring just
+// far enough ahead for the next: responses gr rows past the products,
+// suppression nms rows past the responses. Each response row also keeps
+// its running max along the row, so a pixel over thresh checks its
+// neighbourhood with one comparison per row.
+static void harris_band(harris_job *job, int band)
+{
+    image im = job->im;
+    int w = im.w, h = im.h, gr = job->gr, nms = job->nms;
+    int y0 = band*HARRIS_BAND, y1 = MIN(y0 + HARRIS_BAND, h);
+    int hsize = 2*gr + 1, rsize = 2*nms + 1;
+    float *sums = calloc((size_t)3*w, sizeof(float));
+    float *hs = calloc((size_t)hsize*3*w, sizeof(float));
+    float *resp = calloc((size_t)2*rsize*w, sizeof(float)), *rmax = resp + (size_t)rsize*w;
+    float *tmp = calloc((size_t)MAX(5*w, 3*(w + 2*nms)), sizeof(float)), *s = tmp;
+
+    int rnext = MAX(y0 - nms, 0);
+    int hnext = MAX(rnext - gr, 0);
+    int snext = MAX(hnext - 1, 0);
+    for (int y = y0; y < y1; y++) {
+        for (; rnext <= MIN(y + nms, h - 1); rnext++) {
+            for (; hnext <= MIN(rnext + gr, h - 1); hnext++) {
+                for (; snext <= MIN(hnext + 1, h - 1); snext++) {
+                    channel_sum_row(im, snext, ring_row(sums, 3, w, snext));
                 }
+                product_row(ring_row(sums, 3, w, MAX(hnext - 1, 0)), ring_row(sums, 3, w, hnext),
+                    ring_row(sums, 3, w, MIN(hnext + 1, h - 1)), w, job->g, gr, tmp,
+                    ring_row(hs, hsize, 3*w, hnext));
+            }
+            memset(s, 0, (size_t)3*w*sizeof(float));
+            for (int k = -gr; k <= gr; k++) {
+                float *src = ring_row(hs, hsize, 3*w, MIN(MAX(rnext + k, 0), h - 1));
+                float gk = job->g[k + gr];
+                for (int x = 0; x < 3*w; x++) s[x] += gk*src[x];
+            }
+            float *r = ring_row(resp, rsize, w, rnext);
+            for (int x = 0; x < w; x++) {
+                float x2 = s[x], y2 = s[x + w], xy = s[x + 2*w];
+                float trace = x2 + y2;
+                r[x] = x2*y2 - xy*xy - 0.06f*trace*trace;
             }
+            running_max(r, ring_row(rmax, rsize, w, rnext), w, nms, tmp);
+        }
+        float *r = ring_row(resp, rsize, w, y);
+        for (int x = 0; x < w; x++) {
+            float v = r[x];
+            if (!(v > job->thresh)) continue;
+            int keep = 1;
+            for (int yy = MAX(y - nms, 0); keep && yy <= MIN(y + nms, h - 1); yy++) {
+                keep = !(ring_row(rmax, rsize, w, yy)[x] > v);
+            }
+            if (keep) push_corner(&job->found[band], x + y*w, v);
         }
     }
-    
-    return r;
+    free(sums);
+    free(hs);
+    free(resp);
+    free(tmp);
 }
 
-// Perform harris corner detection and extract features from the corners.
+static void harris_bands(void *ctx, int b0, int b1)
+{
+    for (int b = b0; b < b1; b++) harris_band(ctx, b);
+}
+
+// harris_corners, with the responses of the corners in *v unless v is null.
+static int *harris_candidates(image im, float sigma, float thresh, int nms, int *n, float **v)
+{
+    image g = make_1d_gaussian(sigma);
+    int bands = (im.h + HARRIS_BAND - 1) / HARRIS_BAND;
+    harris_job job;
+    job.im = im;
+    job.g = g.data;
+    job.gr = g.w / 2;
+    job.thresh = thresh;
+    job.nms = nms;
+    job.found = calloc(bands, sizeof(corner_list));
+    parallel_for_tiles(bands, 1, harris_bands, &job);
+    int *indexes = gather_bands(job.found, bands, n, v);
+    free(job.found);
+    free_image(g);
+    return indexes;
+}
+
+// Harris corners in one pass: gradients, their products, the Gaussian
+// window, cornerness and non-max suppression run together over bands of
+// rows in parallel. Same corners as thresholding
+// nms_image(cornerness_response(structure_matrix(im, sigma)), nms), up to
+// rounding.
 // image im: input image.
 // float sigma: std. dev for harris.
 // float thresh: threshold for cornerness.
 // int nms: distance to look for local-maxes in response map.
-// int *n: pointer to number of corners detected, should fill in.
-// returns: array of descriptors of the corners in the image.
-descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n)
+// int *n: set to the number of corners.
+// returns: pixel indexes of the corners in raster order.
+int *harris_corners(image im, float sigma, float thresh, int nms, int *n)
+{
+    return harris_candidates(im, sigma, thresh, nms, n, 0);
+}
+
+// Candidates ANMS considers for every corner it keeps, the strongest ones.
+#define ANMS_POOL 8
+// A corner's ANMS radius ends at the nearest corner this much stronger.
+#define ANMS_ROBUST .9f
+
+// Heap order for top_k: is entry a worse than entry b? Lower keys are
+// worse, and of equal keys the later position.
+static inline int worse(const float *key, int a, int b)
 {
-    // Calculate structure matrix
-    image S = structure_matrix(im, sigma);
+    return key[a] < key[b] || (key[a] == key[b] && a > b);
+}
 
-    // Estimate cornerness
-    image R = cornerness_response(S);
+static void sift_down(const float *key, int *heap, int n, int i)
+{
+    for (;;) {
+        int c = 2*i + 1;
+        if (c >= n) return;
+        if (c + 1 < n && worse(key, heap[c + 1], heap[c])) c++;
+        if (!worse(key, heap[c], heap[i])) return;
+        int t = heap[c];
+        heap[c] = heap[i];
+        heap[i] = t;
+        i = c;
+    }
+}
 
-    // Run NMS on the responses
-    image Rnms = nms_image(R, nms);
+// Picks the k largest keys among positions pos[0..n), or 0..n if pos is
+// null, without sorting them all: a heap holds the best k so far with the
+// worst on top, so each key costs one comparison unless it gets in.
+// int *out: set to the picked positions, largest key first.
+// returns: number picked, at most k.
+static int top_k(const float *key, const int *pos, int n, int k, int *out)
+{
+    int m = 0, i;
+    if (k <= 0) return 0;
+    for (i = 0; i < n; i++) {
+        int p = pos ? pos[i] : i;
+        if (m < k) {
+            // sift up
+            int j = m++;
+            out[j] = p;
+            while (j > 0 && worse(key, out[j], out[(j - 1)/2])) {
+                int t = out[j];
+                out[j] = out[(j - 1)/2];
+                out[(j - 1)/2] = t;
+                j = (j - 1)/2;
+            }
+        } else if (worse(key, out[0], p)) {
+            out[0] = p;
+            sift_down(key, out, m, 0);
+        }
+    }
+    // pop the worst to the back until the best is in front
+    for (i = m - 1; i > 0; i--) {
+        int t = out[0];
+        out[0] = out[i];
+        out[i] = t;
+        sift_down(key, out, i, 0);
+    }
+    return m;
+}
 
-    // Count number of responses over threshold
-    int count = 0;
-    int size = Rnms.w * Rnms.h;
-    int* indexes = malloc(size * sizeof(int));
-    for (int i = 0; i < size; i++) {
-        if (Rnms.data[i] > thresh) indexes[count++] = i;
+// k best candidates, an even share from each cell of a grid laid over
+// the image, topped up with the best of the rest when cells run short.
+static int select_grid(const int *indexes, const float *v, int n, int w, int h, int k, int *out)
+{
+    // about 4 corners per cell, cells about square
+    int cells = MAX(k/4, 1);
+    int gx = MAX(1, (int)roundf(sqrtf((float)cells*w/h)));
+    int gy = MAX(1, (int)roundf((float)cells/gx));
+    int quota = (k + gx*gy - 1)/(gx*gy);
+    int *start = calloc(gx*gy + 1, sizeof(int));
+    int *members = malloc((n ? n : 1)*sizeof(int));
+    int *cell = malloc((n ? n : 1)*sizeof(int));
+    int *picked = malloc((size_t)(gx*gy*quota + k)*sizeof(int));
+    unsigned char *chosen = calloc(n ? n : 1, 1);
+    int i, c, m = 0;
+
+    // counting sort of the candidates by cell
+    for (i = 0; i < n; i++) {
+        int x = indexes[i] % w, y = indexes[i] / w;
+        cell[i] = MIN(y*gy/h, gy - 1)*gx + MIN(x*gx/w, gx - 1);
+        start[cell[i] + 1]++;
     }
-    
-    *n = count; // <- set *n equal to number of corners in image.
-    descriptor *d = calloc(count, sizeof(descriptor));
-    for (int i = 0; i < count; i++) {
-        d[i] = describe_index(im, indexes[i]);
+    for (c = 0; c < gx*gy; c++) start[c + 1] += start[c];
+    for (i = 0; i < n; i++) members[start[cell[i]]++] = i;
+    for (c = gx*gy; c > 0; c--) start[c] = start[c - 1];
+    start[0] = 0;
+
+    for (c = 0; c < gx*gy; c++) {
+        m += top_k(v, members + start[c], start[c + 1] - start[c], quota, picked + m);
+    }
+    for (i = 0; i < m; i++) chosen[picked[i]] = 1;
+    int got = top_k(v, picked, m, k, out);
+    if (got < k) {
+        int rest = 0;
+        for (i = 0; i < n; i++) if (!chosen[i]) members[rest++] = i;
+        got += top_k(v, members, rest, k - got, out + got);
+    }
+    free(start);
+    free(members);
+    free(cell);
+    free(picked);
+    free(chosen);
+    return got;
+}
+
+// Adaptive non-maximal suppression (Brown, Szeliski and Winder 2005):
+// each corner's radius is the distance to the nearest clearly stronger
+// one, and the k largest radii win, so strong corners in busy areas give
+// way to weaker ones in empty areas. Only the strongest ANMS_POOL*k
+// candidates take part, which bounds the quadratic radius search.
+static int select_anms(const int *indexes, const float *v, int n, int w, int k, int *out)
+{
+    // ANMS_POOL*k can be past INT_MAX for a large k
+    int size = MIN((long)n, (long)ANMS_POOL*k);
+    int *pool = malloc((size_t)MAX(size, 1)*sizeof(int));
+    int m = top_k(v, 0, n, size, pool);
+    float *r2 = malloc((m ? m : 1)*sizeof(float));
+    int *picked = malloc((m ? m : 1)*sizeof(int));
+    int i, j;
+    // pool is strongest first, so anything stronger comes earlier
+    for (i = 0; i < m; i++) {
+        float x = indexes[pool[i]] % w, y = indexes[pool[i]] / w;
+        float vi = v[pool[i]], best = FLT_MAX;
+        for (j = 0; j < i; j++) {
+            if (!(ANMS_ROBUST*v[pool[j]] > vi)) continue;
+            float dx = indexes[pool[j]] % w - x, dy = indexes[pool[j]] / w - y;
+            best = MIN(best, dx*dx + dy*dy);
+        }
+        r2[i] = best;
     }
+    int got = top_k(r2, 0, m, k, picked);
+    for (i = 0; i < got; i++) out[i] = pool[picked[i]];
+    free(pool);
+    free(r2);
+    free(picked);
+    return got;
+}
+
+// Keeps at most k of a set of corners, so what comes after has a bounded
+// amount of work whatever the image.
+// int *indexes: pixel indexes of the corners in a w x h image.
+// float *v: their responses.
+// int n: number of corners.
+// int k: how many to keep.
+// select_method method: SELECT_BEST keeps the strongest. SELECT_GRID
+//     takes an even share of the strongest from each cell of a grid over
+//     the image. SELECT_ANMS keeps the corners furthest from any stronger
+//     one. Both spread corners over the image.
+// int *m: set to the number kept, min(n, k).
+// returns: pixel indexes of the kept corners.
+int *select_corners(const int *indexes, const float *v, int n, int w, int h, int k,
+    select_method method, int *m)
+{
+    // Past n every method keeps everything, and grid and ANMS size
+    // their buffers by k
+    k = MIN(k, n);
+    int *order = malloc((size_t)MAX(k, 1)*sizeof(int));
+    if (method == SELECT_GRID) *m = select_grid(indexes, v, n, w, h, k, order);
+    else if (method == SELECT_ANMS) *m = select_anms(indexes, v, n, w, k, order);
+    else *m = top_k(v, 0, n, k, order);
+    for (int i = 0; i < *m; i++) order[i] = indexes[order[i]];
+    return order;
+}
+
+// Harris corners, at most k of them picked by select_corners, so no
+// threshold needs tuning per image.
+// image im: input image.
+// float sigma: std. dev for harris.
+// int nms: distance to look for local-maxes in response map.
+// int k: most corners to return.
+// select_method method: how to pick them, see select_corners.
+// int *n: set to the number of corners.
+// returns: pixel indexes of the corners.
+int *harris_corners_top(image im, float sigma, int nms, int k, select_method method, int *n)
+{
+    int count = 0;
+    float *v = 0;
+    // Every local max with a positive response is a candidate
+    int *c = harris_candidates(im, sigma, 0, nms, &count, &v);
+    int *top = select_corners(c, v, count, im.w, im.h, k, method, n);
+    free(c);
+    free(v);
+    return top;
+}
 
-    free_image(S);
-    free_image(R);
-    free_image(Rnms);
+// Perform harris corner detection and extract features from the corners.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// returns: descriptor set of the corners in the image.
+descriptor_set harris_corner_set(image im, float sigma, float thresh, int nms)
+{
+    int count = 0;
+    int *indexes = harris_corners(im, sigma, thresh, nms, &count);
+    descriptor_set s = describe_corners(im, indexes, count);
     free(indexes);
-    return d;
+    return s;
+}
+
+// Perform harris corner detection and extract features from the corners.
+// Same as harris_corner_set, returned as a descriptor array viewing the set.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int *n: pointer to number of corners detected, should fill in.
+// returns: array of descriptors of the corners in the image.
+descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n)
+{
+    descriptor_set s = harris_corner_set(im, sigma, thresh, nms);
+    *n = s.n; // <- set *n equal to number of corners in image.
+    return descriptor_set_view(s);
+}
+
+// harris_corner_detector with the corners picked by harris_corners_top.
+// image im: input image.
+// float sigma: std. dev for harris.
+// int nms: distance to look for local-maxes in response map.
+// int k: most corners to return.
+// select_method method: how to pick them, see select_corners.
+// int *n: set to the number of corners.
+// returns: array of descriptors of the corners in the image.
+descriptor *harris_corner_detector_top(image im, float sigma, int nms, int k, select_method method, int *n)
+{
+    int *indexes = harris_corners_top(im, sigma, nms, k, method, n);
+    descriptor_set s = describe_corners(im, indexes, *n);
+    free(indexes);
+    return descriptor_set_view(s);
 }
 
 // Find and draw corners on an image.
@@ -240,4 +1108,5 @@ void detect_and_draw_corners(image im, float sigma, float thresh, int nms)
     int n = 0;
     descriptor *d = harris_corner_detector(im, sigma, thresh, nms, &n);
     mark_corners(im, d, n);
+    free_descriptors(d, n);
 }
@@ -8,8 +8,11 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <limits.h>
 #include "image.h"
 #include "matrix.h"
+#include "parallel.h"
+#include "binfile.h"
 
 // Comparator for matches
 // const void *a, *b: pointers to the matches to compare.
@@ -39,19 +42,15 @@ point make_point(float x, float y)
 image both_images(image a, image b)
 {
     image both = make_image(a.w + b.w, a.h > b.h ? a.h : b.h, a.c > b.c ? a.c : b.c);
-    int i,j,k;
+    int j,k;
     for(k = 0; k < a.c; ++k){
         for(j = 0; j < a.h; ++j){
-            for(i = 0; i < a.w; ++i){
-                set_pixel(both, i, j, k, get_pixel(a, i, j, k));
-            }
+            memcpy(image_row(both, j, k), image_row(a, j, k), a.w*sizeof(float));
         }
     }
     for(k = 0; k < b.c; ++k){
         for(j = 0; j < b.h; ++j){
-            for(i = 0; i < b.w; ++i){
-                set_pixel(both, i+a.w, j, k, get_pixel(b, i, j, k));
-            }
+            memcpy(image_row(both, j, k) + a.w, image_row(b, j, k), b.w*sizeof(float));
         }
     }
     return both;
@@ -138,58 +137,9 @@ float l1_distance(float *a, float *b, int n)
 //          one other descriptor in b.
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
 {
-    int i,j;
-
-    // We will have at most an matches.
-    *mn = an;
-    match *m = calloc(an, sizeof(match));
-    for (j = 0; j < an; ++j) {
-        // For every descriptor in a, find best match in b.
-        float best = l1_distance(a[j].data, b[0].data, a[j].n); // <- best distance
-        int bind = 0; // <- best index
-        for (i = 1; i < bn; i++) {
-            float match = l1_distance(a[j].data, b[i].data, a[j].n);
-            if (match < best) {
-                best = match;
-                bind = i;
-            }
-        }
-        // record ai as the index in *a and bi as the index in *b.
-        m[j].ai = j;
-        m[j].bi = bind; // <- should be index in b.
-        m[j].p = a[j].p; // points in a and b
-        m[j].q = b[bind].p;
-        m[j].distance = best; // <- should be the smallest L1 distance!
-    }
-
-    int count = 0;
-    int *seen = calloc(bn, sizeof(int));
-
-    // Matches should be injective (one-to-one).
-    // Sort matches based on distance using match_compare and qsort.
-    qsort(m, an, sizeof(match), &match_compare);
-    // Throw out matches to the same element in b. Use seen to keep track.
-    for (i = 0; i < an; i++) {
-        int inSeen = 0;
-        for (j = 0; j < count; j++) {
-            if (m[i].bi == seen[j]) {
-                inSeen = 1;
-                break;
-            }
-        }
-        if (!inSeen) {
-            // add the new index to seen and move to open space in list
-            m[count] = m[i];
-            seen[count] = m[count].bi;
-            count++;
-        }
-    }
-    // Each point should only be a part of one match.
-    // Some points will not be in a match.
-    // In practice just bring good matches to front of list, set *mn.
-
-    *mn = count;
-    free(seen);
+    descriptor_index *ix = make_descriptor_index(b, bn, INDEX_EXACT);
+    match *m = match_descriptors_index(a, an, ix, 0, mn);
+    free_descriptor_index(ix);
     return m;
 }
 
@@ -209,6 +159,7 @@ point project_point(matrix H, point p)
     // Have to divide by.... something...
     point q = make_point(result.data[0][0] / result.data[2][0], 
         result.data[1][0] / result.data[2][0]);
+    free_matrix(result);
     free_matrix(c);
     return q;
 }
@@ -253,18 +204,64 @@ int model_inliers(matrix H, match *m, int n, float thresh)
     return count;
 }
 
-// Randomly shuffle matches for RANSAC.
-// match *m: matches to shuffle in place.
-// int n: number of elements in matches.
-void randomize_matches(match *m, int n)
+// Solves the 8x8 system A x = b by Gaussian elimination with partial
+// pivoting, leaving x in b. Small enough to live on the stack.
+// returns: 0 if A is (numerically) singular, 1 otherwise.
+static int solve8(double A[8][8], double b[8])
 {
-    // implement Fisher-Yates to shuffle the array.
-    for (int i = n - 1; i > 0; i--) {
-        int r = rand() % (i + 1);
-        match t = m[i];
-        m[i] = m[r];
-        m[r] = t;
+    int i, j, k;
+    double scale = 0;
+    for(i = 0; i < 8; ++i){
+        for(j = 0; j < 8; ++j) scale = MAX(scale, fabs(A[i][j]));
     }
+    for(k = 0; k < 8; ++k){
+        int p = k;
+        for(i = k+1; i < 8; ++i) if(fabs(A[i][k]) > fabs(A[p][k])) p = i;
+        if(fabs(A[p][k]) <= scale*1e-12) return 0;
+        if(p != k){
+            for(j = k; j < 8; ++j){
+                double t = A[k][j]; A[k][j] = A[p][j]; A[p][j] = t;
+            }
+            double t = b[k]; b[k] = b[p]; b[p] = t;
+        }
+        for(i = k+1; i < 8; ++i){
+            double f = A[i][k]/A[k][k];
+            for(j = k; j < 8; ++j) A[i][j] -= f*A[k][j];
+            b[i] -= f*b[k];
+        }
+    }
+    for(k = 7; k >= 0; --k){
+        for(j = k+1; j < 8; ++j) b[k] -= A[k][j]*b[j];
+        b[k] /= A[k][k];
+    }
+    return 1;
+}
+
+// The two rows match p -> q adds to the homography system, with h22 = 1:
+// [x y 1 0 0 0 -x*xp -y*xp] h = xp and [0 0 0 x y 1 -x*yp -y*yp] h = yp.
+static void homography_rows(match mt, double r0[8], double r1[8], double *b0, double *b1)
+{
+    double x = mt.p.x, y = mt.p.y, xp = mt.q.x, yp = mt.q.y;
+    r0[0] = x; r0[1] = y; r0[2] = 1; r0[3] = 0; r0[4] = 0; r0[5] = 0;
+    r0[6] = -x*xp; r0[7] = -y*xp;
+    r1[0] = 0; r1[1] = 0; r1[2] = 0; r1[3] = x; r1[4] = y; r1[5] = 1;
+    r1[6] = -x*yp; r1[7] = -y*yp;
+    *b0 = xp;
+    *b1 = yp;
+}
+
+// Exact homography through 4 matches, written row-major into h.
+// returns: 0 if the points are degenerate (e.g. three in a line).
+static int homography4(const match *m, double h[9])
+{
+    double A[8][8];
+    int i;
+    for(i = 0; i < 4; ++i){
+        homography_rows(m[i], A[2*i], A[2*i+1], &h[2*i], &h[2*i+1]);
+    }
+    if(!solve8(A, h)) return 0;
+    h[8] = 1;
+    return 1;
 }
 
 // Computes homography between two images given matching pixels.
@@ -273,66 +270,214 @@ void randomize_matches(match *m, int n)
 // returns: matrix representing homography H that maps image a to image b.
 matrix compute_homography(match *matches, int n)
 {
-    // TODO: Should we always be calling with at least 4 matches?
-    matrix M = make_matrix(n*2, 8);
-    matrix b = make_matrix(n*2, 1);
+    matrix none = {0};
+    double h[9];
+    if(n < 4) return none;
+    if(n == 4){
+        if(!homography4(matches, h)) return none;
+    } else {
+        // Least squares through the normal equations, (Mt M) h = Mt b,
+        // accumulated row by row instead of building M.
+        double A[8][8] = {{0}};
+        double r[2][8], rb[2];
+        int i, j, k, t;
+        for(j = 0; j < 8; ++j) h[j] = 0;
+        for(i = 0; i < n; ++i){
+            homography_rows(matches[i], r[0], r[1], &rb[0], &rb[1]);
+            for(t = 0; t < 2; ++t){
+                for(j = 0; j < 8; ++j){
+                    for(k = 0; k < 8; ++k) A[j][k] += r[t][j]*r[t][k];
+                    h[j] += r[t][j]*rb[t];
+                }
+            }
+        }
+        if(!solve8(A, h)) return none;
+        h[8] = 1;
+    }
+
+    matrix H = make_matrix(3, 3);
+    int i;
+    for(i = 0; i < 9; ++i) H.data[i/3][i%3] = h[i];
+    return H;
+}
+
+// Hypotheses RANSAC draws and scores between checks of the stopping rule.
+// Fixed, so the result never depends on how many threads score them.
+#define RANSAC_ROUND 256
+// Probability that some sample was all inliers when RANSAC stops early.
+#define RANSAC_CONFIDENCE .995
+
+typedef struct{
+    float *px, *py, *qx, *qy;   // Matches as separate arrays so scoring vectorizes
+    int n;
+    float thresh;
+    unsigned seed;
+    long first;                 // Index of the round's first hypothesis
+    double (*h)[9];             // Model for each hypothesis in the round
+    int *inliers;               // And its inlier count, -1 if degenerate
+} ransac_job;
+
+static unsigned long long splitmix64(unsigned long long *s)
+{
+    unsigned long long z = (*s += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Whether H maps (x, y) within thresh of (qx, qy). Scoring and the final
+// partition of the matches both use this so their counts agree.
+static inline int is_inlier(const float *h, float x, float y, float qx, float qy, float thresh)
+{
+    float w = h[6]*x + h[7]*y + h[8];
+    float dx = (h[0]*x + h[1]*y + h[2])/w - qx;
+    float dy = (h[3]*x + h[4]*y + h[5])/w - qy;
+    return dx*dx + dy*dy < thresh*thresh;
+}
 
+static int count_inliers(const ransac_job *job, const double *hd)
+{
+    float h[9];
     int i;
+    for(i = 0; i < 9; ++i) h[i] = hd[i];
+    int count = 0;
+    for(i = 0; i < job->n; ++i){
+        count += is_inlier(h, job->px[i], job->py[i], job->qx[i], job->qy[i], job->thresh);
+    }
+    return count;
+}
+
+// Moves the matches H agrees with to the front of m.
+// returns: how many there are.
+static int partition_inliers(const double *hd, match *m, int n, float thresh)
+{
+    float h[9];
+    int i, count = 0;
+    for(i = 0; i < 9; ++i) h[i] = hd[i];
     for(i = 0; i < n; ++i){
-        double x  = matches[i].p.x;
-        double xp = matches[i].q.x;
-        double y  = matches[i].p.y;
-        double yp = matches[i].q.y;
-        int row = i * 2;
-        // M row 0
-        M.data[row][0] = x;
-        M.data[row][1] = y;
-        M.data[row][2] = 1.0;
-        M.data[row][6] = -x * xp;
-        M.data[row][7] = -y * xp;
-        // b row 0
-        b.data[row][0] = xp;
-        // M row 1
-        row++;
-        M.data[row][3] = x;
-        M.data[row][4] = y;
-        M.data[row][5] = 1.0;
-        M.data[row][6] = -x * yp;
-        M.data[row][7] = -y * yp;
-        // b row 1
-        b.data[row][0] = yp;
+        if(is_inlier(h, m[i].p.x, m[i].p.y, m[i].q.x, m[i].q.y, thresh)){
+            match t = m[count];
+            m[count] = m[i];
+            m[i] = t;
+            ++count;
+        }
     }
-    matrix a;
-    // TODO: should there be error handleing here and return empty matrix 
-    // if some step would crash?
-    // a = (Mt * M)^-1 * Mt * b
-    matrix Mt = transpose_matrix(M);
-    a = matrix_mult_matrix(matrix_mult_matrix(
-        matrix_invert(matrix_mult_matrix(Mt, M)), Mt), b);
-    free_matrix(Mt);
-     
-    free_matrix(M); free_matrix(b); 
-
-    // If a solution can't be found, return empty matrix;
-    matrix none = {0};
-    if(!a.data) return none;
+    return count;
+}
 
-    matrix H = make_matrix(3, 3);
-    // Fill in the homography H based on the result in a.
-    H.data[0][0] = a.data[0][0];
-    H.data[0][1] = a.data[1][0];
-    H.data[0][2] = a.data[2][0];
-    H.data[1][0] = a.data[3][0];
-    H.data[1][1] = a.data[4][0];
-    H.data[1][2] = a.data[5][0];
-    H.data[2][0] = a.data[6][0];
-    H.data[2][1] = a.data[7][0];
-    H.data[2][2] = 1.0;
-    free_matrix(a);
-    return H;
+// Draws and scores hypotheses [start, end) of the current round. Each
+// hypothesis has its own random stream keyed by the seed and its index,
+// so 4 distinct matches are picked without touching the shared array.
+static void ransac_hypotheses(void *ctx, int start, int end)
+{
+    ransac_job *job = (ransac_job *)ctx;
+    const float *px = job->px, *py = job->py, *qx = job->qx, *qy = job->qy;
+    int t;
+    for(t = start; t < end; ++t){
+        unsigned long long s = ((unsigned long long)job->seed << 32) ^ (job->first + t);
+        s = splitmix64(&s);
+        int idx[4];
+        int i = 0;
+        while(i < 4){
+            int r = ((splitmix64(&s) >> 32) * job->n) >> 32;
+            int j;
+            for(j = 0; j < i && idx[j] != r; ++j);
+            if(j == i) idx[i++] = r;
+        }
+        match sample[4];
+        for(i = 0; i < 4; ++i){
+            sample[i].p = make_point(px[idx[i]], py[idx[i]]);
+            sample[i].q = make_point(qx[idx[i]], qy[idx[i]]);
+        }
+        if(homography4(sample, job->h[t])) job->inliers[t] = count_inliers(job, job->h[t]);
+        else job->inliers[t] = -1;
+    }
+}
+
+// Samples needed to see an all-inlier set of 4 with RANSAC_CONFIDENCE
+// when a fraction w of the matches are inliers.
+static long ransac_needed(double w)
+{
+    double w4 = w*w*w*w;
+    if(w4 >= 1) return 0;
+    if(w4 <= 0) return LONG_MAX;
+    double need = ceil(log(1 - RANSAC_CONFIDENCE)/log(1 - w4));
+    return need < LONG_MAX ? (long)need : LONG_MAX;
+}
+
+// RANSAC with an explicit seed: the same seed gives the same homography
+// on any number of threads. Hypotheses are drawn RANSAC_ROUND at a time
+// and scored in parallel, and the search stops once the best inlier
+// ratio so far makes more samples pointless (or k is reached, or the
+// inlier count passes cutoff).
+// match *m: set of matches, reordered so the final inliers come first.
+// int n: number of matches.
+// float thresh: inlier/outlier distance threshold.
+// int k: most iterations to run.
+// int cutoff: inlier cutoff to exit early.
+// unsigned seed: seed for the samples.
+// returns: matrix representing most common homography between matches.
+matrix RANSAC_seeded(match *m, int n, float thresh, int k, int cutoff, unsigned seed)
+{
+    matrix Hb = make_translation_homography(256, 0);
+    if(n < 4) return Hb;
+
+    ransac_job job;
+    job.px = calloc(4*n, sizeof(float));
+    job.py = job.px + n;
+    job.qx = job.py + n;
+    job.qy = job.qx + n;
+    int i;
+    for(i = 0; i < n; ++i){
+        job.px[i] = m[i].p.x;
+        job.py[i] = m[i].p.y;
+        job.qx[i] = m[i].q.x;
+        job.qy[i] = m[i].q.y;
+    }
+    job.n = n;
+    job.thresh = thresh;
+    job.seed = seed;
+    job.h = calloc(RANSAC_ROUND, sizeof(*job.h));
+    job.inliers = calloc(RANSAC_ROUND, sizeof(int));
+
+    int best = 0;
+    double hb[9];
+    long needed = k;
+    long done = 0;
+    while(done < needed && best <= cutoff){
+        int round = MIN(RANSAC_ROUND, needed - done);
+        job.first = done;
+        parallel_for_tiles(round, 16, ransac_hypotheses, &job);
+        done += round;
+        for(i = 0; i < round; ++i){
+            if(job.inliers[i] > best){
+                best = job.inliers[i];
+                memcpy(hb, job.h[i], sizeof(hb));
+            }
+        }
+        if(best) needed = MIN(needed, ransac_needed((double)best/n));
+    }
+
+    if(best){
+        // Refit on every inlier of the best sample.
+        int inliers = partition_inliers(hb, m, n, thresh);
+        matrix H = compute_homography(m, inliers);
+        free_matrix(Hb);
+        if(H.data){
+            Hb = H;
+        } else {
+            Hb = make_matrix(3, 3);
+            for(i = 0; i < 9; ++i) Hb.data[i/3][i%3] = hb[i];
+        }
+    }
+    free(job.px);
+    free(job.h);
+    free(job.inliers);
+    return Hb;
 }
 
 // Perform RANdom SAmple Consensus to calculate homography for noisy matches.
+// Seeded from rand(), so srand makes it repeatable.
 // match *m: set of matches.
 // int n: number of matches.
 // float thresh: inlier/outlier distance threshold.
@@ -341,41 +486,108 @@ matrix compute_homography(match *matches, int n)
 // returns: matrix representing most common homography between matches.
 matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
 {
-    int e;
-    int best = 0;
-    matrix Hb = make_translation_homography(256, 0);
-    // RANSAC algorithm.
-    // for k iterations:
-    for (e = 0; e < k; e++) {
-        // shuffle the matches
-        randomize_matches(m, n);
-        // compute a homography with a few matches (how many??)
-        matrix model = compute_homography(m, 4);
-        // ignore empty models
-        if (model.cols == 0 && model.rows == 0) {
-            free_matrix(model);
-            continue;
-        }
-        int inliers = model_inliers(model, m, n, thresh);
-        // if new homography is better than old (how can you tell?):
-        if (inliers > best) {
-            free_matrix(Hb);
-            // compute updated homography using all inliers
-            Hb = compute_homography(m, inliers);
-            // TODO: do we need to error handle here as well?
-            free_matrix(model);
-            // remember it and how good it is
-            best = inliers;
-            // if it's better than the cutoff:
-            if (best > cutoff) {
-                return Hb;
-            }
+    return RANSAC_seeded(m, n, thresh, k, cutoff, rand());
+}
+
+// combine_images works through the canvas in bands of COMBINE_BAND rows,
+// and canvases over CANVAS_RAM_PIXELS pixels live in a scratch file with
+// each band written out as it is finished.
+#define COMBINE_BAND 256
+
+typedef struct{
+    image a, b, c;
+    int feather;        // Weight a and b by distance to their borders
+    int dx, dy;         // Offset of c from a's coordinates
+    double h[9];        // Homography from a's coordinates to b's, row-major
+    int x0, y0;         // First column and row to warp, in a's coordinates
+    float x1;           // Columns stop before x1
+    point outline[4];   // b's border in a's coordinates
+    int convex;         // Whether outline can narrow the spans
+} warp_job;
+
+// Columns [*x0, *x1) of row y that can land in b: the x extent of b's
+// outline within a band a pixel either side of the row, so rounding
+// near corners and edges never cuts a sample off.
+static void warp_span(const warp_job *job, float y, int *x0, float *x1)
+{
+    if(!job->convex) return;
+    float lo = INFINITY, hi = -INFINITY;
+    int k;
+    for(k = 0; k < 4; ++k){
+        point p = job->outline[k], q = job->outline[(k+1)%4];
+        // Clip the edge p + t*(q - p) to y-1 <= y <= y+1.
+        float t0 = 0, t1 = 1;
+        if(p.y == q.y){
+            if(fabsf(p.y - y) > 1) continue;
         } else {
-            free_matrix(model);
+            float ta = (y - 1 - p.y)/(q.y - p.y), tb = (y + 1 - p.y)/(q.y - p.y);
+            t0 = MAX(t0, MIN(ta, tb));
+            t1 = MIN(t1, MAX(ta, tb));
+            if(t0 > t1) continue;
         }
+        float xa = p.x + t0*(q.x - p.x), xb = p.x + t1*(q.x - p.x);
+        lo = MIN(lo, MIN(xa, xb));
+        hi = MAX(hi, MAX(xa, xb));
+    }
+    if(lo > hi){
+        *x1 = *x0;
+        return;
     }
+    *x0 = MAX(*x0, (int)floorf(lo) - 1);
+    *x1 = MIN(*x1, ceilf(hi) + 1);
+}
 
-    return Hb;
+// Warps rows [r0, r1) of b into c, every channel per pixel. The row's
+// share of each homogeneous coordinate is computed once per row, and each
+// sample is the same bilinear_interpolate math, reading b directly when
+// the 2x2 neighbourhood is inside it.
+static void warp_rows(void *ctx, int r0, int r1)
+{
+    warp_job *job = (warp_job *)ctx;
+    image b = job->b, c = job->c;
+    const double *h = job->h;
+    size_t plane_b = (size_t)b.w*b.h, plane_c = (size_t)c.w*c.h;
+    int r, i, k;
+    for(r = r0; r < r1; ++r){
+        int j = job->y0 + r;
+        int x0 = job->x0;
+        float x1 = job->x1;
+        warp_span(job, j, &x0, &x1);
+        double hx = h[1]*j, hy = h[4]*j, hw = h[7]*j;
+        float *out = c.data + (size_t)(j - job->dy)*c.w - job->dx;
+        for(i = x0; i < x1; ++i){
+            double w = h[6]*i + hw + h[8];
+            float x = (h[0]*i + hx + h[2])/w;
+            float y = (h[3]*i + hy + h[5])/w;
+            if(!(x >= 0 && x < b.w && y >= 0 && y < b.h)) continue;
+            float xf = floorf(x), yf = floorf(y);
+            float d1 = x - xf, d2 = xf + 1 - x;
+            float d3 = y - yf, d4 = yf + 1 - y;
+            int xi = xf, yi = yf;
+            // Share of b in the pixel: all of it, or by how far the pixel
+            // is inside each image when feathering where they overlap.
+            float t = 1;
+            if(job->feather && i >= 0 && i < job->a.w && j >= 0 && j < job->a.h){
+                float wa = border_distance(i, j, job->a.w, job->a.h);
+                float wb = border_distance(x, y, b.w, b.h);
+                t = wb/(wa + wb);
+            }
+            if(xi + 1 < b.w && yi + 1 < b.h && b.c >= c.c){
+                const float *p = b.data + xi + (size_t)yi*b.w;
+                for(k = 0; k < c.c; ++k, p += plane_b){
+                    float v = (p[0]*d2 + p[1]*d1)*d4 + (p[b.w]*d2 + p[b.w+1]*d1)*d3;
+                    float *o = out + i + k*plane_c;
+                    *o = t == 1 ? v : *o + t*(v - *o);
+                }
+            } else {
+                for(k = 0; k < c.c; ++k){
+                    float v = bilinear_interpolate(b, x, y, k);
+                    float *o = out + i + k*plane_c;
+                    *o = t == 1 ? v : *o + t*(v - *o);
+                }
+            }
+        }
+    }
 }
 
 // Stitches two images together using a projective transformation.
@@ -383,6 +595,17 @@ matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
 // matrix H: homography from image a coordinates to image b coordinates.
 // returns: combined image stitched together.
 image combine_images(image a, image b, matrix H)
+{
+    return combine_images_blend(a, b, H, BLEND_NONE);
+}
+
+// Stitches two images together, blending where they overlap.
+// image a, b: images to stitch.
+// matrix H: homography from image a coordinates to image b coordinates.
+// blend_method method: how to combine the overlap.
+// returns: combined image stitched together, backed by a scratch file if
+//          it is too big for memory. Free it with release_image.
+image combine_images_blend(image a, image b, matrix H, blend_method method)
 {
     matrix Hinv = matrix_invert(H);
 
@@ -399,56 +622,80 @@ image combine_images(image a, image b, matrix H)
     topleft.x = MIN(c1.x, MIN(c2.x, MIN(c3.x, c4.x)));
     topleft.y = MIN(c1.y, MIN(c2.y, MIN(c3.y, c4.y)));
 
+    // Canvases whose pixels can't be counted in an int are from a broken H.
+    double fw = MAX(a.w, botright.x) - MIN(0, topleft.x);
+    double fh = MAX(a.h, botright.y) - MIN(0, topleft.y);
+    if(!(fw > 0 && fh > 0 && fw*fh*a.c < INT_MAX)){
+        fprintf(stderr, "output too big, stopping\n");
+        free_matrix(Hinv);
+        return copy_image(a);
+    }
+
     // Find how big our new image should be and the offsets from image a.
     int dx = MIN(0, topleft.x);
     int dy = MIN(0, topleft.y);
     int w = MAX(a.w, botright.x) - dx;
     int h = MAX(a.h, botright.y) - dy;
 
-    // Can disable this if you are making very big panoramas.
-    // Usually this means there was an error in calculating H.
-    if(w > 7000 || h > 7000){
-        fprintf(stderr, "output too big, stopping\n");
+    int j,k;
+    int disk = (size_t)w*h > CANVAS_RAM_PIXELS;
+    image c = disk ? make_image_disk(w, h, a.c) : make_image(w, h, a.c);
+    if(!c.data){
+        free_matrix(Hinv);
         return copy_image(a);
     }
 
-    int i,j,k;
-    image c = make_image(w, h, a.c);
+    // Image b gets warped into only the rows and spans of c that land
+    // inside its outline.
+    warp_job job;
+    job.a = a;
+    job.b = b;
+    job.c = c;
+    job.feather = method == BLEND_FEATHER;
+    job.dx = dx;
+    job.dy = dy;
+    for(k = 0; k < 9; ++k) job.h[k] = H.data[k/3][k%3];
+    job.x0 = MAX((int)topleft.x, dx);
+    job.x1 = MIN(botright.x, w + dx);
+    int y0 = MAX((int)topleft.y, dy);
+    int y1 = ceilf(MIN(botright.y, h + dy));
+    // b's outline is a convex quad in a's coordinates as long as all of b
+    // lies in front of the camera, otherwise just scan the bounding box.
+    point outline[4] = {make_point(0, 0), make_point(b.w, 0), make_point(b.w, b.h), make_point(0, b.h)};
+    job.convex = 1;
+    for(k = 0; k < 4; ++k){
+        double x = outline[k].x, y = outline[k].y;
+        double wk = Hinv.data[2][0]*x + Hinv.data[2][1]*y + Hinv.data[2][2];
+        if(wk <= 0) job.convex = 0;
+        job.outline[k] = make_point((Hinv.data[0][0]*x + Hinv.data[0][1]*y + Hinv.data[0][2])/wk,
+                                    (Hinv.data[1][0]*x + Hinv.data[1][1]*y + Hinv.data[1][2])/wk);
+    }
 
-    // Paste image a into the new image offset by dx and dy.    
-    for(k = 0; k < a.c; ++k){
-        for(j = 0; j < a.h; ++j){
-            for(i = 0; i < a.w; ++i){
-                float aVal = get_pixel(a, i, j, k);
-                set_pixel(c, i  - dx , j - dy  , k, aVal);
+    int r0, r1;
+    for(r0 = 0; r0 < h; r0 = r1){
+        r1 = MIN(r0 + COMBINE_BAND, h);
+        // Paste image a into the new image offset by dx and dy.
+        int a0 = MAX(r0 + dy, 0), a1 = MIN(r1 + dy, a.h);
+        for(k = 0; k < a.c; ++k){
+            for(j = a0; j < a1; ++j){
+                memcpy(image_row(c, j - dy, k) - dx, image_row(a, j, k), a.w*sizeof(float));
             }
         }
-    }
-    
-    // Paste in image b as well.
-    // TODO: make more efficient, do not run for every pixel in c
-    // Also need to check pixels outside of a since b might extend further
-    // int topX = floorf(c1.x);
-    // int topY = floorf(c1.y);
-    // int botX = ceilf(c4.x);
-    // int botY = ceilf(c4.y);
-    for(k = 0; k < c.c; ++k){
-        for(j = topleft.y; j < botright.y; ++j){
-            for(i = topleft.x; i < botright.x; ++i){
-                point proj = project_point(H, make_point(i, j));
-                if (proj.x >= 0 && proj.x < b.w && proj.y >= 0 && proj.y < b.h) {
-                    float bVal = bilinear_interpolate(b, proj.x, proj.y, k);
-                    set_pixel(c, i - dx, j - dy, k, bVal);
-                }
+        // Paste in image b as well.
+        job.y0 = MAX(y0, r0 + dy);
+        int n = MIN(y1, r1 + dy) - job.y0;
+        if(n > 0) parallel_for(n, warp_rows, &job);
+        if(method == BLEND_MULTIBAND){
+            multiband_blend_band(a, b, c, job.h, dx, dy, floorf(topleft.x), ceilf(botright.x),
+                                 floorf(topleft.y), ceilf(botright.y), r0, r1);
+        }
+        if(disk){
+            for(k = 0; k < c.c; ++k){
+                bin_evict(image_row(c, r0, k), (size_t)(r1 - r0)*w*sizeof(float));
             }
         }
     }
-
-    // You should loop over some points in the new image (which? all?)
-    // and see if their projection from a coordinates to b coordinates falls
-    // inside of the bounds of image b. If so, use bilinear interpolation to
-    // estimate the value of b at that projection, then fill in image c.
-
+    free_matrix(Hinv);
     return c;
 }
 
@@ -461,6 +708,13 @@ image combine_images(image a, image b, matrix H)
 // int iters: number of RANSAC iterations. Typical: 1,000-50,000
 // int cutoff: RANSAC inlier cutoff. Typical: 10-100
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff)
+{
+    return panorama_image_blend(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff, BLEND_NONE);
+}
+
+// Like panorama_image, blending the overlap.
+// blend_method blend: how to combine the overlap, see combine_images_blend.
+image panorama_image_blend(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, blend_method blend)
 {
     srand(10);
     int an = 0;
@@ -490,7 +744,7 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
     free(m);
 
     // Stitch the images together with the homography
-    image comb = combine_images(a, b, H);
+    image comb = combine_images_blend(a, b, H, blend);
     return comb;
 }
 
@@ -500,7 +754,5 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
 // returns: image projected onto cylinder, then flattened.
 image cylindrical_project(image im, float f)
 {
-    //TODO: project image onto a cylinder
-    image c = copy_image(im);
-    return c;
+    return remap_cached(im, REMAP_CYLINDRICAL, f, 0, 0);
 }
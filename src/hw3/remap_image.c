@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "image.h"
+#include "parallel.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Geometric warps as a lookup table plus a gather. A table holds, for
+// every output pixel, the top left of the 2x2 source pixels it samples
+// and the bilinear weights, so remapping costs no trig at all. Tables are
+// cached by warp and size since a panorama's frames all share them.
+
+// Tables kept around for reuse.
+#define REMAP_CACHE 4
+// How far outside the source, in pixels, a sample can be and still count.
+#define REMAP_EDGE 1e-3
+
+struct remap_table{
+    remap_kind kind;
+    int w, h;           // Size of the source and the output
+    float f, k1, k2;    // Focal length and distortion it was built for
+    int *off;           // Top left source pixel per output pixel, -1 outside
+    float *fx, *fy;     // Weights of the right column and bottom row
+};
+
+typedef struct{
+    remap_table *t;
+    int refs;           // Users of t right now
+    unsigned long used; // When t was last handed out, for eviction
+} remap_entry;
+
+static pthread_mutex_t remap_lock = PTHREAD_MUTEX_INITIALIZER;
+static remap_entry remap_cache[REMAP_CACHE];
+static unsigned long remap_clock = 0;
+
+// Where output pixel (x, y) comes from in the source.
+// returns: 0 if it comes from behind the camera.
+static int remap_source(const remap_table *t, double x, double y, double *sx, double *sy)
+{
+    double xc = t->w/2, yc = t->h/2, f = t->f;
+    double u = (x - xc)/f, v = (y - yc)/f;
+    double X, Y, Z;
+    if(t->kind == REMAP_CYLINDRICAL){
+        X = sin(u);
+        Y = v;
+        Z = cos(u);
+    } else if(t->kind == REMAP_SPHERICAL){
+        X = sin(u)*cos(v);
+        Y = sin(v);
+        Z = cos(u)*cos(v);
+    } else {
+        // Undistorting: the source has radial distortion
+        // r' = r(1 + k1 r^2 + k2 r^4).
+        double r2 = u*u + v*v;
+        double s = 1 + t->k1*r2 + t->k2*r2*r2;
+        X = u*s;
+        Y = v*s;
+        Z = 1;
+    }
+    if(Z <= 0) return 0;
+    *sx = f*X/Z + xc;
+    *sy = f*Y/Z + yc;
+    return 1;
+}
+
+static void fill_rows(void *ctx, int r0, int r1)
+{
+    remap_table *t = (remap_table *)ctx;
+    int x, y;
+    for(y = r0; y < r1; ++y){
+        for(x = 0; x < t->w; ++x){
+            size_t i = x + (size_t)y*t->w;
+            double sx, sy;
+            t->off[i] = -1;
+            t->fx[i] = t->fy[i] = 0;
+            if(!remap_source(t, x, y, &sx, &sy)) continue;
+            // Sources a rounding error past the edge still count as on it.
+            if(!(sx > -REMAP_EDGE && sx < t->w - 1 + REMAP_EDGE && sy > -REMAP_EDGE && sy < t->h - 1 + REMAP_EDGE)) continue;
+            sx = MIN(MAX(sx, 0), t->w - 1);
+            sy = MIN(MAX(sy, 0), t->h - 1);
+            // On the last row or column, sample the pair before it with
+            // all the weight on the edge, so all four taps are inside.
+            int xi = MIN((int)sx, t->w - 2), yi = MIN((int)sy, t->h - 2);
+            t->off[i] = xi + yi*t->w;
+            t->fx[i] = sx - xi;
+            t->fy[i] = sy - yi;
+        }
+    }
+}
+
+// Makes the lookup table for a warp of w x h images.
+// remap_kind kind: which warp.
+// int w, h: size of the images, source and output alike.
+// float f: focal length in pixels.
+// float k1, k2: radial distortion for REMAP_UNDISTORT, unused otherwise.
+// returns: the table, or 0 for images too small to sample.
+remap_table *make_remap_table(remap_kind kind, int w, int h, float f, float k1, float k2)
+{
+    if(w < 2 || h < 2) return 0;
+    remap_table *t = calloc(1, sizeof(remap_table));
+    size_t n = (size_t)w*h;
+    t->kind = kind;
+    t->w = w;
+    t->h = h;
+    t->f = f;
+    t->k1 = k1;
+    t->k2 = k2;
+    t->off = malloc(n*sizeof(int));
+    t->fx = malloc(n*sizeof(float));
+    t->fy = malloc(n*sizeof(float));
+    parallel_for(h, fill_rows, t);
+    return t;
+}
+
+void free_remap_table(remap_table *t)
+{
+    if(!t) return;
+    free(t->off);
+    free(t->fx);
+    free(t->fy);
+    free(t);
+}
+
+typedef struct{
+    image im, out;
+    const remap_table *t;
+} remap_job;
+
+static void remap_rows(void *ctx, int r0, int r1)
+{
+    remap_job *job = (remap_job *)ctx;
+    const remap_table *t = job->t;
+    int w = t->w, y, c;
+    for(c = 0; c < job->im.c; ++c){
+        const float *src = image_channel(job->im, c);
+        for(y = r0; y < r1; ++y){
+            const int *off = t->off + (size_t)y*w;
+            const float *fx = t->fx + (size_t)y*w, *fy = t->fy + (size_t)y*w;
+            float *dst = image_row(job->out, y, c);
+            int i = 0;
+#if defined(__AVX2__)
+            __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+            __m256i none = _mm256_set1_epi32(-1), right = _mm256_set1_epi32(1), down = _mm256_set1_epi32(w);
+            for(; i + 8 <= w; i += 8){
+                __m256i o = _mm256_loadu_si256((const __m256i *)(off + i));
+                __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(o, none));
+                __m256i ob = _mm256_add_epi32(o, down);
+                __m256 p00 = _mm256_mask_i32gather_ps(zero, src, o, valid, 4);
+                __m256 p01 = _mm256_mask_i32gather_ps(zero, src, _mm256_add_epi32(o, right), valid, 4);
+                __m256 p10 = _mm256_mask_i32gather_ps(zero, src, ob, valid, 4);
+                __m256 p11 = _mm256_mask_i32gather_ps(zero, src, _mm256_add_epi32(ob, right), valid, 4);
+                __m256 dx = _mm256_loadu_ps(fx + i), dy = _mm256_loadu_ps(fy + i);
+                __m256 ex = _mm256_sub_ps(one, dx);
+                __m256 top = _mm256_add_ps(_mm256_mul_ps(p00, ex), _mm256_mul_ps(p01, dx));
+                __m256 bot = _mm256_add_ps(_mm256_mul_ps(p10, ex), _mm256_mul_ps(p11, dx));
+                __m256 v = _mm256_add_ps(_mm256_mul_ps(top, _mm256_sub_ps(one, dy)), _mm256_mul_ps(bot, dy));
+                _mm256_storeu_ps(dst + i, _mm256_and_ps(v, valid));
+            }
+#endif
+            for(; i < w; ++i){
+                if(off[i] < 0){
+                    dst[i] = 0;
+                    continue;
+                }
+                const float *p = src + off[i];
+                float top = p[0]*(1 - fx[i]) + p[1]*fx[i];
+                float bot = p[w]*(1 - fx[i]) + p[w+1]*fx[i];
+                dst[i] = top*(1 - fy[i]) + bot*fy[i];
+            }
+        }
+    }
+}
+
+// Warps an image through a lookup table, bilinear sampling every channel.
+// image im: image to warp, the size the table was made for.
+// remap_table *t: the warp.
+// returns: the warped image, black where nothing maps.
+image remap_image(image im, const remap_table *t)
+{
+    if(!t || im.w != t->w || im.h != t->h){
+        fprintf(stderr, "remap table doesn't fit a %d x %d image\n", im.w, im.h);
+        return copy_image(im);
+    }
+    remap_job job;
+    job.im = im;
+    job.out = make_image(im.w, im.h, im.c);
+    job.t = t;
+    parallel_for(im.h, remap_rows, &job);
+    return job.out;
+}
+
+// Gets a table from the cache, making it on a miss. Tables in use are
+// never evicted, and when all of them are busy the new one just isn't
+// cached.
+static remap_table *acquire_table(remap_kind kind, int w, int h, float f, float k1, float k2)
+{
+    int i;
+    remap_table *t = 0, *made = 0;
+    while(1){
+        pthread_mutex_lock(&remap_lock);
+        for(i = 0; i < REMAP_CACHE; ++i){
+            remap_table *c = remap_cache[i].t;
+            if(c && c->kind == kind && c->w == w && c->h == h && c->f == f && c->k1 == k1 && c->k2 == k2){
+                ++remap_cache[i].refs;
+                remap_cache[i].used = ++remap_clock;
+                t = c;
+                break;
+            }
+        }
+        if(!t && made){
+            int slot = -1;
+            for(i = 0; i < REMAP_CACHE; ++i){
+                if(remap_cache[i].refs) continue;
+                if(slot < 0 || !remap_cache[i].t || (remap_cache[slot].t && remap_cache[i].used < remap_cache[slot].used)) slot = i;
+            }
+            if(slot >= 0){
+                free_remap_table(remap_cache[slot].t);
+                remap_cache[slot].t = made;
+                remap_cache[slot].refs = 1;
+                remap_cache[slot].used = ++remap_clock;
+            }
+            t = made;
+            made = 0;
+        }
+        pthread_mutex_unlock(&remap_lock);
+        if(t) break;
+        // Build outside the lock, then look again in case another thread
+        // got there first.
+        made = make_remap_table(kind, w, h, f, k1, k2);
+        if(!made) return 0;
+    }
+    free_remap_table(made);
+    return t;
+}
+
+static void release_table(remap_table *t)
+{
+    int i;
+    pthread_mutex_lock(&remap_lock);
+    for(i = 0; i < REMAP_CACHE; ++i){
+        if(remap_cache[i].t == t){
+            --remap_cache[i].refs;
+            t = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&remap_lock);
+    free_remap_table(t);
+}
+
+// Warps an image with a cached table.
+// returns: the warped image, or a copy if the image is too small to warp.
+image remap_cached(image im, remap_kind kind, float f, float k1, float k2)
+{
+    remap_table *t = acquire_table(kind, im.w, im.h, f, k1, k2);
+    if(!t) return copy_image(im);
+    image out = remap_image(im, t);
+    release_table(t);
+    return out;
+}
+
+// Project an image onto a sphere.
+// image im: image to project.
+// float f: focal length used to take image (in pixels).
+// returns: image projected onto a sphere, then flattened.
+image spherical_project(image im, float f)
+{
+    return remap_cached(im, REMAP_SPHERICAL, f, 0, 0);
+}
+
+// Removes radial lens distortion.
+// image im: image to correct.
+// float f: focal length in pixels.
+// float k1, k2: distortion coefficients, r' = r(1 + k1 r^2 + k2 r^4) for
+//               radii r in units of f from the image centre.
+// returns: the corrected image.
+image undistort_image(image im, float f, float k1, float k2)
+{
+    return remap_cached(im, REMAP_UNDISTORT, f, k1, k2);
+}
@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+#include "matrix.h"
+#include "parallel.h"
+
+// Stitching many images at once. Every image is detected and described
+// once, pairs are matched and fit in parallel, and the pairwise
+// homographies that pass a verification test form a graph. The images
+// are then chained to a reference through its maximum spanning tree and
+// composited in one pass.
+
+// Lowe's ratio test for pairwise matches.
+#define STITCH_RATIO .8f
+// A pair is verified when it has more than STITCH_MIN_INLIERS +
+// STITCH_INLIER_RATIO*matches inliers, counting the matches that land in
+// the overlap (Brown and Lowe). Their ratio is .3 for SIFT; raw patch
+// descriptors match less reliably, so true pairs on low texture scenes
+// like the field only reach a quarter or so.
+#define STITCH_MIN_INLIERS 8
+#define STITCH_INLIER_RATIO .1f
+
+typedef struct{
+    int i, j;
+    int inliers;        // 0 unless the pair was verified
+    matrix H;           // i's coordinates to j's
+} stitch_pair;
+
+typedef struct{
+    image *ims;
+    descriptor_set *sets;
+    descriptor **d;
+    descriptor_index **ix;
+    stitch_pair *pairs;
+    float sigma, thresh, inlier_thresh;
+    int nms, iters, cutoff;
+} stitch_job;
+
+static void detect_images(void *ctx, int start, int end)
+{
+    stitch_job *job = (stitch_job *)ctx;
+    int i;
+    for(i = start; i < end; ++i){
+        job->sets[i] = harris_corner_set(job->ims[i], job->sigma, job->thresh, job->nms);
+        job->ix[i] = make_descriptor_index_set(job->sets[i], INDEX_KDFOREST);
+        job->d[i] = descriptor_set_view(job->sets[i]);
+    }
+}
+
+// returns: how many matches H carries from their first image into b,
+//          the matches an overlap this size should explain.
+static int overlap_matches(matrix H, match *m, int n, image b)
+{
+    double *h = H.data[0], *g = H.data[1], *f = H.data[2];
+    int i, count = 0;
+    for(i = 0; i < n; ++i){
+        double x = m[i].p.x, y = m[i].p.y;
+        double w = f[0]*x + f[1]*y + f[2];
+        double bx = (h[0]*x + h[1]*y + h[2])/w, by = (g[0]*x + g[1]*y + g[2])/w;
+        count += w > 0 && bx >= 0 && bx < b.w && by >= 0 && by < b.h;
+    }
+    return count;
+}
+
+static void match_pairs(void *ctx, int start, int end)
+{
+    stitch_job *job = (stitch_job *)ctx;
+    int k, mn = 0;
+    for(k = start; k < end; ++k){
+        stitch_pair *p = job->pairs + k;
+        match *m = match_descriptors_index(job->d[p->i], job->sets[p->i].n, job->ix[p->j], STITCH_RATIO, &mn);
+        // Seeded by pair, so the graph doesn't depend on the thread count.
+        p->H = RANSAC_seeded(m, mn, job->inlier_thresh, job->iters, job->cutoff, k + 1);
+        int inliers = mn >= 4 ? model_inliers(p->H, m, mn, job->inlier_thresh) : 0;
+        p->inliers = inliers > STITCH_MIN_INLIERS + STITCH_INLIER_RATIO*overlap_matches(p->H, m, mn, job->ims[p->j]) ? inliers : 0;
+        free(m);
+    }
+}
+
+// Picks the centre of the largest connected set of images: the image
+// that reaches the most others, in the fewest hops.
+static int pick_reference(stitch_pair *pairs, int np, int n)
+{
+    int *hops = calloc(n, sizeof(int));
+    int i, k, best = 0, best_reach = -1, best_depth = 0;
+    for(i = 0; i < n; ++i){
+        for(k = 0; k < n; ++k) hops[k] = -1;
+        hops[i] = 0;
+        int reach = 1, depth = 0, grew = 1;
+        while(grew){
+            grew = 0;
+            for(k = 0; k < np; ++k){
+                stitch_pair *p = pairs + k;
+                if(!p->inliers) continue;
+                int a = p->i, b = p->j;
+                if(hops[a] == depth && hops[b] < 0) hops[b] = depth + 1;
+                else if(hops[b] == depth && hops[a] < 0) hops[a] = depth + 1;
+                else continue;
+                ++reach;
+                grew = 1;
+            }
+            if(grew) ++depth;
+        }
+        if(reach > best_reach || (reach == best_reach && depth < best_depth)){
+            best = i;
+            best_reach = reach;
+            best_depth = depth;
+        }
+    }
+    free(hops);
+    return best;
+}
+
+// Finds homographies that put a set of overlapping images in one frame.
+// image *ims: images to stitch.
+// int n: number of images.
+// float sigma, thresh, int nms: harris corner detector settings.
+// float inlier_thresh, int iters, int cutoff: RANSAC settings.
+// int window: only match images at most window apart in ims, e.g. 2 for
+//             a sweep in order, or 0 to try every pair.
+// matrix *H: filled with n homographies from the reference image to each
+//            image. Images that couldn't be connected get an empty matrix.
+// returns: index of the reference image.
+int panorama_homographies(image *ims, int n, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, int window, matrix *H)
+{
+    int i, j, k, np = 0;
+    if(window <= 0 || window >= n) window = n - 1;
+    stitch_job job;
+    job.ims = ims;
+    job.sets = calloc(n, sizeof(descriptor_set));
+    job.d = calloc(n, sizeof(descriptor *));
+    job.ix = calloc(n, sizeof(descriptor_index *));
+    job.pairs = calloc((size_t)n*window, sizeof(stitch_pair));
+    job.sigma = sigma;
+    job.thresh = thresh;
+    job.nms = nms;
+    job.inlier_thresh = inlier_thresh;
+    job.iters = iters;
+    job.cutoff = cutoff;
+    for(i = 0; i < n; ++i){
+        for(j = i + 1; j < n && j - i <= window; ++j){
+            job.pairs[np].i = i;
+            job.pairs[np].j = j;
+            ++np;
+        }
+    }
+    parallel_for_tiles(n, 1, detect_images, &job);
+    parallel_for_tiles(np, 1, match_pairs, &job);
+
+    // Grow the maximum spanning tree of verified pairs out from the
+    // reference, chaining each new image's homography through its parent.
+    int ref = pick_reference(job.pairs, np, n);
+    for(i = 0; i < n; ++i) H[i] = (matrix){0};
+    H[ref] = make_identity_homography();
+    while(1){
+        stitch_pair *best = 0;
+        for(k = 0; k < np; ++k){
+            stitch_pair *p = job.pairs + k;
+            if(p->inliers && !H[p->i].data != !H[p->j].data && (!best || p->inliers > best->inliers)) best = p;
+        }
+        if(!best) break;
+        if(H[best->i].data){
+            H[best->j] = matrix_mult_matrix(best->H, H[best->i]);
+        } else {
+            matrix inv = matrix_invert(best->H);
+            if(!inv.data){
+                best->inliers = 0;
+                continue;
+            }
+            H[best->i] = matrix_mult_matrix(inv, H[best->j]);
+            free_matrix(inv);
+        }
+    }
+    for(i = 0; i < n; ++i){
+        if(!H[i].data) fprintf(stderr, "image %d doesn't overlap the others, leaving it out\n", i);
+    }
+
+    for(k = 0; k < np; ++k) free_matrix(job.pairs[k].H);
+    for(i = 0; i < n; ++i){
+        free_descriptor_index(job.ix[i]);
+        free_descriptors(job.d[i], job.sets[i].n);
+    }
+    free(job.pairs);
+    free(job.ix);
+    free(job.d);
+    free(job.sets);
+    return ref;
+}
+
+// Create a panorama from many images at once.
+// image *ims: images to stitch.
+// int n: number of images.
+// float sigma, thresh, int nms: harris corner detector settings.
+// float inlier_thresh, int iters, int cutoff: RANSAC settings.
+// int window: how far apart in ims images can be and still be matched,
+//             or 0 to match every pair. See panorama_homographies.
+// blend_method blend: how to combine overlaps, see composite_images.
+// returns: the panorama in the frame of the best connected image, see
+//          composite_images.
+image panorama_images(image *ims, int n, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, int window, blend_method blend)
+{
+    matrix *H = calloc(n, sizeof(matrix));
+    panorama_homographies(ims, n, sigma, thresh, nms, inlier_thresh, iters, cutoff, window, H);
+    image pan = composite_images(ims, H, n, blend);
+    int i;
+    for(i = 0; i < n; ++i) free_matrix(H[i]);
+    free(H);
+    return pan;
+}
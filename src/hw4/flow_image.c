@@ -10,6 +10,11 @@
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 // Draws a line on an image with color corresponding to the direction of line
 // image im: image to draw line on
@@ -48,68 +53,108 @@ void draw_line(image im, float x, float y, float dx, float dy)
 
 // Get helper
 
-// Make an integral image or summed area table from an image
-// image im: image to process
-// returns: image I such that I[x,y] = sum{i<=x, j<=y}(im[i,j])
-image make_integral_image(image im)
-{
-    image integ = make_image(im.w, im.h, im.c);
+typedef struct{
+    image im, out;
+    int s;
+} box_job;
 
-    for (int c = 0; c < im.c; c++) {
+// Builds the summed area table for channels [c0, c1).
+static void integral_channels(void *ctx, int c0, int c1)
+{
+    box_job *job = ctx;
+    image im = job->im, integ = job->out;
+    for (int c = c0; c < c1; c++) {
+        // column-major order keeps float rounding identical to the
+        // reference tables in data/
         for (int x = 0; x < im.w; x++) {
             for (int y = 0; y < im.h; y++) {
-                float i = get_pixel(im, x, y, c);
+                float i = PIXEL(im, x, y, c);
                 float I_up = 0, I_left = 0, I_kitty = 0;
 
                 // check if values are safe to fetch, zero if not
-                if (y > 0) I_up = get_pixel(integ, x, y - 1, c);
-                if (x > 0) I_left = get_pixel(integ, x - 1, y, c);
-                if (x > 0 && y > 0) I_kitty = get_pixel(integ, x - 1, y - 1, c);
+                if (y > 0) I_up = PIXEL(integ, x, y - 1, c);
+                if (x > 0) I_left = PIXEL(integ, x - 1, y, c);
+                if (x > 0 && y > 0) I_kitty = PIXEL(integ, x - 1, y - 1, c);
 
-                set_pixel(integ, x, y, c, i + I_up + I_left - I_kitty);
+                PIXEL(integ, x, y, c) = i + I_up + I_left - I_kitty;
             }
         }
     }
+}
 
-    return integ;
+// Make an integral image or summed area table from an image
+// image im: image to process
+// returns: image I such that I[x,y] = sum{i<=x, j<=y}(im[i,j])
+image make_integral_image(image im)
+{
+    box_job job;
+    job.im = im;
+    job.out = make_image(im.w, im.h, im.c);
+    // each channel is a separate scan, so channels run in parallel
+    parallel_for_tiles(im.c, 1, integral_channels, &job);
+    return job.out;
 }
 
-// Apply a box filter to an image using an integral image for speed
-// image im: image to smooth
-// int s: window size for box filter
-// returns: smoothed image
-image box_filter_image(image im, int s)
+// Box filters rows [y0, y1) of every channel from the integral image.
+static void box_filter_rows(void *ctx, int y0, int y1)
 {
-    image integ = make_integral_image(im);
-    image S = make_image(im.w, im.h, im.c);
-    int offset = s / 2;
+    box_job *job = ctx;
+    image integ = job->im, S = job->out;
+    int offset = job->s / 2;
 
-    for (int c = 0; c < im.c; c++) {
-        for (int x = 0; x < im.w; x++) {
-            for (int y = 0; y < im.h; y++) {
+    for (int c = 0; c < S.c; c++) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < S.w; x++) {
                 // calculate corners, we want A,B,C to be the pixels just outside the window
                 int x_min = MAX(x - offset - 1, -1);
-                int x_max = MIN(x + offset, im.w - 1);
+                int x_max = MIN(x + offset, S.w - 1);
                 int y_min = MAX(y - offset - 1, -1);
-                int y_max = MIN(y + offset, im.h - 1);
+                int y_max = MIN(y + offset, S.h - 1);
 
                 // set initial corner values
                 float A = 0, B = 0, C = 0;
-                float D = get_pixel(integ, x_max, y_max, c);
+                float D = PIXEL(integ, x_max, y_max, c);
 
                 // check if values are safe to fetch, zero if not
-                if (x_min >= 0) C = get_pixel(integ, x_min, y_max, c);
-                if (y_min >= 0) B = get_pixel(integ, x_max, y_min, c);
-                if (x_min >= 0 && y_min >= 0) A = get_pixel(integ, x_min, y_min, c);
+                if (x_min >= 0) C = PIXEL(integ, x_min, y_max, c);
+                if (y_min >= 0) B = PIXEL(integ, x_max, y_min, c);
+                if (x_min >= 0 && y_min >= 0) A = PIXEL(integ, x_min, y_min, c);
                 
                 // compute the actual box coordinates
                 float boxSize = (x_max - x_min) * (y_max - y_min);
-                set_pixel(S, x, y, c, (D - B - C + A ) / boxSize);
+                PIXEL(S, x, y, c) = (D - B - C + A ) / boxSize;
             }
         }
     }
+}
+
+// Apply a box filter to an image using an integral image for speed
+// image im: image to smooth
+// int s: window size for box filter
+// returns: smoothed image
+image box_filter_image(image im, int s)
+{
+    image integ = make_image(im.w, im.h, im.c);
+    image out = make_image(im.w, im.h, im.c);
+    box_filter_image_into(im, s, integ, out);
     free_image(integ);
-    return S;
+    return out;
+}
+
+// box_filter_image into buffers the caller keeps, for loops that filter
+// the same size images over and over.
+// image integ: scratch for the integral image, the size of im.
+// image out: the smoothed image, the size of im. May not be im.
+void box_filter_image_into(image im, int s, image integ, image out)
+{
+    box_job job;
+    job.im = im;
+    job.out = integ;
+    parallel_for_tiles(im.c, 1, integral_channels, &job);
+    job.im = integ;
+    job.out = out;
+    job.s = s;
+    parallel_for(im.h, box_filter_rows, &job);
 }
 
 // Calculate the time-structure matrix of an image pair.
@@ -133,17 +178,17 @@ image time_structure_matrix(image im, image prev, int s)
     image S_p = make_image(im.w, im.h, 5);
 
     // fill in corresponding measures
-    for (int x = 0; x < im.w; x++) {
-        for (int y = 0; y < im.h; y++) {
-            float xDer = get_pixel(Ix, x, y, 0);
-            float yDer = get_pixel(Iy, x, y, 0);
-            float It = get_pixel(im, x, y, 0) - get_pixel(prev, x, y, 0);
-            set_pixel(S_p, x, y, 0, xDer * xDer);
-            set_pixel(S_p, x, y, 1, yDer * yDer);
-            set_pixel(S_p, x, y, 2, xDer * yDer);
-            set_pixel(S_p, x, y, 3, xDer * It);
-            set_pixel(S_p, x, y, 4, yDer * It);
-        }
+    float *S_c[5];
+    for (int c = 0; c < 5; c++) S_c[c] = image_channel(S_p, c);
+    for (int i = 0; i < im.w * im.h; i++) {
+        float xDer = Ix.data[i];
+        float yDer = Iy.data[i];
+        float It = im.data[i] - prev.data[i];
+        S_c[0][i] = xDer * xDer;
+        S_c[1][i] = yDer * yDer;
+        S_c[2][i] = xDer * yDer;
+        S_c[3][i] = xDer * It;
+        S_c[4][i] = yDer * It;
     }
 
     image S =  box_filter_image(S_p, s);
@@ -159,49 +204,122 @@ image time_structure_matrix(image im, image prev, int s)
     return S;
 }
 
+// Solves [Ixx Ixy; Ixy Iyy] v = -[Ixt; Iyt] for n pixels in closed form.
+// Windows with no texture at all have no solution and get zero velocity.
+// conf, if given, gets the smaller eigenvalue of each system: how well
+// the window pins down the motion in its weakest direction.
+static void solve_flow_row(const float *xx, const float *yy, const float *xy,
+    const float *xt, const float *yt, float *vx, float *vy, float *conf, int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    __m256 zero = _mm256_setzero_ps(), half = _mm256_set1_ps(.5f);
+    for(; i + 8 <= n; i += 8){
+        __m256 a = _mm256_loadu_ps(xx + i), c = _mm256_loadu_ps(yy + i), b = _mm256_loadu_ps(xy + i);
+        __m256 p = _mm256_loadu_ps(xt + i), q = _mm256_loadu_ps(yt + i);
+        __m256 det = _mm256_sub_ps(_mm256_mul_ps(a, c), _mm256_mul_ps(b, b));
+        __m256 ok = _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ);
+        __m256 inv = _mm256_and_ps(_mm256_div_ps(_mm256_set1_ps(1), det), ok);
+        // v = -A^-1 [p q] = [b*q - c*p, b*p - a*q] / det
+        _mm256_storeu_ps(vx + i, _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(b, q), _mm256_mul_ps(c, p)), inv));
+        _mm256_storeu_ps(vy + i, _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(b, p), _mm256_mul_ps(a, q)), inv));
+        if(conf){
+            __m256 mean = _mm256_mul_ps(half, _mm256_add_ps(a, c));
+            __m256 d = _mm256_mul_ps(half, _mm256_sub_ps(a, c));
+            __m256 r = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(d, d), _mm256_mul_ps(b, b)));
+            _mm256_storeu_ps(conf + i, _mm256_sub_ps(mean, r));
+        }
+    }
+#elif defined(__ARM_NEON)
+    float32x4_t zero = vdupq_n_f32(0), half = vdupq_n_f32(.5f);
+    for(; i + 4 <= n; i += 4){
+        float32x4_t a = vld1q_f32(xx + i), c = vld1q_f32(yy + i), b = vld1q_f32(xy + i);
+        float32x4_t p = vld1q_f32(xt + i), q = vld1q_f32(yt + i);
+        float32x4_t det = vmlsq_f32(vmulq_f32(a, c), b, b);
+        uint32x4_t ok = vmvnq_u32(vceqq_f32(det, zero));
+        float32x4_t inv = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(vdivq_f32(vdupq_n_f32(1), det)), ok));
+        vst1q_f32(vx + i, vmulq_f32(vmlsq_f32(vmulq_f32(b, q), c, p), inv));
+        vst1q_f32(vy + i, vmulq_f32(vmlsq_f32(vmulq_f32(b, p), a, q), inv));
+        if(conf){
+            float32x4_t mean = vmulq_f32(half, vaddq_f32(a, c));
+            float32x4_t d = vmulq_f32(half, vsubq_f32(a, c));
+            vst1q_f32(conf + i, vsubq_f32(mean, vsqrtq_f32(vmlaq_f32(vmulq_f32(d, d), b, b))));
+        }
+    }
+#endif
+    for(; i < n; ++i){
+        float a = xx[i], c = yy[i], b = xy[i], p = xt[i], q = yt[i];
+        float det = a*c - b*b;
+        float inv = det != 0 ? 1/det : 0;
+        vx[i] = (b*q - c*p)*inv;
+        vy[i] = (b*p - a*q)*inv;
+        if(conf){
+            float d = .5f*(a - c);
+            conf[i] = .5f*(a + c) - sqrtf(d*d + b*b);
+        }
+    }
+}
+
+typedef struct{
+    image S, v;
+    int stride;
+    int conf;       // write the smaller eigenvalue to v's third channel
+} velocity_job;
+
+// Solves output rows [j0, j1). Strided pixels are gathered into a
+// contiguous row first so the solve runs on whole rows.
+static void velocity_rows(void *ctx, int j0, int j1)
+{
+    velocity_job *job = ctx;
+    image S = job->S, v = job->v;
+    int stride = job->stride, off = (stride - 1)/2;
+    float *row = stride > 1 ? malloc(5*v.w*sizeof(float)) : 0;
+    int i, j, k;
+    for(j = j0; j < j1; ++j){
+        const float *s[5];
+        int y = j*stride + off;
+        for(k = 0; k < 5; ++k){
+            s[k] = image_row(S, y, k) + off;
+            if(row){
+                float *dst = row + k*v.w;
+                for(i = 0; i < v.w; ++i) dst[i] = s[k][i*stride];
+                s[k] = dst;
+            }
+        }
+        solve_flow_row(s[0], s[1], s[2], s[3], s[4], image_row(v, j, 0), image_row(v, j, 1),
+            job->conf ? image_row(v, j, 2) : 0, v.w);
+    }
+    free(row);
+}
+
+static image solve_velocity(image S, int stride, int conf)
+{
+    velocity_job job;
+    job.S = S;
+    job.v = make_image(S.w/stride, S.h/stride, 3);
+    job.stride = stride;
+    job.conf = conf;
+    parallel_for(job.v.h, velocity_rows, &job);
+    return job.v;
+}
+
 // Calculate the velocity given a structure image
 // image S: time-structure image
 // int stride: only calculate subset of pixels for speed
 image velocity_image(image S, int stride)
 {
-    image v = make_image(S.w/stride, S.h/stride, 3);
-    int i, j;
-    matrix M = make_matrix(2,2);
-    matrix N = make_matrix(2,1);
-    for(j = (stride-1)/2; j < S.h; j += stride){
-        for(i = (stride-1)/2; i < S.w; i += stride){
-            float Ixx = S.data[i + S.w*j + 0*S.w*S.h];
-            float Iyy = S.data[i + S.w*j + 1*S.w*S.h];
-            float Ixy = S.data[i + S.w*j + 2*S.w*S.h];
-            float Ixt = S.data[i + S.w*j + 3*S.w*S.h];
-            float Iyt = S.data[i + S.w*j + 4*S.w*S.h];
-
-            // set up the matrixes
-            M.data[0][0] = Ixx;
-            M.data[0][1] = Ixy;
-            M.data[1][0] = Ixy;
-            M.data[1][1] = Iyy;
-
-            N.data[0][0] = -Ixt;
-            N.data[1][0] = -Iyt;
-
-            // Do the equation
-            matrix Mi = matrix_invert(M);
-            matrix result = matrix_mult_matrix(Mi, N);
-            float vx = result.data[0][0];
-            float vy = result.data[1][0];
+    return solve_velocity(S, stride, 0);
+}
 
-            set_pixel(v, i/stride, j/stride, 0, vx);
-            set_pixel(v, i/stride, j/stride, 1, vy);
-            
-            //free the matricies
-            free_matrix(Mi);
-            free_matrix(result); 
-        }
-    }
-    free_matrix(M);
-    free_matrix(N);
-    return v;
+// Calculate the velocity and how far to trust it.
+// image S: time-structure image
+// int stride: only calculate subset of pixels for speed
+// returns: velocity_image's x and y velocity, and the smaller eigenvalue
+//          of each structure matrix in the third channel. Velocities where
+//          it is small are mostly noise.
+image velocity_confidence_image(image S, int stride)
+{
+    return solve_velocity(S, stride, 1);
 }
 
 // Draw lines on an image given the velocity
@@ -262,29 +380,65 @@ void optical_flow_webcam(int smooth, int stride, int div)
 #ifdef OPENCV
     void * cap;
     cap = open_video_stream(0, 0, 1280, 720, 30);
-    image prev = get_image_from_stream(cap);
-    image prev_c = nn_resize(prev, prev.w/div, prev.h/div);
     image im = get_image_from_stream(cap);
-    image im_c = nn_resize(im, im.w/div, im.h/div);
+    if(!im.data) return;
+    // One level and one step: a single Lucas-Kanade solve against the last
+    // frame's gradients, with the flow box filtered over the window after
+    // the update. The last frame's grayscale, gradients and window sums
+    // are kept instead of redone.
+    flow_session *s = make_flow_session(im.w/div, im.h/div, 1, smooth, 1);
     while(im.data){
-        image copy = copy_image(im);
-        image v = optical_flow_images(im_c, prev_c, smooth, stride);
-        draw_flow(copy, v, smooth*div);
-        int key = show_image(copy, "flow", 5);
+        image im_c = nn_resize(im, im.w/div, im.h/div);
+        image v = flow_session_next(s, im_c, stride);
+        // The session's flow is in pixels. velocity_image solves with Sobel
+        // gradients that aren't divided by 8, so its velocities are 1/8 of
+        // that, and smooth*div was the scale for those.
+        draw_flow(im, v, smooth*div/8.);
+        int key = show_image(im, "flow", 5);
         free_image(v);
-        free_image(copy);
-        free_image(prev);
-        free_image(prev_c);
-        prev = im;
-        prev_c = im_c;
+        free_image(im_c);
+        free_image(im);
+        if(key != -1) {
+            key = key % 256;
+            printf("%d\n", key);
+            if (key == 27) break;
+        }
+        im = get_image_from_stream(cap);
+    }
+    free_flow_session(s);
+#else
+    fprintf(stderr, "Must compile with OpenCV\n");
+#endif
+}
+
+// Run coarse to fine optical flow demo on webcam, at full resolution.
+// Each frame's pyramid is built once and kept as the next frame's
+// template.
+// int smooth: window size for the Lucas-Kanade sums
+// int stride: downsampling for velocity matrix
+// int levels: pyramid levels, 0 to pick from the frame size
+void optical_flow_webcam_pyramid(int smooth, int stride, int levels)
+{
+#ifdef OPENCV
+    void * cap;
+    cap = open_video_stream(0, 0, 1280, 720, 30);
+    image im = get_image_from_stream(cap);
+    if(!im.data) return;
+    flow_session *s = make_flow_session(im.w, im.h, levels, smooth, 3);
+    while(im.data){
+        image v = flow_session_next(s, im, stride);
+        draw_flow(im, v, stride/4.);
+        int key = show_image(im, "flow", 5);
+        free_image(v);
+        free_image(im);
         if(key != -1) {
             key = key % 256;
             printf("%d\n", key);
             if (key == 27) break;
         }
         im = get_image_from_stream(cap);
-        im_c = nn_resize(im, im.w/div, im.h/div);
     }
+    free_flow_session(s);
 #else
     fprintf(stderr, "Must compile with OpenCV\n");
 #endif
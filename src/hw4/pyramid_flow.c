@@ -0,0 +1,489 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+#include "parallel.h"
+
+// Coarse to fine Lucas-Kanade. Each frame becomes a grayscale Gaussian
+// pyramid with gradients once, so a video pays for one new pyramid per
+// frame. The flow found on a coarse level seeds the next finer one, and
+// on every level the current frame is warped by the flow so far and the
+// motion that is left is solved for, a few times over. Motion far too big
+// for one linearization at full resolution is a pixel or two on the
+// coarse levels.
+//
+// Gradients are taken on the previous frame, the template, so the 2x2
+// system of each window only depends on it and is inverted once a level.
+
+// Smallest side a level of an automatic pyramid may have.
+#define FLOW_MIN_SIZE 16
+#define FLOW_MAX_LEVELS 8
+// Warp and solve steps on each level.
+#define FLOW_ITERS 3
+// Windows whose smaller eigenvalue is below this have too little texture
+// to pin down both directions, so their flow is left as it is.
+#define FLOW_MIN_EIG 1e-6f
+
+// Per level working buffers for one frame pair.
+typedef struct{
+    int levels;
+    image *work;    // 3 channels: template products, then residual products
+    image *filt;    // 3 channels: windowed residual products
+    image *integ;   // 3 channels: box filter scratch
+    image *flow;    // 2 channels: flow of the level, x and y
+    image *flat;    // 2 channels: flow held flat over the window
+} flow_buffers;
+
+static int pyramid_levels(int w, int h, int levels)
+{
+    if(levels > 0) return levels;
+    levels = 1;
+    while(levels < FLOW_MAX_LEVELS && MIN(w, h) >> levels >= FLOW_MIN_SIZE) ++levels;
+    return levels;
+}
+
+static image *make_level_images(flow_pyramid p, int c)
+{
+    image *ims = calloc(p.levels, sizeof(image));
+    int i;
+    for(i = 0; i < p.levels; ++i) ims[i] = make_image(p.im[i].w, p.im[i].h, c);
+    return ims;
+}
+
+static void free_level_images(image *ims, int levels)
+{
+    int i;
+    if(!ims) return;
+    for(i = 0; i < levels; ++i) free_image(ims[i]);
+    free(ims);
+}
+
+static flow_pyramid alloc_flow_pyramid(int w, int h, int levels)
+{
+    flow_pyramid p;
+    int i;
+    p.levels = levels;
+    p.im = calloc(levels, sizeof(image));
+    for(i = 0; i < levels; ++i){
+        p.im[i] = make_image(w, h, 1);
+        w = (w + 1)/2;
+        h = (h + 1)/2;
+    }
+    p.dx = make_level_images(p, 1);
+    p.dy = make_level_images(p, 1);
+    return p;
+}
+
+static flow_buffers alloc_flow_buffers(flow_pyramid p)
+{
+    flow_buffers b;
+    b.levels = p.levels;
+    b.work = make_level_images(p, 3);
+    b.filt = make_level_images(p, 3);
+    b.integ = make_level_images(p, 3);
+    b.flow = make_level_images(p, 2);
+    b.flat = make_level_images(p, 2);
+    return b;
+}
+
+static void free_flow_buffers(flow_buffers b)
+{
+    free_level_images(b.work, b.levels);
+    free_level_images(b.filt, b.levels);
+    free_level_images(b.integ, b.levels);
+    free_level_images(b.flow, b.levels);
+    free_level_images(b.flat, b.levels);
+}
+
+// The same image with fewer channels, sharing the data.
+static image channels_view(image im, int c)
+{
+    im.c = c;
+    return im;
+}
+
+typedef struct{
+    image im, dx, dy;
+} gradient_job;
+
+// Sobel gradients of rows [y0, y1), scaled to intensity per pixel since
+// the filters weigh 8 pixel differences. Borders are clamped.
+static void gradient_rows(void *ctx, int y0, int y1)
+{
+    gradient_job *job = ctx;
+    int w = job->im.w, h = job->im.h, x, y;
+    for(y = y0; y < y1; ++y){
+        const float *u = image_row(job->im, MAX(y - 1, 0), 0);
+        const float *m = image_row(job->im, y, 0);
+        const float *d = image_row(job->im, MIN(y + 1, h - 1), 0);
+        float *gx = image_row(job->dx, y, 0), *gy = image_row(job->dy, y, 0);
+        for(x = 0; x < w; ++x){
+            int l = MAX(x - 1, 0), r = MIN(x + 1, w - 1);
+            gx[x] = (u[r] - u[l] + 2*(m[r] - m[l]) + d[r] - d[l])*.125f;
+            gy[x] = (d[l] - u[l] + 2*(d[x] - u[x]) + d[r] - u[r])*.125f;
+        }
+    }
+}
+
+// Fills a pyramid from a frame the size of its first level.
+// float *tmp: scratch for (w+1)/2 x h floats.
+static void fill_flow_pyramid(flow_pyramid p, image frame, float *tmp)
+{
+    int i, n = frame.w*frame.h;
+    float *g = p.im[0].data;
+    if(frame.c == 3){
+        const float *r = image_channel(frame, 0), *gr = image_channel(frame, 1), *b = image_channel(frame, 2);
+        for(i = 0; i < n; ++i) g[i] = 0.299f*r[i] + 0.587f*gr[i] + 0.114f*b[i];
+    } else {
+        memcpy(g, frame.data, n*sizeof(float));
+    }
+    for(i = 0; i < p.levels; ++i){
+        if(i > 0){
+            image scratch = {p.im[i].w, p.im[i-1].h, 1, tmp};
+            pyramid_down_into(p.im[i-1], scratch, p.im[i]);
+        }
+        gradient_job job = {p.im[i], p.dx[i], p.dy[i]};
+        parallel_for(p.im[i].h, gradient_rows, &job);
+    }
+}
+
+// Prepares a frame for pyramid_flow.
+// image im: the frame, grayscale or rgb.
+// int levels: number of levels, or 0 to halve the frame until its
+//             smaller side would drop below FLOW_MIN_SIZE.
+// returns: the pyramid, free with free_flow_pyramid.
+flow_pyramid make_flow_pyramid(image im, int levels)
+{
+    flow_pyramid p = alloc_flow_pyramid(im.w, im.h, pyramid_levels(im.w, im.h, levels));
+    float *tmp = malloc((size_t)(im.w + 1)/2*im.h*sizeof(float));
+    fill_flow_pyramid(p, im, tmp);
+    free(tmp);
+    return p;
+}
+
+void free_flow_pyramid(flow_pyramid p)
+{
+    free_level_images(p.im, p.levels);
+    free_level_images(p.dx, p.levels);
+    free_level_images(p.dy, p.levels);
+}
+
+// Bilinear sample of a w x h plane, clamping (x, y) to the plane.
+static inline float sample_clamped(const float *p, int w, int h, float x, float y)
+{
+    x = MIN(MAX(x, 0), w - 1);
+    y = MIN(MAX(y, 0), h - 1);
+    int xi = x, yi = y;
+    int x1 = xi + (xi < w - 1), y1 = yi + (yi < h - 1);
+    float fx = x - xi, fy = y - yi;
+    const float *r0 = p + (size_t)yi*w, *r1 = p + (size_t)y1*w;
+    float top = r0[xi] + fx*(r0[x1] - r0[xi]);
+    float bot = r1[xi] + fx*(r1[x1] - r1[xi]);
+    return top + fy*(bot - top);
+}
+
+typedef struct{
+    image cur, prev, dx, dy;    // One level of each pyramid
+    image flow;                 // Flow so far, x and y channels
+    image A;                    // Windowed template products, then their inverse
+    image b;                    // Gradient times residual, then windowed
+    image coarse;               // The level above's flow, to upsample
+} level_job;
+
+// Gradient products of the template for rows [y0, y1).
+static void template_rows(void *ctx, int y0, int y1)
+{
+    level_job *job = ctx;
+    int w = job->prev.w, x, y;
+    for(y = y0; y < y1; ++y){
+        const float *gx = image_row(job->dx, y, 0), *gy = image_row(job->dy, y, 0);
+        float *xx = image_row(job->A, y, 0), *yy = image_row(job->A, y, 1), *xy = image_row(job->A, y, 2);
+        for(x = 0; x < w; ++x){
+            xx[x] = gx[x]*gx[x];
+            yy[x] = gy[x]*gy[x];
+            xy[x] = gx[x]*gy[x];
+        }
+    }
+}
+
+// Replaces the windowed products [Ixx Ixy; Ixy Iyy] of rows [y0, y1)
+// with their inverse, or zeros where the window is too flat to solve.
+static void invert_rows(void *ctx, int y0, int y1)
+{
+    level_job *job = ctx;
+    int w = job->prev.w, x, y;
+    for(y = y0; y < y1; ++y){
+        float *xx = image_row(job->A, y, 0), *yy = image_row(job->A, y, 1), *xy = image_row(job->A, y, 2);
+        for(x = 0; x < w; ++x){
+            float a = xx[x], c = yy[x], b = xy[x];
+            float det = a*c - b*b;
+            float d = .5f*(a - c);
+            float min_eig = .5f*(a + c) - sqrtf(d*d + b*b);
+            if(min_eig < FLOW_MIN_EIG){
+                xx[x] = yy[x] = xy[x] = 0;
+                continue;
+            }
+            xx[x] = c/det;
+            yy[x] = a/det;
+            xy[x] = -b/det;
+        }
+    }
+}
+
+// Warps the current frame by the flow and multiplies what is left of the
+// difference to the template by the template's gradients.
+static void residual_rows(void *ctx, int y0, int y1)
+{
+    level_job *job = ctx;
+    int w = job->cur.w, h = job->cur.h, x, y;
+    for(y = y0; y < y1; ++y){
+        const float *u = image_row(job->flow, y, 0), *v = image_row(job->flow, y, 1);
+        const float *t = image_row(job->prev, y, 0);
+        const float *gx = image_row(job->dx, y, 0), *gy = image_row(job->dy, y, 0);
+        float *bx = image_row(job->b, y, 0), *by = image_row(job->b, y, 1);
+        for(x = 0; x < w; ++x){
+            float sx = x + u[x], sy = y + v[x];
+            // Pixels that moved out of the frame say nothing about the motion
+            if(sx < 0 || sx > w - 1 || sy < 0 || sy > h - 1){
+                bx[x] = by[x] = 0;
+                continue;
+            }
+            float e = sample_clamped(job->cur.data, w, h, sx, sy) - t[x];
+            bx[x] = gx[x]*e;
+            by[x] = gy[x]*e;
+        }
+    }
+}
+
+// flow -= A^-1 b for rows [y0, y1), with b the windowed residual products.
+static void update_rows(void *ctx, int y0, int y1)
+{
+    level_job *job = ctx;
+    int w = job->cur.w, x, y;
+    for(y = y0; y < y1; ++y){
+        const float *xx = image_row(job->A, y, 0), *yy = image_row(job->A, y, 1), *xy = image_row(job->A, y, 2);
+        const float *bx = image_row(job->b, y, 0), *by = image_row(job->b, y, 1);
+        float *u = image_row(job->flow, y, 0), *v = image_row(job->flow, y, 1);
+        for(x = 0; x < w; ++x){
+            u[x] -= xx[x]*bx[x] + xy[x]*by[x];
+            v[x] -= xy[x]*bx[x] + yy[x]*by[x];
+        }
+    }
+}
+
+// Samples the coarser level's flow at rows [y0, y1) and scales it to
+// this level's pixels.
+static void upsample_rows(void *ctx, int y0, int y1)
+{
+    level_job *job = ctx;
+    image c = job->coarse, f = job->flow;
+    float sx = (float)c.w/f.w, sy = (float)c.h/f.h;
+    int x, y;
+    for(y = y0; y < y1; ++y){
+        float *u = image_row(f, y, 0), *v = image_row(f, y, 1);
+        float cy = (y + .5f)*sy - .5f;
+        for(x = 0; x < f.w; ++x){
+            float cx = (x + .5f)*sx - .5f;
+            u[x] = sample_clamped(image_channel(c, 0), c.w, c.h, cx, cy)/sx;
+            v[x] = sample_clamped(image_channel(c, 1), c.w, c.h, cx, cy)/sy;
+        }
+    }
+}
+
+// Windows and inverts the template's gradient products on every level.
+// image *ginv: per level 3 channel results.
+static void prepare_template(flow_pyramid prev, flow_buffers b, image *ginv, int smooth)
+{
+    int l;
+    for(l = 0; l < prev.levels; ++l){
+        level_job job;
+        job.prev = prev.im[l];
+        job.dx = prev.dx[l];
+        job.dy = prev.dy[l];
+        job.A = b.work[l];
+        parallel_for(job.prev.h, template_rows, &job);
+        box_filter_image_into(b.work[l], smooth, b.integ[l], ginv[l]);
+        job.A = ginv[l];
+        parallel_for(job.prev.h, invert_rows, &job);
+    }
+}
+
+// Flow from a prepared template to the current frame, left in b.flow[0].
+static void solve_flow(flow_pyramid im, flow_pyramid prev, image *ginv, flow_buffers b, int smooth, int iters)
+{
+    int levels = MIN(im.levels, prev.levels);
+    int l, k;
+    for(l = levels - 1; l >= 0; --l){
+        level_job job;
+        job.cur = im.im[l];
+        job.prev = prev.im[l];
+        job.dx = prev.dx[l];
+        job.dy = prev.dy[l];
+        job.A = ginv[l];
+        job.flow = b.flow[l];
+        int h = job.cur.h;
+        if(l == levels - 1){
+            memset(job.flow.data, 0, (size_t)job.flow.w*h*2*sizeof(float));
+        } else {
+            job.coarse = b.flow[l+1];
+            parallel_for(h, upsample_rows, &job);
+        }
+
+        image work = channels_view(b.work[l], 2), filt = channels_view(b.filt[l], 2);
+        image integ = channels_view(b.integ[l], 2);
+        for(k = 0; k < iters; ++k){
+            job.b = work;
+            parallel_for(h, residual_rows, &job);
+            box_filter_image_into(work, smooth, integ, filt);
+            job.b = filt;
+            parallel_for(h, update_rows, &job);
+            // Each pixel solves with its neighbours' flow, so disagreeing
+            // neighbours feed each other and the solve can ring. Holding
+            // the flow flat over the window, as Lucas-Kanade assumes,
+            // keeps it settling.
+            box_filter_image_into(job.flow, smooth, integ, b.flat[l]);
+            image swap = b.flow[l];
+            b.flow[l] = job.flow = b.flat[l];
+            b.flat[l] = swap;
+        }
+    }
+}
+
+// Dense optical flow between two prepared frames.
+// flow_pyramid im: the current frame.
+// flow_pyramid prev: the previous frame, the same size.
+// int smooth: window size for the Lucas-Kanade sums, on every level.
+// int iters: warp and solve steps per level.
+// returns: two channel image of how far, in pixels, each pixel of prev
+//          moved to reach im.
+image pyramid_flow(flow_pyramid im, flow_pyramid prev, int smooth, int iters)
+{
+    if(im.im[0].w != prev.im[0].w || im.im[0].h != prev.im[0].h){
+        fprintf(stderr, "Flow frames differ in size: %dx%d and %dx%d\n",
+            im.im[0].w, im.im[0].h, prev.im[0].w, prev.im[0].h);
+        return make_image(im.im[0].w, im.im[0].h, 2);
+    }
+    flow_buffers b = alloc_flow_buffers(prev);
+    image *ginv = make_level_images(prev, 3);
+    prepare_template(prev, b, ginv, smooth);
+    solve_flow(im, prev, ginv, b, smooth, iters);
+    image flow = b.flow[0];
+    b.flow[0] = (image){0};
+    free_level_images(ginv, prev.levels);
+    free_flow_buffers(b);
+    return flow;
+}
+
+// Samples a dense flow field every stride pixels, the way velocity_image
+// lays out its output, for draw_flow.
+// returns: w/stride x h/stride image, x and y flow in the first two of
+//          its three channels.
+image sample_flow(image flow, int stride)
+{
+    image v = make_image(flow.w/stride, flow.h/stride, 3);
+    int x, y, c, off = (stride - 1)/2;
+    for(c = 0; c < 2; ++c){
+        for(y = 0; y < v.h; ++y){
+            for(x = 0; x < v.w; ++x){
+                PIXEL(v, x, y, c) = PIXEL(flow, x*stride + off, y*stride + off, c);
+            }
+        }
+    }
+    return v;
+}
+
+// Calculate the optical flow between two images, coarse to fine.
+// image im: current image
+// image prev: previous image
+// int levels: pyramid levels, 0 to pick from the image size
+// int smooth: window size for the Lucas-Kanade sums
+// int stride: downsampling for velocity matrix
+// returns: velocity matrix, in pixels
+image optical_flow_pyramid(image im, image prev, int levels, int smooth, int stride)
+{
+    flow_pyramid a = make_flow_pyramid(im, levels);
+    flow_pyramid b = make_flow_pyramid(prev, levels);
+    image flow = pyramid_flow(a, b, smooth, FLOW_ITERS);
+    image v = sample_flow(flow, stride);
+    free_image(flow);
+    free_flow_pyramid(a);
+    free_flow_pyramid(b);
+    return v;
+}
+
+// A video's frames each play the current frame once and the template
+// once. A session keeps the last frame's pyramid, gradients and inverted
+// window sums, so each frame is only converted, downsampled and
+// differentiated once, and every buffer is made up front and reused.
+struct flow_session{
+    int w, h, smooth, iters;
+    int frames;                 // frames seen so far
+    flow_pyramid pyr[2];        // this frame's and the last one's
+    image *ginv[2];             // their inverted window sums
+    flow_buffers buf;
+    float *tmp;                 // pyramid_down scratch
+};
+
+// Starts a flow session for frames of one size.
+// int w, h: frame size.
+// int levels: pyramid levels, 0 to pick from the frame size.
+// int smooth: window size for the Lucas-Kanade sums.
+// int iters: warp and solve steps per level.
+// returns: the session, free with free_flow_session.
+flow_session *make_flow_session(int w, int h, int levels, int smooth, int iters)
+{
+    flow_session *s = calloc(1, sizeof(flow_session));
+    int i;
+    s->w = w;
+    s->h = h;
+    s->smooth = smooth;
+    s->iters = iters;
+    levels = pyramid_levels(w, h, levels);
+    for(i = 0; i < 2; ++i){
+        s->pyr[i] = alloc_flow_pyramid(w, h, levels);
+        s->ginv[i] = make_level_images(s->pyr[i], 3);
+    }
+    s->buf = alloc_flow_buffers(s->pyr[0]);
+    s->tmp = malloc((size_t)(w + 1)/2*h*sizeof(float));
+    return s;
+}
+
+void free_flow_session(flow_session *s)
+{
+    int i;
+    if(!s) return;
+    for(i = 0; i < 2; ++i){
+        free_flow_pyramid(s->pyr[i]);
+        free_level_images(s->ginv[i], s->pyr[i].levels);
+    }
+    free_flow_buffers(s->buf);
+    free(s->tmp);
+    free(s);
+}
+
+// Adds a frame to a session.
+// image frame: the next frame, grayscale or rgb, the session's size.
+// int stride: downsampling for velocity matrix
+// returns: velocity matrix from the last frame to this one, in pixels,
+//          zero for the first frame.
+image flow_session_next(flow_session *s, image frame, int stride)
+{
+    if(frame.w != s->w || frame.h != s->h){
+        fprintf(stderr, "Flow session is for %dx%d frames, got %dx%d\n", s->w, s->h, frame.w, frame.h);
+        return make_image(frame.w/stride, frame.h/stride, 3);
+    }
+    int cur = s->frames & 1, prev = !cur;
+    fill_flow_pyramid(s->pyr[cur], frame, s->tmp);
+    image v;
+    if(s->frames){
+        solve_flow(s->pyr[cur], s->pyr[prev], s->ginv[prev], s->buf, s->smooth, s->iters);
+        v = sample_flow(s->buf.flow[0], stride);
+    } else {
+        v = make_image(frame.w/stride, frame.h/stride, 3);
+    }
+    // This frame is the next one's template
+    prepare_template(s->pyr[cur], s->buf, s->ginv[cur], s->smooth);
+    ++s->frames;
+    return v;
+}
@@ -95,16 +95,12 @@ matrix backward_layer(layer *l, matrix delta)
     // Calculate dL/dw and save it in l->dw
     // xt * dL/d(xw) where xt is the transpose of the input matrix x.
     free_matrix(l->dw);
-    matrix xt = transpose_matrix(l->in);
-    l->dw = matrix_mult_matrix(xt, delta);
-    free_matrix(xt);
+    l->dw = transpose_mult_matrix(l->in, delta);
 
     // 1.4.3
     // Calculate dL/dx and return it.
     // dL/d(xw) * wt where wt is the transpose of our weights, w
-    matrix wt = transpose_matrix(l->w);
-    matrix dx = matrix_mult_matrix(delta, wt);
-    free_matrix(wt);
+    matrix dx = matrix_mult_transpose(delta, l->w);
 
     return dx;
 }
@@ -265,6 +261,290 @@ void train_model(model m, data d, int batch, int iters, double rate, double mome
     }
 }
 
+// Train a model on a streaming dataset using SGD. Batches come from
+// next_batch, so the dataset's threads decode ahead while this trains.
+// model m: model to train
+// dataset *d: dataset to train on, its batch size is the SGD batch size
+// int iters: number of iterations of SGD to run (i.e. how many batches)
+// double rate: learning rate
+// double momentum: momentum
+// double decay: weight decay
+void train_model_stream(model m, dataset *d, int iters, double rate, double momentum, double decay)
+{
+    int e;
+    for(e = 0; e < iters; ++e){
+        data b = next_batch(d);
+        matrix p = forward_model(m, b.X);
+        fprintf(stderr, "%06d: Loss: %f\n", e, cross_entropy_loss(b.y, p));
+        matrix dL = axpy_matrix(-1, p, b.y); // partial derivative of loss dL/dy
+        backward_model(m, dL);
+        update_model(m, rate/b.X.rows, momentum, decay);
+        free_matrix(dL);
+        free_data(b);
+    }
+}
+
+// Accuracy over the next dataset_size(d) rows of a streaming dataset.
+// Open it fresh and unshuffled so that covers every image exactly once.
+// model m: model to evaluate
+// dataset *d: dataset to evaluate on
+// returns: fraction of rows classified correctly
+double accuracy_model_stream(model m, dataset *d)
+{
+    int n = dataset_size(d);
+    int seen = 0;
+    int correct = 0;
+    while(seen < n){
+        data b = next_batch(d);
+        matrix p = forward_model(m, b.X);
+        int i;
+        for(i = 0; i < b.y.rows && seen < n; ++i, ++seen){
+            if(max_index(b.y.data[i], b.y.cols) == max_index(p.data[i], p.cols)) ++correct;
+        }
+        free_data(b);
+    }
+    return (double)correct / n;
+}
+
+
+// Single precision path. Same math as above on fmatrix, so activations,
+// weights and GEMMs move half the bytes and fill twice the SIMD lanes.
+// The dataset stays double and is converted one batch at a time.
+
+// Float version of activate_matrix.
+// fmatrix m: Input to activation function, modified in place
+// ACTIVATION a: function to run
+void activate_fmatrix(fmatrix m, ACTIVATION a)
+{
+    int i, j;
+    for(i = 0; i < m.rows; ++i){
+        float sum = 0;
+        for(j = 0; j < m.cols; ++j){
+            float x = m.data[i][j];
+            if(a == LOGISTIC){
+                m.data[i][j] = 1.0f / (1.0f + expf(-x));
+            } else if (a == RELU){
+                if (x <= 0) m.data[i][j] = 0.0f;
+            } else if (a == LRELU){
+                if (x <= 0) m.data[i][j] *= 0.1f;
+            } else if (a == SOFTMAX){
+                m.data[i][j] = expf(x);
+            }
+            sum += m.data[i][j];
+        }
+        if (a == SOFTMAX) {
+            for(j = 0; j < m.cols; ++j){
+                m.data[i][j] = m.data[i][j] / sum;
+            }
+        }
+    }
+}
+
+// Float version of gradient_matrix.
+// fmatrix m: an activated layer output
+// ACTIVATION a: activation function for a layer
+// fmatrix d: delta before activation gradient, modified in place
+void gradient_fmatrix(fmatrix m, ACTIVATION a, fmatrix d)
+{
+    int i, j;
+    for (i = 0; i < m.rows; ++i){
+        for (j = 0; j < m.cols; ++j){
+            float x = m.data[i][j];
+            if (a == LOGISTIC){
+                d.data[i][j] *= x - x * x;
+            } else if (a == RELU){
+                if (x <= 0) d.data[i][j] = 0.0f;
+            } else if (a == LRELU){
+                if (x <= 0) d.data[i][j] *= 0.1f;
+            }
+        }
+    }
+}
+
+// Forward propagate through a single precision layer, see forward_layer.
+fmatrix forward_flayer(flayer *l, fmatrix in)
+{
+    l->in = in;
+    fmatrix out = fmatrix_mult_fmatrix(in, l->w);
+    activate_fmatrix(out, l->activation);
+    free_fmatrix(l->out);
+    l->out = out;
+    return out;
+}
+
+// Backward propagate through a single precision layer, see backward_layer.
+fmatrix backward_flayer(flayer *l, fmatrix delta)
+{
+    gradient_fmatrix(l->out, l->activation, delta);
+    free_fmatrix(l->dw);
+    l->dw = transpose_mult_fmatrix(l->in, delta);
+    return fmatrix_mult_transpose(delta, l->w);
+}
+
+// Update a single precision layer, see update_layer.
+void update_flayer(flayer *l, float rate, float momentum, float decay)
+{
+    fmatrix rTimesWPlusDW = axpy_fmatrix(-decay, l->w, l->dw);
+    fmatrix dw_t = axpy_fmatrix(momentum, l->v, rTimesWPlusDW);
+    fmatrix wPlus1 = axpy_fmatrix(rate, dw_t, l->w);
+    free_fmatrix(rTimesWPlusDW);
+    free_fmatrix(l->v);
+    l->v = dw_t;
+    free_fmatrix(l->w);
+    l->w = wPlus1;
+}
+
+// Make a new single precision layer, see make_layer.
+flayer make_flayer(int input, int output, ACTIVATION activation)
+{
+    flayer l;
+    l.in  = make_fmatrix(1,1);
+    l.out = make_fmatrix(1,1);
+    l.w   = random_fmatrix(input, output, sqrt(2./input));
+    l.v   = make_fmatrix(input, output);
+    l.dw  = make_fmatrix(input, output);
+    l.activation = activation;
+    return l;
+}
+
+// Run a single precision model on input X.
+fmatrix forward_fmodel(fmodel m, fmatrix X)
+{
+    int i;
+    for(i = 0; i < m.n; ++i){
+        X = forward_flayer(m.layers + i, X);
+    }
+    return X;
+}
+
+// Run a single precision model backward given gradient dL.
+void backward_fmodel(fmodel m, fmatrix dL)
+{
+    fmatrix d = copy_fmatrix(dL);
+    int i;
+    for(i = m.n-1; i >= 0; --i){
+        fmatrix prev = backward_flayer(m.layers + i, d);
+        free_fmatrix(d);
+        d = prev;
+    }
+    free_fmatrix(d);
+}
+
+void update_fmodel(fmodel m, float rate, float momentum, float decay)
+{
+    int i;
+    for(i = 0; i < m.n; ++i){
+        update_flayer(m.layers + i, rate, momentum, decay);
+    }
+}
+
+// Index of the maximum element of a float array, see max_index.
+static int max_index_f(float *a, int n)
+{
+    if(n <= 0) return -1;
+    int i;
+    int max_i = 0;
+    for (i = 1; i < n; ++i) {
+        if (a[i] > a[max_i]) max_i = i;
+    }
+    return max_i;
+}
+
+// Accuracy of a single precision model on some data d. Runs in chunks so
+// only a few hundred rows are ever converted to float at once.
+// returns: accuracy, number correct / total
+double accuracy_fmodel(fmodel m, data d)
+{
+    int chunk = 256;
+    int i, start;
+    int correct = 0;
+    for(start = 0; start < d.X.rows; start += chunk){
+        int n = MIN(chunk, d.X.rows - start);
+        matrix rows = d.X;
+        rows.rows = n;
+        rows.data = d.X.data + start;
+        fmatrix X = matrix_to_fmatrix(rows);
+        fmatrix p = forward_fmodel(m, X);
+        for(i = 0; i < n; ++i){
+            if(max_index(d.y.data[start+i], d.y.cols) == max_index_f(p.data[i], p.cols)) ++correct;
+        }
+        free_fmatrix(X);
+    }
+    return (double)correct / d.y.rows;
+}
+
+// Cross-entropy loss for single precision predictions, see cross_entropy_loss.
+static double cross_entropy_loss_f(matrix y, fmatrix p)
+{
+    int i, j;
+    double sum = 0;
+    for(i = 0; i < y.rows; ++i){
+        for(j = 0; j < y.cols; ++j){
+            sum += -y.data[i][j]*log(p.data[i][j]);
+        }
+    }
+    return sum/y.rows;
+}
+
+// Train a single precision model with SGD, see train_model.
+void train_fmodel(fmodel m, data d, int batch, int iters, double rate, double momentum, double decay)
+{
+    int e;
+    for(e = 0; e < iters; ++e){
+        data b = random_batch(d, batch);
+        fmatrix X = matrix_to_fmatrix(b.X);
+        fmatrix y = matrix_to_fmatrix(b.y);
+        fmatrix p = forward_fmodel(m, X);
+        fprintf(stderr, "%06d: Loss: %f\n", e, cross_entropy_loss_f(b.y, p));
+        fmatrix dL = axpy_fmatrix(-1, p, y); // partial derivative of loss dL/dy
+        backward_fmodel(m, dL);
+        update_fmodel(m, rate/batch, momentum, decay);
+        free_fmatrix(dL);
+        free_fmatrix(y);
+        free_fmatrix(X);
+        free_data(b);
+    }
+}
+
+// Float version of train_model_stream.
+void train_fmodel_stream(fmodel m, dataset *d, int iters, double rate, double momentum, double decay)
+{
+    int e;
+    for(e = 0; e < iters; ++e){
+        data b = next_batch(d);
+        fmatrix X = matrix_to_fmatrix(b.X);
+        fmatrix y = matrix_to_fmatrix(b.y);
+        fmatrix p = forward_fmodel(m, X);
+        fprintf(stderr, "%06d: Loss: %f\n", e, cross_entropy_loss_f(b.y, p));
+        fmatrix dL = axpy_fmatrix(-1, p, y); // partial derivative of loss dL/dy
+        backward_fmodel(m, dL);
+        update_fmodel(m, rate/b.X.rows, momentum, decay);
+        free_fmatrix(dL);
+        free_fmatrix(y);
+        free_fmatrix(X);
+        free_data(b);
+    }
+}
+
+// Float version of accuracy_model_stream.
+double accuracy_fmodel_stream(fmodel m, dataset *d)
+{
+    int n = dataset_size(d);
+    int seen = 0;
+    int correct = 0;
+    while(seen < n){
+        data b = next_batch(d);
+        fmatrix X = matrix_to_fmatrix(b.X);
+        fmatrix p = forward_fmodel(m, X);
+        int i;
+        for(i = 0; i < b.y.rows && seen < n; ++i, ++seen){
+            if(max_index(b.y.data[i], b.y.cols) == max_index_f(p.data[i], p.cols)) ++correct;
+        }
+        free_fmatrix(X);
+        free_data(b);
+    }
+    return (double)correct / n;
+}
 
 // Questions 
 //
@@ -3,6 +3,7 @@
 #include <stdio.h>
 
 #include "matrix.h"
+#include "parallel.h"
 #define TWOPI 6.2831853
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
@@ -19,6 +20,13 @@ typedef struct{
     float *data;
 } image;
 
+// An image with 8 bits per sample, 0 to 255 for 0 to 1, laid out like image.
+// Use image_u8_to_float when a stage needs floats.
+typedef struct{
+    int w,h,c;
+    unsigned char *data;
+} image_u8;
+
 // A 2d point.
 // float x, y: the coordinates of the point.
 typedef struct{
@@ -45,6 +53,98 @@ typedef struct{
     float distance;
 } match;
 
+// Every descriptor of an image in one block: row i of data describes
+// the pixel at p[i].
+// int n: number of descriptors.
+// int d: floats in each descriptor.
+// int stride: floats between rows, d padded with zeros to a multiple of 8.
+typedef struct{
+    int n, d, stride;
+    float *data;
+    point *p;
+} descriptor_set;
+
+// Nearest neighbours of a query in a descriptor_index: the closest and
+// second closest rows (-1 if missing) and their L1 distances, for ratio tests.
+typedef struct{
+    int i1, i2;
+    float d1, d2;
+} neighbors;
+
+// Backends for a descriptor_index: brute force or a randomized k-d forest.
+typedef enum{
+    INDEX_EXACT, INDEX_KDFOREST
+} index_method;
+
+// Descriptors of one image packed for repeated nearest neighbour queries.
+typedef struct descriptor_index descriptor_index;
+
+// Warps remap_image can apply from a table: projections onto a cylinder
+// or a sphere, and removal of radial lens distortion.
+typedef enum{
+    REMAP_CYLINDRICAL, REMAP_SPHERICAL, REMAP_UNDISTORT
+} remap_kind;
+
+// Per pixel source positions of a warp, built once per image size.
+typedef struct remap_table remap_table;
+
+// Panorama canvases bigger than this many pixels are built in a scratch
+// file rather than in memory.
+#define CANVAS_RAM_PIXELS (7000*7000)
+
+// How combine_images_blend treats the overlap: b over a, a linear
+// feather by distance to each image's border, or multi-band blending
+// across a seam.
+typedef enum{
+    BLEND_NONE, BLEND_FEATHER, BLEND_MULTIBAND
+} blend_method;
+
+// Backends for smooth_image_method, from most accurate to fastest.
+typedef enum{
+    SMOOTH_EXACT, SMOOTH_BOX, SMOOTH_IIR
+} smooth_method;
+
+// How select_corners picks corners when there are too many.
+typedef enum{
+    SELECT_BEST, SELECT_GRID, SELECT_ANMS
+} select_method;
+
+// A frame prepared for pyramidal optical flow: a grayscale Gaussian
+// pyramid, finest level first, with the gradients of every level.
+typedef struct{
+    int levels;
+    image *im;          // Each level half the size of the one before
+    image *dx, *dy;     // Gradients of im, in intensity per pixel
+} flow_pyramid;
+
+// The last frame of a video prepared for optical flow against the next.
+typedef struct flow_session flow_session;
+
+// Direct pixel access for inner loops. These do no bounds checks or
+// clamping, use get_pixel for reads that can fall outside the image.
+#define PIXEL(im, x, y, c) ((im).data[(x) + (im).w*((y) + (im).h*(c))])
+
+// Pointer to the first pixel of channel c.
+static inline float *image_channel(image im, int c)
+{
+    return im.data + (size_t)im.w*im.h*c;
+}
+
+// Pointer to the first pixel of row y in channel c.
+static inline float *image_row(image im, int y, int c)
+{
+    return im.data + (size_t)im.w*(y + (size_t)im.h*c);
+}
+
+// How far (x, y) is inside a w x h image, in pixels, and <= 0 outside:
+// the distance transform of the image's mask, in closed form.
+static inline float border_distance(float x, float y, int w, int h)
+{
+    float dx = x + 1 < w - x ? x + 1 : w - x;
+    float dy = y + 1 < h - y ? y + 1 : h - y;
+    return dx < dy ? dx : dy;
+}
+
 // Basic operations
 float get_pixel(image im, int x, int y, int c);
 void set_pixel(image im, int x, int y, int c, float v);
@@ -63,12 +163,31 @@ image add_image(image a, image b);
 
 // Loading and saving
 image make_image(int w, int h, int c);
+image make_image_disk(int w, int h, int c);
 image load_image(char *filename);
 void save_image(image im, const char *name);
 void save_image_binary(image im, const char *fname);
 image load_image_binary(const char *fname);
+image map_image_binary(const char *fname);
 void save_png(image im, const char *name);
+int load_images(char **paths, int n, int channels, image *ims);
+int save_images(image *ims, char **names, int n, int png);
 void free_image(image im);
+void release_image(image im);
+
+// 8 bit images
+image_u8 make_image_u8(int w, int h, int c);
+image_u8 load_image_u8(char *filename);
+int load_images_u8(char **paths, int n, image_u8 *ims);
+void save_image_u8(image_u8 im, const char *name);
+void save_png_u8(image_u8 im, const char *name);
+image image_u8_to_float(image_u8 im);
+image_u8 image_to_u8(image im);
+image_u8 nn_resize_u8(image_u8 im, int w, int h);
+image_u8 bilinear_resize_u8(image_u8 im, int w, int h);
+image_u8 rgb_to_grayscale_u8(image_u8 im);
+image_u8 box_filter_image_u8(image_u8 im, int s);
+void free_image_u8(image_u8 im);
 
 // Resizing
 float nn_interpolate(image im, float x, float y, int c);
@@ -90,7 +209,9 @@ void l1_normalize(image im);
 void threshold_image(image im, float thresh);
 image *sobel_image(image im);
 image colorize_sobel(image im);
+image make_1d_gaussian(float sigma);
 image smooth_image(image im, float sigma);
+image smooth_image_method(image im, float sigma, smooth_method method);
 
 // Harris and Stitching
 point make_point(float x, float y);
@@ -98,24 +219,73 @@ point project_point(matrix H, point p);
 matrix compute_homography(match *matches, int n);
 image structure_matrix(image im, float sigma);
 image cornerness_response(image S);
+image nms_image(image im, int w);
+int *nms_corners(image im, int w, float thresh, int *n);
 void free_descriptors(descriptor *d, int n);
+descriptor_set make_descriptor_set(int n, int d);
+void free_descriptor_set(descriptor_set s);
+descriptor *descriptor_set_view(descriptor_set s);
+descriptor describe_index(image im, int i);
+descriptor_set describe_corners(image im, int *indexes, int n);
+int *harris_corners(image im, float sigma, float thresh, int nms, int *n);
+int *select_corners(const int *indexes, const float *v, int n, int w, int h, int k,
+    select_method method, int *m);
+int *harris_corners_top(image im, float sigma, int nms, int k, select_method method, int *n);
+descriptor_set harris_corner_set(image im, float sigma, float thresh, int nms);
 image cylindrical_project(image im, float f);
+image spherical_project(image im, float f);
+image undistort_image(image im, float f, float k1, float k2);
+remap_table *make_remap_table(remap_kind kind, int w, int h, float f, float k1, float k2);
+image remap_image(image im, const remap_table *t);
+image remap_cached(image im, remap_kind kind, float f, float k1, float k2);
+void free_remap_table(remap_table *t);
 void mark_corners(image im, descriptor *d, int n);
 image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms);
 void detect_and_draw_corners(image im, float sigma, float thresh, int nms);
 int model_inliers(matrix H, match *m, int n, float thresh);
+matrix RANSAC(match *m, int n, float thresh, int k, int cutoff);
+matrix RANSAC_seeded(match *m, int n, float thresh, int k, int cutoff, unsigned seed);
 image combine_images(image a, image b, matrix H);
+image combine_images_blend(image a, image b, matrix H, blend_method method);
+void multiband_blend_band(image a, image b, image c, const double *h, int dx, int dy,
+    int x0, int x1, int y0, int y1, int r0, int r1);
+image multiband_blend(image *ims, image *masks, int n);
+image pyramid_down(image im);
+void pyramid_down_into(image im, image tmp, image out);
+image composite_images(image *ims, matrix *H, int n, blend_method blend);
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn);
+int match_compare(const void *a, const void *b);
+descriptor_index *make_descriptor_index(descriptor *d, int n, index_method method);
+descriptor_index *make_descriptor_index_set(descriptor_set s, index_method method);
+void query_descriptor_index(descriptor_index *ix, descriptor *q, int n, neighbors *out);
+match *match_descriptors_index(descriptor *a, int an, descriptor_index *b, float ratio, int *mn);
+point descriptor_index_point(descriptor_index *ix, int i);
+void free_descriptor_index(descriptor_index *ix);
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n);
+descriptor *harris_corner_detector_top(image im, float sigma, int nms, int k, select_method method, int *n);
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
+image panorama_image_blend(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, blend_method blend);
+int panorama_homographies(image *ims, int n, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, int window, matrix *H);
+image panorama_images(image *ims, int n, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, int window, blend_method blend);
 
 // Optical Flow
 image make_integral_image(image im);
 image box_filter_image(image im, int s);
+void box_filter_image_into(image im, int s, image integ, image out);
 image time_structure_matrix(image im, image prev, int s);
 image velocity_image(image S, int stride);
+image velocity_confidence_image(image S, int stride);
 image optical_flow_images(image im, image prev, int smooth, int stride);
 void optical_flow_webcam(int smooth, int stride, int div);
+flow_pyramid make_flow_pyramid(image im, int levels);
+void free_flow_pyramid(flow_pyramid p);
+image pyramid_flow(flow_pyramid im, flow_pyramid prev, int smooth, int iters);
+image sample_flow(image flow, int stride);
+image optical_flow_pyramid(image im, image prev, int levels, int smooth, int stride);
+flow_session *make_flow_session(int w, int h, int levels, int smooth, int iters);
+image flow_session_next(flow_session *s, image frame, int stride);
+void free_flow_session(flow_session *s);
+void optical_flow_webcam_pyramid(int smooth, int stride, int levels);
 void draw_flow(image im, image v, float scale);
 
 #ifdef OPENCV
@@ -148,9 +318,43 @@ typedef struct {
     int n;
 } model;
 
+// Single precision layer and model, trained with the *_flayer/*_fmodel
+// functions. Choose one or the other when building the model.
+typedef struct {
+    fmatrix in;
+    fmatrix w;
+    fmatrix dw;
+    fmatrix v;
+    fmatrix out;
+    ACTIVATION activation;
+} flayer;
+
+typedef struct {
+    flayer *layers;
+    int n;
+} fmodel;
+
+// Options for a streaming dataset, see default_dataset_opts.
+typedef struct {
+    int batch;              // Rows in each mini-batch
+    int ring;               // Decoded batches kept ready ahead of training
+    int threads;            // Threads decoding images
+    int shuffle;            // Visit images in a new seeded order each epoch
+    unsigned seed;          // Seed for the shuffle
+    int cache_u8;           // Keep decoded pixels as bytes for later epochs
+} dataset_opts;
+
+// Image list decoded lazily in the background, one mini-batch at a time.
+typedef struct dataset dataset;
+
 data load_classification_data(char *images, char *label_file, int bias);
 void free_data(data d);
 data random_batch(data d, int n);
+dataset_opts default_dataset_opts(int batch);
+dataset *open_dataset(char *images, char *label_file, int bias, dataset_opts opts);
+data next_batch(dataset *d);
+int dataset_size(dataset *d);
+void close_dataset(dataset *d);
 char *fgetl(FILE *fp);
 void activate_matrix(matrix m, ACTIVATION a);
 void gradient_matrix(matrix m, ACTIVATION a, matrix d);
@@ -158,7 +362,21 @@ matrix forward_layer(layer *l, matrix in);
 matrix backward_layer(layer *l, matrix delta);
 void update_layer(layer *l, double rate, double momentum, double decay);
 layer make_layer(int input, int output, ACTIVATION activation);
+void activate_fmatrix(fmatrix m, ACTIVATION a);
+void gradient_fmatrix(fmatrix m, ACTIVATION a, fmatrix d);
+fmatrix forward_flayer(flayer *l, fmatrix in);
+fmatrix backward_flayer(flayer *l, fmatrix delta);
+void update_flayer(flayer *l, float rate, float momentum, float decay);
+flayer make_flayer(int input, int output, ACTIVATION activation);
+fmatrix forward_fmodel(fmodel m, fmatrix X);
+double accuracy_fmodel(fmodel m, data d);
+void train_fmodel(fmodel m, data d, int batch, int iters, double rate, double momentum, double decay);
+void train_model_stream(model m, dataset *d, int iters, double rate, double momentum, double decay);
+void train_fmodel_stream(fmodel m, dataset *d, int iters, double rate, double momentum, double decay);
+double accuracy_model_stream(model m, dataset *d);
+double accuracy_fmodel_stream(fmodel m, dataset *d);
 matrix load_matrix(const char *fname);
+matrix map_matrix(const char *fname);
 void save_matrix(matrix m, const char *fname);
 
 #ifdef __cplusplus
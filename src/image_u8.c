@@ -0,0 +1,299 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+#include "parallel.h"
+#include "stb_image.h"
+#include "stb_image_write.h"
+
+// 8 bit images for work that never needs more than a byte per sample:
+// loading, resizing, graying and box filtering for thumbnails take a
+// quarter of the memory of float images. Anything that needs floats, like
+// convolve_image or harris_corner_detector, takes image_u8_to_float of the
+// result at the point it is needed.
+
+image_u8 make_image_u8(int w, int h, int c)
+{
+    image_u8 out;
+    out.w = w;
+    out.h = h;
+    out.c = c;
+    out.data = calloc((size_t)w*h*c, 1);
+    return out;
+}
+
+void free_image_u8(image_u8 im)
+{
+    free(im.data);
+}
+
+static inline unsigned char *u8_row(image_u8 im, int y, int c)
+{
+    return im.data + ((size_t)c*im.h + y)*im.w;
+}
+
+// Loads an image without going through floats. Alpha is dropped, like
+// load_image.
+// returns: the image, or an empty one if the file can't be read.
+image_u8 load_image_u8(char *filename)
+{
+    image_u8 im = {0};
+    int w, h, c, k;
+    size_t i;
+    unsigned char *data = stbi_load(filename, &w, &h, &c, 0);
+    if(!data){
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        return im;
+    }
+    im = make_image_u8(w, h, c == 4 ? 3 : c);
+    size_t n = (size_t)w*h;
+    for(k = 0; k < im.c; ++k){
+        unsigned char *dst = im.data + k*n;
+        const unsigned char *src = data + k;
+        for(i = 0; i < n; ++i) dst[i] = src[i*c];
+    }
+    free(data);
+    return im;
+}
+
+typedef struct{
+    char **paths;
+    image_u8 *ims;
+    int failed;
+} load_u8_job;
+
+static void load_u8_files(void *ctx, int start, int end)
+{
+    load_u8_job *job = ctx;
+    int i;
+    for(i = start; i < end; ++i){
+        job->ims[i] = load_image_u8(job->paths[i]);
+        if(!job->ims[i].data) __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// load_images for 8 bit images.
+// returns: number of files that failed, their images are empty.
+int load_images_u8(char **paths, int n, image_u8 *ims)
+{
+    load_u8_job job = {paths, ims, 0};
+    parallel_for_tiles(n, 1, load_u8_files, &job);
+    return job.failed;
+}
+
+static void save_image_u8_stb(image_u8 im, const char *name, int png)
+{
+    char buff[256];
+    size_t i, n = (size_t)im.w*im.h;
+    int k;
+    unsigned char *data = malloc(n*im.c);
+    for(k = 0; k < im.c; ++k){
+        const unsigned char *src = im.data + k*n;
+        for(i = 0; i < n; ++i) data[i*im.c + k] = src[i];
+    }
+    int success = 0;
+    if(png){
+        snprintf(buff, sizeof(buff), "%s.png", name);
+        success = stbi_write_png(buff, im.w, im.h, im.c, data, im.w*im.c);
+    } else {
+        snprintf(buff, sizeof(buff), "%s.jpg", name);
+        success = stbi_write_jpg(buff, im.w, im.h, im.c, data, 100);
+    }
+    free(data);
+    if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
+}
+
+void save_image_u8(image_u8 im, const char *name)
+{
+    save_image_u8_stb(im, name, 0);
+}
+
+void save_png_u8(image_u8 im, const char *name)
+{
+    save_image_u8_stb(im, name, 1);
+}
+
+// Promotes an 8 bit image to floats in [0, 1], the same values load_image
+// would have given.
+image image_u8_to_float(image_u8 im)
+{
+    float table[256];
+    int i;
+    for(i = 0; i < 256; ++i) table[i] = i/255.;
+    image out = make_image(im.w, im.h, im.c);
+    size_t k, n = (size_t)im.w*im.h*im.c;
+    for(k = 0; k < n; ++k) out.data[k] = table[im.data[k]];
+    return out;
+}
+
+// Quantizes a float image to 8 bits, clamping to [0, 1].
+image_u8 image_to_u8(image im)
+{
+    image_u8 out = make_image_u8(im.w, im.h, im.c);
+    size_t k, n = (size_t)im.w*im.h*im.c;
+    for(k = 0; k < n; ++k){
+        float v = roundf(255*im.data[k]);
+        out.data[k] = v < 0 ? 0 : v > 255 ? 255 : (unsigned char)v;
+    }
+    return out;
+}
+
+// Source pixel centres of a resize: dst pixel x samples src at
+// (x + .5)*src/dst - .5.
+static inline float resize_source(int x, int src, int dst)
+{
+    return (x + .5f)*src/dst - .5f;
+}
+
+typedef struct{
+    image_u8 im, out;
+    int *x0, *x1;       // source columns of each output column
+    int *fx;            // weight of x1 in 1/256ths
+    int s;              // box filter window
+} u8_job;
+
+static void nn_rows(void *ctx, int y0, int y1)
+{
+    u8_job *job = ctx;
+    image_u8 im = job->im, out = job->out;
+    int c, x, y;
+    for(c = 0; c < out.c; ++c){
+        for(y = y0; y < y1; ++y){
+            int sy = roundf(resize_source(y, im.h, out.h));
+            const unsigned char *src = u8_row(im, MIN(MAX(sy, 0), im.h - 1), c);
+            unsigned char *dst = u8_row(out, y, c);
+            for(x = 0; x < out.w; ++x) dst[x] = src[job->x0[x]];
+        }
+    }
+}
+
+// nn_resize for 8 bit images.
+image_u8 nn_resize_u8(image_u8 im, int w, int h)
+{
+    u8_job job;
+    int x;
+    job.im = im;
+    job.out = make_image_u8(w, h, im.c);
+    job.x0 = malloc(w*sizeof(int));
+    for(x = 0; x < w; ++x){
+        int sx = roundf(resize_source(x, im.w, w));
+        job.x0[x] = MIN(MAX(sx, 0), im.w - 1);
+    }
+    parallel_for(h, nn_rows, &job);
+    free(job.x0);
+    return job.out;
+}
+
+static void bilinear_rows(void *ctx, int y0, int y1)
+{
+    u8_job *job = ctx;
+    image_u8 im = job->im, out = job->out;
+    int c, x, y;
+    for(y = y0; y < y1; ++y){
+        float sy = MIN(MAX(resize_source(y, im.h, out.h), 0), im.h - 1);
+        int r0 = sy, r1 = MIN(r0 + 1, im.h - 1);
+        int fy = (int)((sy - r0)*256 + .5f), ey = 256 - fy;
+        for(c = 0; c < out.c; ++c){
+            const unsigned char *a = u8_row(im, r0, c), *b = u8_row(im, r1, c);
+            unsigned char *dst = u8_row(out, y, c);
+            for(x = 0; x < out.w; ++x){
+                int i0 = job->x0[x], i1 = job->x1[x], fx = job->fx[x], ex = 256 - fx;
+                int top = a[i0]*ex + a[i1]*fx;
+                int bot = b[i0]*ex + b[i1]*fx;
+                dst[x] = (top*ey + bot*fy + (1 << 15)) >> 16;
+            }
+        }
+    }
+}
+
+// bilinear_resize for 8 bit images, in 8 bit fixed point.
+image_u8 bilinear_resize_u8(image_u8 im, int w, int h)
+{
+    u8_job job;
+    int x;
+    job.im = im;
+    job.out = make_image_u8(w, h, im.c);
+    job.x0 = malloc(w*sizeof(int));
+    job.x1 = malloc(w*sizeof(int));
+    job.fx = malloc(w*sizeof(int));
+    for(x = 0; x < w; ++x){
+        float sx = MIN(MAX(resize_source(x, im.w, w), 0), im.w - 1);
+        job.x0[x] = sx;
+        job.x1[x] = MIN(job.x0[x] + 1, im.w - 1);
+        job.fx[x] = (int)((sx - job.x0[x])*256 + .5f);
+    }
+    parallel_for(h, bilinear_rows, &job);
+    free(job.x0);
+    free(job.x1);
+    free(job.fx);
+    return job.out;
+}
+
+// rgb_to_grayscale for 8 bit images, with the weights in 1/256ths.
+image_u8 rgb_to_grayscale_u8(image_u8 im)
+{
+    if(im.c != 3){
+        fprintf(stderr, "rgb_to_grayscale_u8 needs 3 channels, got %d\n", im.c);
+        return (image_u8){0};
+    }
+    image_u8 out = make_image_u8(im.w, im.h, 1);
+    size_t i, n = (size_t)im.w*im.h;
+    const unsigned char *r = im.data, *g = im.data + n, *b = im.data + 2*n;
+    for(i = 0; i < n; ++i) out.data[i] = (77*r[i] + 150*g[i] + 29*b[i] + 128) >> 8;
+    return out;
+}
+
+// Box filters rows [y0, y1) with running column sums, so a band of rows
+// costs two adds per pixel whatever the window.
+static void box_rows(void *ctx, int y0, int y1)
+{
+    u8_job *job = ctx;
+    image_u8 im = job->im, out = job->out;
+    int r = job->s/2, w = im.w, h = im.h;
+    unsigned *col = malloc(w*sizeof(unsigned));
+    int c, x, y, k;
+    for(c = 0; c < im.c; ++c){
+        memset(col, 0, w*sizeof(unsigned));
+        for(k = MAX(y0 - r, 0); k <= MIN(y0 + r, h - 1); ++k){
+            const unsigned char *src = u8_row(im, k, c);
+            for(x = 0; x < w; ++x) col[x] += src[x];
+        }
+        for(y = y0; y < y1; ++y){
+            if(y > y0){
+                if(y + r < h){
+                    const unsigned char *in = u8_row(im, y + r, c);
+                    for(x = 0; x < w; ++x) col[x] += in[x];
+                }
+                if(y - r - 1 >= 0){
+                    const unsigned char *gone = u8_row(im, y - r - 1, c);
+                    for(x = 0; x < w; ++x) col[x] -= gone[x];
+                }
+            }
+            // Windows are cut off at the borders and average what is left
+            int rows = MIN(y + r, h - 1) - MAX(y - r, 0) + 1;
+            unsigned char *dst = u8_row(out, y, c);
+            unsigned sum = 0;
+            for(x = 0; x < MIN(r, w); ++x) sum += col[x];
+            for(x = 0; x < w; ++x){
+                if(x + r < w) sum += col[x + r];
+                if(x - r - 1 >= 0) sum -= col[x - r - 1];
+                unsigned n = rows*(MIN(x + r, w - 1) - MAX(x - r, 0) + 1);
+                dst[x] = (sum + n/2)/n;
+            }
+        }
+    }
+    free(col);
+}
+
+// box_filter_image for 8 bit images. Sums are exact integers.
+image_u8 box_filter_image_u8(image_u8 im, int s)
+{
+    u8_job job;
+    job.im = im;
+    job.out = make_image_u8(im.w, im.h, im.c);
+    job.s = s;
+    parallel_for(im.h, box_rows, &job);
+    return job.out;
+}
@@ -3,6 +3,13 @@
 #include <stdlib.h>
 
 #include "image.h"
+#include "binfile.h"
+#include "parallel.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 image make_empty_image(int w, int h, int c)
 {
@@ -21,31 +28,142 @@ image make_image(int w, int h, int c)
     return out;
 }
 
+// Like make_image but backed by a temporary file instead of the heap, for
+// images too big to keep in memory. Free it with release_image.
+// returns: zeroed image, or an empty image if the file can't be made.
+image make_image_disk(int w, int h, int c)
+{
+    image out = make_empty_image(w,h,c);
+    out.data = bin_map_scratch((size_t)w*h*c*sizeof(float));
+    if(!out.data) out.w = out.h = out.c = 0;
+    return out;
+}
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-void save_image_stb(image im, const char *name, int png)
+// Converts n interleaved pixels of c <= 4 channels to planar floats in
+// [0, 1], planes n floats apart. Values come from a table so they are
+// exactly (float)(v/255.), whatever the vector width.
+static void u8_to_planar(const unsigned char *src, float *dst, int n, int c)
 {
-    char buff[256];
-    unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
-    int i,k;
-    for(k = 0; k < im.c; ++k){
-        for(i = 0; i < im.w*im.h; ++i){
-            data[i*im.c+k] = (unsigned char) roundf((255*im.data[i + k*im.w*im.h]));
+    int i = 0, k;
+    float table[256];
+    for(k = 0; k < 256; ++k) table[k] = k/255.;
+#if defined(__AVX2__)
+    // 16 pixels are c 16 byte chunks. mask[k][q] picks channel k's bytes
+    // out of chunk q into their pixel's lane.
+    unsigned char mask[4][4][16];
+    int q, j;
+    for(k = 0; k < c; ++k){
+        for(q = 0; q < c; ++q){
+            for(j = 0; j < 16; ++j){
+                int pos = c*j + k - 16*q;
+                mask[k][q][j] = pos >= 0 && pos < 16 ? pos : 0x80;
+            }
+        }
+    }
+    for(; i + 16 <= n; i += 16){
+        __m128i chunk[4];
+        for(q = 0; q < c; ++q) chunk[q] = _mm_loadu_si128((const __m128i *)(src + c*i + 16*q));
+        for(k = 0; k < c; ++k){
+            __m128i p = _mm_setzero_si128();
+            for(q = 0; q < c; ++q){
+                p = _mm_or_si128(p, _mm_shuffle_epi8(chunk[q], _mm_loadu_si128((const __m128i *)mask[k][q])));
+            }
+            float *out = dst + (size_t)k*n + i;
+            _mm256_storeu_ps(out, _mm256_i32gather_ps(table, _mm256_cvtepu8_epi32(p), 4));
+            _mm256_storeu_ps(out + 8, _mm256_i32gather_ps(table, _mm256_cvtepu8_epi32(_mm_srli_si128(p, 8)), 4));
+        }
+    }
+#elif defined(__ARM_NEON)
+    if(c == 3){
+        for(; i + 16 <= n; i += 16){
+            uint8x16x3_t rgb = vld3q_u8(src + 3*i);
+            unsigned char planes[3][16];
+            int j;
+            for(k = 0; k < 3; ++k) vst1q_u8(planes[k], rgb.val[k]);
+            for(k = 0; k < 3; ++k){
+                float *out = dst + (size_t)k*n + i;
+                for(j = 0; j < 16; ++j) out[j] = table[planes[k][j]];
+            }
+        }
+    }
+#endif
+    for(; i < n; ++i){
+        for(k = 0; k < c; ++k) dst[(size_t)k*n + i] = table[src[c*i + k]];
+    }
+}
+
+// Quantizes n planar floats of c channels, planes n floats apart, to
+// interleaved bytes, rounding and clamping to [0, 255].
+static void planar_to_u8(const float *src, unsigned char *dst, int n, int c)
+{
+    int i, k;
+    for(k = 0; k < c; ++k){
+        const float *p = src + (size_t)k*n;
+        i = 0;
+#if defined(__AVX2__)
+        // roundf rounds halves up, which truncating v + .5 - ulp matches
+        __m256 s = _mm256_set1_ps(255), zero = _mm256_setzero_ps(), half = _mm256_set1_ps(0.49999997f);
+        for(; i + 16 <= n; i += 16){
+            __m256 fa = _mm256_mul_ps(_mm256_loadu_ps(p + i), s);
+            __m256 fb = _mm256_mul_ps(_mm256_loadu_ps(p + i + 8), s);
+            fa = _mm256_add_ps(_mm256_min_ps(_mm256_max_ps(fa, zero), s), half);
+            fb = _mm256_add_ps(_mm256_min_ps(_mm256_max_ps(fb, zero), s), half);
+            __m256i a = _mm256_cvttps_epi32(fa);
+            __m256i b = _mm256_cvttps_epi32(fb);
+            // packs work within 128 bit lanes, permute puts the pixels back in order
+            __m256i w = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+            __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+            unsigned char q[16];
+            _mm_storeu_si128((__m128i *)q, bytes);
+            int j;
+            for(j = 0; j < 16; ++j) dst[c*(i + j) + k] = q[j];
+        }
+#elif defined(__ARM_NEON)
+        float32x4_t s = vdupq_n_f32(255);
+        for(; i + 8 <= n; i += 8){
+            int32x4_t a = vcvtaq_s32_f32(vmulq_f32(vld1q_f32(p + i), s));
+            int32x4_t b = vcvtaq_s32_f32(vmulq_f32(vld1q_f32(p + i + 4), s));
+            uint8x8_t q = vqmovun_s16(vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+            unsigned char out[8];
+            vst1_u8(out, q);
+            int j;
+            for(j = 0; j < 8; ++j) dst[c*(i + j) + k] = out[j];
+        }
+#endif
+        for(; i < n; ++i){
+            float v = roundf(255*p[i]);
+            dst[c*i + k] = v < 0 ? 0 : v > 255 ? 255 : (unsigned char)v;
         }
     }
+}
+
+// returns: 1 if the image was written.
+static int write_image_stb(image im, const char *name, int png)
+{
+    char buff[256];
+    unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
+    planar_to_u8(im.data, data, im.w*im.h, im.c);
     int success = 0;
     if(png){
-        sprintf(buff, "%s.png", name);
+        snprintf(buff, sizeof(buff), "%s.png", name);
         success = stbi_write_png(buff, im.w, im.h, im.c, data, im.w*im.c);
     } else {
-        sprintf(buff, "%s.jpg", name);
+        snprintf(buff, sizeof(buff), "%s.jpg", name);
         success = stbi_write_jpg(buff, im.w, im.h, im.c, data, 100);
     }
     free(data);
     if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
+    return success;
+}
+
+void save_image_stb(image im, const char *name, int png)
+{
+    write_image_stb(im, name, png);
 }
 
 void save_png(image im, const char *name)
@@ -58,52 +176,114 @@ void save_image(image im, const char *name)
     save_image_stb(im, name, 0);
 }
 
-// 
-// Load an image using stb
-// channels = [0..4]
-// channels > 0 forces the image to have that many channels
-//
-image load_image_stb(char *filename, int channels)
+// Decodes a file, or returns an empty image saying why it couldn't.
+static image decode_image(const char *filename, int channels)
 {
     int w, h, c;
     unsigned char *data = stbi_load(filename, &w, &h, &c, channels);
     if (!data) {
         fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
             filename, stbi_failure_reason());
-        exit(0);
+        return make_empty_image(0,0,0);
     }
     if (channels) c = channels;
-    int i,j,k;
     image im = make_image(w, h, c);
-    for(k = 0; k < c; ++k){
-        for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-                int dst_index = i + w*j + w*h*k;
-                int src_index = k + c*i + c*w*j;
-                im.data[dst_index] = (float)data[src_index]/255.;
-            }
-        }
-    }
+    u8_to_planar(data, im.data, w*h, c);
     //We don't like alpha channels, #YOLO
     if(im.c == 4) im.c = 3;
     free(data);
     return im;
 }
 
+// 
+// Load an image using stb
+// channels = [0..4]
+// channels > 0 forces the image to have that many channels
+//
+image load_image_stb(char *filename, int channels)
+{
+    image im = decode_image(filename, channels);
+    if(!im.data) exit(0);
+    return im;
+}
+
 image load_image(char *filename)
 {
     image out = load_image_stb(filename, 0);
     return out;
 }
 
+typedef struct{
+    char **paths;
+    image *ims;
+    int channels, png;
+    int failed;
+} image_io_job;
+
+static void decode_images(void *ctx, int start, int end)
+{
+    image_io_job *job = ctx;
+    int i;
+    for(i = start; i < end; ++i){
+        job->ims[i] = decode_image(job->paths[i], job->channels);
+        if(!job->ims[i].data) __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void encode_images(void *ctx, int start, int end)
+{
+    image_io_job *job = ctx;
+    int i;
+    for(i = start; i < end; ++i){
+        if(!write_image_stb(job->ims[i], job->paths[i], job->png)) __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Loads many images at once, one file per thread.
+// char **paths: files to load.
+// int n: number of files.
+// int channels: as load_image_stb, 0 to keep each file's own.
+// image *ims: filled with the n images. Files that can't be read get an
+//             empty image instead of ending the program.
+// returns: number of files that failed.
+int load_images(char **paths, int n, int channels, image *ims)
+{
+    image_io_job job = {paths, ims, channels, 0, 0};
+    parallel_for_tiles(n, 1, decode_images, &job);
+    return job.failed;
+}
+
+// Saves many images at once, one file per thread.
+// image *ims: images to save.
+// char **names: file names without extension, like save_image.
+// int n: number of images.
+// int png: 1 for png, 0 for jpg.
+// returns: number of images that failed.
+int save_images(image *ims, char **names, int n, int png)
+{
+    image_io_job job = {names, ims, 0, png, 0};
+    parallel_for_tiles(n, 1, encode_images, &job);
+    return job.failed;
+}
+
 void save_image_binary(image im, const char *fname)
 {
-    FILE *fp = fopen(fname, "wb");
-    fwrite(&im.w, sizeof(int), 1, fp);
-    fwrite(&im.h, sizeof(int), 1, fp);
-    fwrite(&im.c, sizeof(int), 1, fp);
-    fwrite(im.data, sizeof(float), im.w*im.h*im.c, fp);
-    fclose(fp);
+    bin_writer w;
+    int dims[3] = {im.w, im.h, im.c};
+    if(!bin_open_write(&w, fname, BIN_F32, 3, dims)) return;
+    bin_write(&w, im.data, (size_t)im.w*im.h*im.c*sizeof(float));
+    if(!bin_close_write(&w)) fprintf(stderr, "Couldn't write %s\n", fname);
+}
+
+// Checks a header describes an image.
+static int image_header(const bin_header *h, const char *fname)
+{
+    size_t n = (size_t)h->dims[0]*h->dims[1]*h->dims[2];
+    if(h->dtype != BIN_F32 || h->ndim != 3 || h->data_bytes != n*sizeof(float)){
+        fprintf(stderr, "%s is not a float image\n", fname);
+        return 0;
+    }
+    return 1;
 }
 
 image load_image_binary(const char *fname)
@@ -112,11 +292,67 @@ image load_image_binary(const char *fname)
     int h = 0;
     int c = 0;
     FILE *fp = fopen(fname, "rb");
-    fread(&w, sizeof(int), 1, fp);
-    fread(&h, sizeof(int), 1, fp);
-    fread(&c, sizeof(int), 1, fp);
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return make_empty_image(0,0,0);
+    }
+    bin_header hd;
+    int versioned = bin_read_header(fp, &hd);
+    if(versioned){
+        if(!image_header(&hd, fname)){
+            fclose(fp);
+            return make_empty_image(0,0,0);
+        }
+        w = hd.dims[0];
+        h = hd.dims[1];
+        c = hd.dims[2];
+    } else {
+        fread(&w, sizeof(int), 1, fp);
+        fread(&h, sizeof(int), 1, fp);
+        fread(&c, sizeof(int), 1, fp);
+    }
     image im = make_image(w,h,c);
-    fread(im.data, sizeof(float), im.w*im.h*im.c, fp);
+    size_t n = (size_t)im.w*im.h*im.c;
+    if(fread(im.data, sizeof(float), n, fp) != n) fprintf(stderr, "%s is truncated\n", fname);
+    fclose(fp);
+    if(versioned && !bin_verify(&hd, im.data)){
+        free_image(im);
+        return make_empty_image(0,0,0);
+    }
+    return im;
+}
+
+// Maps a binary image file instead of reading it. The image is a view of
+// the file's pages, so this costs the same for any size and pages load as
+// they are touched. Writes to it stay in memory. release_image unmaps it.
+// Reads the versioned format and legacy headerless dumps.
+// const char *fname: file to map.
+// returns: image view, or an empty image on failure.
+image map_image_binary(const char *fname)
+{
+    size_t size;
+    char *base = bin_map(fname, &size);
+    if(!base) return make_empty_image(0,0,0);
+    bin_header hd;
+    image im;
+    if(bin_parse_header(base, size, &hd)){
+        if(!image_header(&hd, fname)){
+            bin_release(base);
+            return make_empty_image(0,0,0);
+        }
+        im = make_empty_image(hd.dims[0], hd.dims[1], hd.dims[2]);
+        im.data = (float *)(base + hd.data_offset);
+    } else {
+        int dims[3] = {0};
+        if(size >= sizeof(dims)) memcpy(dims, base, sizeof(dims));
+        im = make_empty_image(dims[0], dims[1], dims[2]);
+        if(size < sizeof(dims) + (size_t)im.w*im.h*im.c*sizeof(float)){
+            fprintf(stderr, "%s is truncated\n", fname);
+            bin_release(base);
+            return make_empty_image(0,0,0);
+        }
+        im.data = (float *)(base + sizeof(dims));
+    }
     return im;
 }
 
@@ -125,3 +361,11 @@ void free_image(image im)
     free(im.data);
 }
 
+// Frees an image that may be a view of a file: one from map_image_binary
+// or make_image_disk, or a panorama big enough to be built on disk. Heap
+// images are freed like free_image.
+void release_image(image im)
+{
+    if(!bin_release(im.data)) free(im.data);
+}
+
@@ -3,11 +3,15 @@
 #include "image.h"
 #include "test.h"
 #include "args.h"
+#include "bench.h"
 
 int main(int argc, char **argv)
 {
-    if(argc < 3){
+    if(argc >= 2 && 0 == strcmp(argv[1], "bench")){
+        run_benchmarks(argc, argv);
+    } else if(argc < 3){
         printf("usage: %s test <hw0 | hw1...>\n", argv[0]);  
+        printf("       %s bench [-sizes 128,512] [-msizes 32,128] [-reps 11] [-budget 2] [-only name] [-out file.json]\n", argv[0]);
     } else if (0 == strcmp(argv[1], "test")){
         if (0 == strcmp(argv[2], "hw0")) test_hw0();
         if (0 == strcmp(argv[2], "hw1")) test_hw1();
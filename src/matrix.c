@@ -4,6 +4,10 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include "parallel.h"
+#include "binfile.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
 
 matrix make_identity_homography()
 {
@@ -26,9 +30,26 @@ void free_matrix(matrix m)
 {
     if (m.data) {
         int i;
-        if (!m.shallow) for(i = 0; i < m.rows; ++i) free(m.data[i]);
+        if (m.shallow) {
+            // rows belong to another matrix
+        } else if (m.base) {
+            free(m.base);
+        } else {
+            for(i = 0; i < m.rows; ++i) free(m.data[i]);
+        }
+        free(m.data);
+    }
+}
+
+// Frees a matrix from map_matrix, unmapping its file. Heap matrices are
+// freed like free_matrix.
+void release_matrix(matrix m)
+{
+    if (m.data && !m.shallow && m.base && bin_release(m.base)) {
         free(m.data);
+        return;
     }
+    free_matrix(m);
 }
 
 matrix make_matrix(int rows, int cols)
@@ -38,19 +59,18 @@ matrix make_matrix(int rows, int cols)
     m.cols = cols;
     m.shallow = 0;
     m.data = calloc(m.rows, sizeof(double *));
+    m.base = calloc((size_t)m.rows*m.cols, sizeof(double));
     int i;
-    for(i = 0; i < m.rows; ++i) m.data[i] = calloc(m.cols, sizeof(double));
+    for(i = 0; i < m.rows; ++i) m.data[i] = m.base + (size_t)i*m.cols;
     return m;
 }
 
 matrix copy_matrix(matrix m)
 {
-    int i,j;
+    int i;
     matrix c = make_matrix(m.rows, m.cols);
     for(i = 0; i < m.rows; ++i){
-        for(j = 0; j < m.cols; ++j){
-            c.data[i][j] = m.data[i][j];
-        }
+        memcpy(c.data[i], m.data[i], m.cols*sizeof(double));
     }
     return c;
 }
@@ -80,16 +100,161 @@ matrix make_identity(int rows, int cols)
     return m;
 }
 
+#define GEMM_T double
+#define GEMM_M matrix
+#define GEMM_NR 8
+#define GEMM_FN(x) dgemm_##x
+#include "gemm_impl.h"
+#undef GEMM_T
+#undef GEMM_M
+#undef GEMM_NR
+#undef GEMM_FN
+
+#define GEMM_T float
+#define GEMM_M fmatrix
+#define GEMM_NR 16
+#define GEMM_FN(x) sgemm_##x
+#include "gemm_impl.h"
+#undef GEMM_T
+#undef GEMM_M
+#undef GEMM_NR
+#undef GEMM_FN
+
 matrix matrix_mult_matrix(matrix a, matrix b)
 {
     assert(a.cols == b.rows);
-    int i, j, k;
     matrix p = make_matrix(a.rows, b.cols);
-    for(i = 0; i < p.rows; ++i){
-        for(j = 0; j < p.cols; ++j){
-            for(k = 0; k < a.cols; ++k){
-                p.data[i][j] += a.data[i][k]*b.data[k][j];
-            }
+    dgemm_mult(0, a, 0, b, p);
+    return p;
+}
+
+// Returns a * transpose(b) without building the transpose.
+matrix matrix_mult_transpose(matrix a, matrix b)
+{
+    assert(a.cols == b.cols);
+    matrix p = make_matrix(a.rows, b.rows);
+    dgemm_mult(0, a, 1, b, p);
+    return p;
+}
+
+// Returns transpose(a) * b without building the transpose.
+matrix transpose_mult_matrix(matrix a, matrix b)
+{
+    assert(a.rows == b.rows);
+    matrix p = make_matrix(a.cols, b.cols);
+    dgemm_mult(1, a, 0, b, p);
+    return p;
+}
+
+void free_fmatrix(fmatrix m)
+{
+    if (m.data) {
+        int i;
+        if (m.shallow) {
+            // rows belong to another matrix
+        } else if (m.base) {
+            free(m.base);
+        } else {
+            for(i = 0; i < m.rows; ++i) free(m.data[i]);
+        }
+        free(m.data);
+    }
+}
+
+fmatrix make_fmatrix(int rows, int cols)
+{
+    fmatrix m;
+    m.rows = rows;
+    m.cols = cols;
+    m.shallow = 0;
+    m.data = calloc(m.rows, sizeof(float *));
+    m.base = calloc((size_t)m.rows*m.cols, sizeof(float));
+    int i;
+    for(i = 0; i < m.rows; ++i) m.data[i] = m.base + (size_t)i*m.cols;
+    return m;
+}
+
+fmatrix copy_fmatrix(fmatrix m)
+{
+    int i;
+    fmatrix c = make_fmatrix(m.rows, m.cols);
+    for(i = 0; i < m.rows; ++i){
+        memcpy(c.data[i], m.data[i], m.cols*sizeof(float));
+    }
+    return c;
+}
+
+fmatrix random_fmatrix(int rows, int cols, float s)
+{
+    fmatrix m = make_fmatrix(rows, cols);
+    int i, j;
+    for(i = 0; i < rows; ++i){
+        for(j = 0; j < cols; ++j){
+            m.data[i][j] = 2*s*(rand()%1000/1000.0) - s;
+        }
+    }
+    return m;
+}
+
+fmatrix matrix_to_fmatrix(matrix m)
+{
+    fmatrix f = make_fmatrix(m.rows, m.cols);
+    int i, j;
+    for(i = 0; i < m.rows; ++i){
+        for(j = 0; j < m.cols; ++j){
+            f.data[i][j] = m.data[i][j];
+        }
+    }
+    return f;
+}
+
+matrix fmatrix_to_matrix(fmatrix f)
+{
+    matrix m = make_matrix(f.rows, f.cols);
+    int i, j;
+    for(i = 0; i < f.rows; ++i){
+        for(j = 0; j < f.cols; ++j){
+            m.data[i][j] = f.data[i][j];
+        }
+    }
+    return m;
+}
+
+fmatrix fmatrix_mult_fmatrix(fmatrix a, fmatrix b)
+{
+    assert(a.cols == b.rows);
+    fmatrix p = make_fmatrix(a.rows, b.cols);
+    sgemm_mult(0, a, 0, b, p);
+    return p;
+}
+
+// Returns a * transpose(b) without building the transpose.
+fmatrix fmatrix_mult_transpose(fmatrix a, fmatrix b)
+{
+    assert(a.cols == b.cols);
+    fmatrix p = make_fmatrix(a.rows, b.rows);
+    sgemm_mult(0, a, 1, b, p);
+    return p;
+}
+
+// Returns transpose(a) * b without building the transpose.
+fmatrix transpose_mult_fmatrix(fmatrix a, fmatrix b)
+{
+    assert(a.rows == b.rows);
+    fmatrix p = make_fmatrix(a.cols, b.cols);
+    sgemm_mult(1, a, 0, b, p);
+    return p;
+}
+
+fmatrix axpy_fmatrix(float a, fmatrix x, fmatrix y)
+{
+    assert(x.cols == y.cols);
+    assert(x.rows == y.rows);
+    int i, j;
+    fmatrix p = make_fmatrix(x.rows, x.cols);
+    for(i = 0; i < x.rows; ++i){
+        for(j = 0; j < x.cols; ++j){
+            p.data[i][j] = a*x.data[i][j] + y.data[i][j];
         }
     }
     return p;
@@ -139,14 +304,9 @@ matrix axpy_matrix(double a, matrix x, matrix y)
 
 matrix transpose_matrix(matrix m)
 {
-    matrix t;
-    t.rows = m.cols;
-    t.cols = m.rows;
-    t.data = calloc(t.rows, sizeof(double *));
-    t.shallow = 0;
+    matrix t = make_matrix(m.cols, m.rows);
     int i, j;
     for(i = 0; i < t.rows; ++i){
-        t.data[i] = calloc(t.cols, sizeof(double));
         for(j = 0; j < t.cols; ++j){
             t.data[i][j] = m.data[j][i];
         }
@@ -361,13 +521,13 @@ double *sle_solve(matrix A, double *b)
 matrix solve_system(matrix M, matrix b)
 {
     matrix none = {0};
-    matrix Mt = transpose_matrix(M);
-    matrix MtM = matrix_mult_matrix(Mt, M);
+    matrix MtM = transpose_mult_matrix(M, M);
     matrix MtMinv = matrix_invert(MtM);
+    free_matrix(MtM);
     if(!MtMinv.data) return none;
-    matrix Mdag = matrix_mult_matrix(MtMinv, Mt);
+    matrix Mdag = matrix_mult_transpose(MtMinv, M);
     matrix a = matrix_mult_matrix(Mdag, b);
-    free_matrix(Mt); free_matrix(MtM); free_matrix(MtMinv); free_matrix(Mdag);
+    free_matrix(MtMinv); free_matrix(Mdag);
     return a;
 }
 
@@ -383,32 +543,96 @@ void test_matrix()
     }
 }
 
+// Checks a header describes a matrix.
+static int matrix_header(const bin_header *h, const char *fname)
+{
+    size_t n = (size_t)h->dims[0]*h->dims[1];
+    if(h->dtype != BIN_F64 || h->ndim != 2 || h->data_bytes != n*sizeof(double)){
+        fprintf(stderr, "%s is not a double matrix\n", fname);
+        return 0;
+    }
+    return 1;
+}
+
 matrix load_matrix(const char *fname)
 {
+    matrix none = {0};
     int rows = 0;
     int cols = 0;
     FILE *fp = fopen(fname, "rb");
-    fread(&rows, sizeof(int), 1, fp);
-    fread(&cols, sizeof(int), 1, fp);
-    int i;
-    matrix m = make_matrix(rows, cols);
-    for(i = 0; i < rows; ++i){
-        fread(m.data[i], sizeof(double), cols, fp);
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return none;
+    }
+    bin_header h;
+    int versioned = bin_read_header(fp, &h);
+    if(versioned){
+        if(!matrix_header(&h, fname)){
+            fclose(fp);
+            return none;
+        }
+        rows = h.dims[0];
+        cols = h.dims[1];
+    } else {
+        fread(&rows, sizeof(int), 1, fp);
+        fread(&cols, sizeof(int), 1, fp);
     }
+    matrix m = make_matrix(rows, cols);
+    size_t n = (size_t)rows*cols;
+    if(fread(m.base, sizeof(double), n, fp) != n) fprintf(stderr, "%s is truncated\n", fname);
     fclose(fp);
+    if(versioned && !bin_verify(&h, m.base)){
+        free_matrix(m);
+        return none;
+    }
+    return m;
+}
+
+// Maps a binary matrix file instead of reading it, see map_image_binary.
+// Only the row pointers are allocated. release_matrix unmaps the file.
+// const char *fname: file to map.
+// returns: matrix view, or a matrix with no data on failure.
+matrix map_matrix(const char *fname)
+{
+    matrix m = {0};
+    size_t size;
+    char *base = bin_map(fname, &size);
+    if(!base) return m;
+    bin_header h;
+    if(bin_parse_header(base, size, &h)){
+        if(!matrix_header(&h, fname)){
+            bin_release(base);
+            return m;
+        }
+        m.rows = h.dims[0];
+        m.cols = h.dims[1];
+        m.base = (double *)(base + h.data_offset);
+    } else {
+        int dims[2] = {0};
+        if(size >= sizeof(dims)) memcpy(dims, base, sizeof(dims));
+        if(size < sizeof(dims) + (size_t)dims[0]*dims[1]*sizeof(double)){
+            fprintf(stderr, "%s is truncated\n", fname);
+            bin_release(base);
+            return m;
+        }
+        m.rows = dims[0];
+        m.cols = dims[1];
+        m.base = (double *)(base + sizeof(dims));
+    }
+    m.data = calloc(m.rows, sizeof(double *));
+    int i;
+    for(i = 0; i < m.rows; ++i) m.data[i] = m.base + (size_t)i*m.cols;
     return m;
 }
 
 void save_matrix(matrix m, const char *fname)
 {
-    FILE *fp = fopen(fname, "wb");
-    fwrite(&m.rows, sizeof(int), 1, fp);
-    fwrite(&m.cols, sizeof(int), 1, fp);
+    bin_writer w;
+    int dims[2] = {m.rows, m.cols};
+    if(!bin_open_write(&w, fname, BIN_F64, 2, dims)) return;
     int i;
     for(i = 0; i < m.rows; ++i){
-        fwrite(m.data[i], sizeof(double), m.cols, fp);
+        bin_write(&w, m.data[i], m.cols*sizeof(double));
     }
-    fclose(fp);
+    if(!bin_close_write(&w)) fprintf(stderr, "Couldn't write %s\n", fname);
 }
-
-
@@ -1,11 +1,24 @@
 #ifndef MATRIX_H
 #define MATRIX_H
+// data[i] points at row i. Matrices from make_matrix keep all rows in one
+// row-major block, base, so data[i] == base + i*cols until rows get swapped.
+// shallow matrices only own the row pointers.
 typedef struct matrix{
     int rows, cols;
     double **data;
     int shallow;
+    double *base;
 } matrix;
 
+// Single precision counterpart of matrix, same layout rules. Used where
+// double accuracy buys nothing, like training the classifier.
+typedef struct fmatrix{
+    int rows, cols;
+    float **data;
+    int shallow;
+    float *base;
+} fmatrix;
+
 typedef struct LUP{
     matrix *L;
     matrix *U;
@@ -17,11 +30,14 @@ matrix make_identity_homography();
 matrix make_translation_homography(float dx, float dy);
 
 void free_matrix(matrix m);
+void release_matrix(matrix m);
 double mag_matrix(matrix m);
 matrix make_matrix(int rows, int cols);
 matrix copy_matrix(matrix m);
 double *sle_solve(matrix A, double *b);
 matrix matrix_mult_matrix(matrix a, matrix b);
+matrix matrix_mult_transpose(matrix a, matrix b);
+matrix transpose_mult_matrix(matrix a, matrix b);
 matrix matrix_elmult_matrix(matrix a, matrix b);
 void print_matrix(matrix m);
 double **n_principal_components(matrix m, int n);
@@ -31,4 +47,15 @@ matrix matrix_invert(matrix m);
 matrix random_matrix(int rows, int cols, double s);
 matrix transpose_matrix(matrix m);
 matrix axpy_matrix(double a, matrix x, matrix y);
+
+fmatrix make_fmatrix(int rows, int cols);
+void free_fmatrix(fmatrix m);
+fmatrix copy_fmatrix(fmatrix m);
+fmatrix random_fmatrix(int rows, int cols, float s);
+fmatrix matrix_to_fmatrix(matrix m);
+matrix fmatrix_to_matrix(fmatrix m);
+fmatrix fmatrix_mult_fmatrix(fmatrix a, fmatrix b);
+fmatrix fmatrix_mult_transpose(fmatrix a, fmatrix b);
+fmatrix transpose_mult_fmatrix(fmatrix a, fmatrix b);
+fmatrix axpy_fmatrix(float a, fmatrix x, fmatrix y);
 #endif
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "parallel.h"
+
+// A small work-stealing thread pool. A parallel_for cuts [0, n) into
+// tiles and deals them out in contiguous runs, one queue per thread.
+// Threads pop tiles from the front of their own queue and, once that is
+// empty, steal from the back of the others. Each tile always covers the
+// same range no matter who runs it, so as long as tiles write disjoint
+// output the result does not depend on the thread count.
+
+typedef struct{
+    pthread_mutex_t lock;
+    int head, tail;
+} tile_queue;
+
+static int num_threads = 0;
+static int tile_size = 32;
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static pthread_t *helpers = 0;
+static int nhelpers = 0;
+static int generation = 0;
+static int busy = 0;
+static int quit = 0;
+
+// The current job
+static tile_fn job_fn;
+static void *job_ctx;
+static int job_n, job_tile;
+static tile_queue *queues = 0;
+static int nqueues = 0;
+
+// Set on pool threads and on a caller while it runs a job, so nested
+// parallel_for calls just run inline.
+static __thread int in_pool = 0;
+
+static int next_tile(int id)
+{
+    int i, t = -1;
+    tile_queue *q = queues + id;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) t = q->head++;
+    pthread_mutex_unlock(&q->lock);
+    for (i = 1; t < 0 && i < nqueues; ++i) {
+        tile_queue *v = queues + (id + i) % nqueues;
+        pthread_mutex_lock(&v->lock);
+        if (v->head < v->tail) t = --v->tail;
+        pthread_mutex_unlock(&v->lock);
+    }
+    return t;
+}
+
+static void run_tiles(int id)
+{
+    int t;
+    while ((t = next_tile(id)) >= 0) {
+        int start = t * job_tile;
+        int end = start + job_tile < job_n ? start + job_tile : job_n;
+        job_fn(job_ctx, start, end);
+    }
+}
+
+static void *helper_thread(void *arg)
+{
+    int id = (int)(size_t)arg;
+    int seen = 0;
+    in_pool = 1;
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (!quit && generation == seen) pthread_cond_wait(&job_start, &pool_lock);
+        if (quit) break;
+        seen = generation;
+        pthread_mutex_unlock(&pool_lock);
+        run_tiles(id);
+        pthread_mutex_lock(&pool_lock);
+        if (--busy == 0) pthread_cond_signal(&job_done);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+static void stop_pool()
+{
+    int i;
+    pthread_mutex_lock(&pool_lock);
+    quit = 1;
+    pthread_cond_broadcast(&job_start);
+    pthread_mutex_unlock(&pool_lock);
+    for (i = 0; i < nhelpers; ++i) pthread_join(helpers[i], 0);
+    for (i = 0; i < nqueues; ++i) pthread_mutex_destroy(&queues[i].lock);
+    free(helpers);
+    free(queues);
+    helpers = 0;
+    queues = 0;
+    nhelpers = nqueues = 0;
+    generation = 0;
+    quit = 0;
+}
+
+static void start_pool(int n)
+{
+    int i;
+    nqueues = n;
+    queues = calloc(n, sizeof(tile_queue));
+    for (i = 0; i < n; ++i) pthread_mutex_init(&queues[i].lock, 0);
+    helpers = calloc(n - 1, sizeof(pthread_t));
+    for (i = 0; i < n - 1; ++i) {
+        if (pthread_create(helpers + i, 0, helper_thread, (void *)(size_t)(i + 1))) break;
+    }
+    nhelpers = i;
+    nqueues = i + 1;
+}
+
+// Sets how many threads whole-image operators use, 0 means one per core.
+void set_num_threads(int n)
+{
+    pthread_mutex_lock(&job_lock);
+    if (nhelpers) stop_pool();
+    num_threads = n > 0 ? n : 0;
+    pthread_mutex_unlock(&job_lock);
+}
+
+int get_num_threads()
+{
+    if (num_threads > 0) return num_threads;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+// Sets the default tile size, in rows for the image operators.
+void set_tile_size(int n)
+{
+    tile_size = n > 0 ? n : 1;
+}
+
+int get_tile_size()
+{
+    return tile_size;
+}
+
+// Runs fn over [0, n) in tiles of the given size across the pool.
+// int n: size of the range.
+// int tile: size of each tile.
+// tile_fn fn: work to do on each tile.
+// void *ctx: passed through to fn.
+void parallel_for_tiles(int n, int tile, tile_fn fn, void *ctx)
+{
+    if (n <= 0) return;
+    if (tile < 1) tile = 1;
+    int ntiles = (n + tile - 1) / tile;
+    int threads = get_num_threads();
+    if (threads < 2 || ntiles < 2 || in_pool) {
+        fn(ctx, 0, n);
+        return;
+    }
+
+    pthread_mutex_lock(&job_lock);
+    if (!nhelpers) start_pool(threads);
+    if (!nhelpers) {
+        pthread_mutex_unlock(&job_lock);
+        fn(ctx, 0, n);
+        return;
+    }
+
+    // Deal out the tiles in contiguous runs
+    int i;
+    for (i = 0; i < nqueues; ++i) {
+        queues[i].head = (long)ntiles * i / nqueues;
+        queues[i].tail = (long)ntiles * (i + 1) / nqueues;
+    }
+    job_fn = fn;
+    job_ctx = ctx;
+    job_n = n;
+    job_tile = tile;
+
+    pthread_mutex_lock(&pool_lock);
+    busy = nhelpers;
+    ++generation;
+    pthread_cond_broadcast(&job_start);
+    pthread_mutex_unlock(&pool_lock);
+
+    in_pool = 1;
+    run_tiles(0);
+    in_pool = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    while (busy > 0) pthread_cond_wait(&job_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+    pthread_mutex_unlock(&job_lock);
+}
+
+// Runs fn over [0, n) using the default tile size.
+void parallel_for(int n, tile_fn fn, void *ctx)
+{
+    parallel_for_tiles(n, tile_size, fn, ctx);
+}
@@ -0,0 +1,15 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+// Work done on the half open range [start, end) of a parallel_for.
+typedef void (*tile_fn)(void *ctx, int start, int end);
+
+void set_num_threads(int n);
+int get_num_threads();
+void set_tile_size(int n);
+int get_tile_size();
+
+void parallel_for(int n, tile_fn fn, void *ctx);
+void parallel_for_tiles(int n, int tile, tile_fn fn, void *ctx);
+
+#endif
@@ -1,7 +1,9 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
+#include <unistd.h>
 #include "matrix.h"
 #include "image.h"
 #include "test.h"
@@ -32,6 +34,20 @@ image center_crop(image im)
     return c;
 }
 
+image crop_image(image im, int x, int y, int w, int h)
+{
+    image c = make_image(w, h, im.c);
+    int i, j, k;
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < h; ++j){
+            for(i = 0; i < w; ++i){
+                set_pixel(c, i, j, k, get_pixel(im, i+x, j+y, k));
+            }
+        }
+    }
+    return c;
+}
+
 void feature_normalize2(image im)
 {
     int i;
@@ -406,6 +422,172 @@ void test_frequency_image(){
     free_image(high_freq);
 }
 
+// Like same_image but with a fixed absolute tolerance, for unnormalized
+// outputs where same_image's relative eps would keep growing.
+int close_image(image a, image b, float eps)
+{
+    int i;
+    if(a.w != b.w || a.h != b.h || a.c != b.c) return 0;
+    for(i = 0; i < a.w*a.h*a.c; ++i){
+        if(!within_eps(a.data[i], b.data[i], eps)) return 0;
+    }
+    return 1;
+}
+
+// Straightforward clamped convolution to check the fast paths against.
+image reference_convolve(image im, image f, int preserve)
+{
+    image out = make_image(im.w, im.h, preserve ? im.c : 1);
+    int x, y, c, i, j;
+    for(c = 0; c < im.c; ++c){
+        for(y = 0; y < im.h; ++y){
+            for(x = 0; x < im.w; ++x){
+                float sum = 0;
+                for(j = 0; j < f.h; ++j){
+                    for(i = 0; i < f.w; ++i){
+                        sum += f.data[i + j*f.w]*get_pixel(im, x+i-f.w/2, y+j-f.h/2, c);
+                    }
+                }
+                int oc = preserve ? c : 0;
+                set_pixel(out, x, y, oc, get_pixel(out, x, y, oc) + sum);
+            }
+        }
+    }
+    return out;
+}
+
+void test_separable_convolution(){
+    image im = load_image("data/dogsmall.jpg");
+    image filters[4] = {make_gaussian_filter(1.5), make_gx_filter(), make_box_filter(5), make_emboss_filter()};
+    int i;
+    for(i = 0; i < 4; ++i){
+        image fast = convolve_image(im, filters[i], 1);
+        image slow = reference_convolve(im, filters[i], 1);
+        TEST(close_image(fast, slow, EPS));
+        free_image(fast);
+        free_image(slow);
+        fast = convolve_image(im, filters[i], 0);
+        slow = reference_convolve(im, filters[i], 0);
+        TEST(close_image(fast, slow, EPS));
+        free_image(fast);
+        free_image(slow);
+        free_image(filters[i]);
+    }
+    free_image(im);
+}
+
+int identical_image(image a, image b)
+{
+    if(a.w != b.w || a.h != b.h || a.c != b.c) return 0;
+    return 0 == memcmp(a.data, b.data, a.w*a.h*a.c*sizeof(float));
+}
+
+// Batch loads match one at a time loads, a bad path only fails its own
+// slot, and pngs saved in a batch read back exactly.
+void test_load_images()
+{
+    char *paths[] = {"data/dogsmall.jpg", "data/no_such_image.jpg", "data/colorbar.png"};
+    image ims[3];
+    TEST(load_images(paths, 3, 0, ims) == 1);
+    TEST(!ims[1].data);
+    image dog = load_image("data/dogsmall.jpg");
+    TEST(identical_image(dog, ims[0]));
+
+    char *names[] = {"uwimg_test_a", "uwimg_test_b"};
+    image out[2] = {ims[0], ims[2]};
+    TEST(save_images(out, names, 2, 1) == 0);
+    image back = load_image("uwimg_test_b.png");
+    TEST(identical_image(back, ims[2]));
+    free_image(back);
+    back = load_image("uwimg_test_a.png");
+    TEST(identical_image(back, ims[0]));
+    free_image(back);
+    remove("uwimg_test_a.png");
+    remove("uwimg_test_b.png");
+    free_image(dog);
+    free_image(ims[0]);
+    free_image(ims[2]);
+}
+
+// Largest difference between an 8 bit image and a float one, in 8 bit levels.
+float u8_image_error(image_u8 a, image b)
+{
+    if(a.w != b.w || a.h != b.h || a.c != b.c) return 256;
+    float err = 0;
+    size_t i;
+    for(i = 0; i < (size_t)a.w*a.h*a.c; ++i) err = MAX(err, fabsf(a.data[i] - 255*b.data[i]));
+    return err;
+}
+
+// 8 bit images load, resize, gray and blur to within a level or two of the
+// float pipeline, and promote to the values load_image gives.
+void test_image_u8()
+{
+    image_u8 im = load_image_u8("data/dogsmall.jpg");
+    image f = load_image("data/dogsmall.jpg");
+    image promoted = image_u8_to_float(im);
+    TEST(identical_image(promoted, f));
+    image_u8 back = image_to_u8(promoted);
+    TEST(0 == memcmp(back.data, im.data, im.w*im.h*im.c));
+    TEST(!load_image_u8("data/no_such_image.jpg").data);
+
+    image_u8 nn = nn_resize_u8(im, im.w*4, im.h*4);
+    image gt = load_image("figs/dog4x-nn-for-test.png");
+    TEST(u8_image_error(nn, gt) <= 1);
+    free_image(gt);
+    image_u8 bl = bilinear_resize_u8(im, im.w*4, im.h*4);
+    gt = load_image("figs/dog4x-bl.png");
+    TEST(u8_image_error(bl, gt) <= 2);
+    free_image(gt);
+
+    image_u8 gray = rgb_to_grayscale_u8(im);
+    image fgray = rgb_to_grayscale(f);
+    TEST(u8_image_error(gray, fgray) <= 1);
+    image_u8 box = box_filter_image_u8(im, 7);
+    image fbox = box_filter_image(f, 7);
+    TEST(u8_image_error(box, fbox) <= 1);
+
+    free_image_u8(im);
+    free_image_u8(back);
+    free_image_u8(nn);
+    free_image_u8(bl);
+    free_image_u8(gray);
+    free_image_u8(box);
+    free_image(f);
+    free_image(promoted);
+    free_image(fgray);
+    free_image(fbox);
+}
+
+// Runs the tiled operators serially and on several threads with small
+// tiles and checks the outputs match bit for bit.
+void test_parallel_determinism(){
+    image im = load_image("data/dogsmall.jpg");
+    image f = make_gaussian_filter(2);
+    image out[2][6];
+    int t;
+    for(t = 0; t < 2; ++t){
+        set_num_threads(t ? 4 : 1);
+        set_tile_size(t ? 3 : 32);
+        out[t][0] = convolve_image(im, f, 1);
+        out[t][1] = bilinear_resize(im, im.w*3, im.h*3);
+        out[t][2] = copy_image(im);
+        rgb_to_hsv(out[t][2]);
+        out[t][3] = box_filter_image(im, 7);
+        out[t][4] = structure_matrix(im, 2);
+        out[t][5] = cornerness_response(out[t][4]);
+    }
+    set_num_threads(0);
+    set_tile_size(32);
+    for(t = 0; t < 6; ++t){
+        TEST(identical_image(out[0][t], out[1][t]));
+        free_image(out[0][t]);
+        free_image(out[1][t]);
+    }
+    free_image(f);
+    free_image(im);
+}
+
 void test_sobel(){
     image im = load_image("data/dog.jpg");
     image *res = sobel_image(im);
@@ -456,6 +638,50 @@ void test_structure()
     free_image(gt);
 }
 
+float avg_abs_diff(image a, image b)
+{
+    float diff = 0;
+    int i;
+    for(i = 0; i < a.w*a.h*a.c; ++i){
+        diff += fabs(b.data[i] - a.data[i]);
+    }
+    return diff/(a.w*a.h*a.c);
+}
+
+// The fast backends should stay close to the exact Gaussian and leave flat
+// images flat, including at the borders.
+void test_smooth_methods()
+{
+    image g = make_1d_gaussian(2);
+    float sum = 0;
+    int i, m;
+    for(i = 0; i < g.w; ++i) sum += g.data[i];
+    TEST(g.w == 13 && g.h == 1 && within_eps(sum, 1, EPS));
+    free_image(g);
+
+    image im = load_image("data/dogsmall.jpg");
+    image f = make_gaussian_filter(2);
+    image full = convolve_image(im, f, 1);
+    image exact = smooth_image_method(im, 2, SMOOTH_EXACT);
+    TEST(close_image(exact, full, EPS));
+
+    image flat = make_image(37, 23, 2);
+    for(i = 0; i < flat.w*flat.h*flat.c; ++i) flat.data[i] = .3;
+    for(m = SMOOTH_BOX; m <= SMOOTH_IIR; ++m){
+        image approx = smooth_image_method(im, 2, m);
+        TEST(avg_abs_diff(approx, exact) < .005);
+        free_image(approx);
+        approx = smooth_image_method(flat, 5, m);
+        TEST(close_image(approx, flat, 1e-4));
+        free_image(approx);
+    }
+    free_image(flat);
+    free_image(exact);
+    free_image(full);
+    free_image(f);
+    free_image(im);
+}
+
 void test_cornerness()
 {
     image im = load_image("data/dogbw.png");
@@ -470,7 +696,141 @@ void test_cornerness()
     free_image(gt);
 }
 
+// The separable max filter suppresses exactly what a direct scan of each
+// neighbourhood does, ties and borders included, for any radius.
+void test_nms_image()
+{
+    image im = make_image(53, 37, 1);
+    int i, k, x, y, dx, dy;
+    srand(7);
+    for(i = 0; i < im.w*im.h; ++i) im.data[i] = rand()%8;
+    int radii[] = {0, 1, 3, 7, 40};
+    for(k = 0; k < 5; ++k){
+        int w = radii[k];
+        image r = nms_image(im, w);
+        int ok = 1, count = 0;
+        for(y = 0; y < im.h; ++y){
+            for(x = 0; x < im.w; ++x){
+                float v = get_pixel(im, x, y, 0), expect = v;
+                for(dy = -w; dy <= w; ++dy) for(dx = -w; dx <= w; ++dx){
+                    if(get_pixel(im, x+dx, y+dy, 0) > v) expect = -999999;
+                }
+                ok &= get_pixel(r, x, y, 0) == expect;
+                count += expect > 4;
+            }
+        }
+        int n = 0;
+        int *c = nms_corners(im, w, 4, &n);
+        int listed = n == count;
+        for(i = 0; listed && i < n; ++i) listed = r.data[c[i]] > 4 && (i == 0 || c[i] > c[i-1]);
+        TEST(ok && listed);
+        free(c);
+        free_image(r);
+    }
+    free_image(im);
+}
+
+// The fused detector finds the corners of the step by step pipeline, and
+// the same ones on any number of threads.
+void test_harris_corners()
+{
+    image im = load_image("data/Rainier1.png");
+    image S = structure_matrix(im, 2);
+    image R = cornerness_response(S);
+    image N = nms_image(R, 3);
+    int n = 0, m = 0, same = 0, i, j = 0;
+    set_num_threads(1);
+    int *serial = harris_corners(im, 2, 5, 3, &n);
+    set_num_threads(0);
+    int *c = harris_corners(im, 2, 5, 3, &n);
+    TEST(n > 100 && 0 == memcmp(serial, c, n*sizeof(int)));
+    for(i = 0; i < N.w*N.h; ++i){
+        if(N.data[i] <= 5) continue;
+        ++m;
+        while(j < n && c[j] < i) ++j;
+        same += j < n && c[j] == i;
+    }
+    TEST(same >= .99*m && n <= m + .01*m);
+    free(serial);
+    free(c);
+    free_image(im);
+    free_image(S);
+    free_image(R);
+    free_image(N);
+}
+
+int compare_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// Grid cells out of 8 x 8 that hold at least one of the corners.
+int covered_cells(int *c, int n, int w, int h)
+{
+    int cells[64] = {0}, i, count = 0;
+    for(i = 0; i < n; ++i){
+        int cell = (c[i]/w)*8/h*8 + (c[i]%w)*8/w;
+        count += !cells[cell];
+        cells[cell] = 1;
+    }
+    return count;
+}
+
+// Top k selection keeps the k strongest corners, or k corners spread
+// further over the image, always from the candidates and never more than k.
+void test_select_corners()
+{
+    image im = load_image("data/Rainier1.png");
+    image S = structure_matrix(im, 2);
+    image R = cornerness_response(S);
+    int n = 0, m = 0, k = 150, i, j;
+    int *c = nms_corners(R, 3, 0, &n);
+    float *v = calloc(n, sizeof(float));
+    for(i = 0; i < n; ++i) v[i] = R.data[c[i]];
+    TEST(n > 2*k);
+
+    int *best = select_corners(c, v, n, im.w, im.h, k, SELECT_BEST, &m);
+    int sorted = m == k, beaten = 0;
+    for(i = 1; i < m; ++i) sorted &= R.data[best[i-1]] >= R.data[best[i]];
+    for(i = 0; i < n; ++i) beaten += v[i] > R.data[best[m-1]];
+    TEST(sorted && beaten < k);
+
+    int *top = harris_corners_top(im, 2, 3, k, SELECT_BEST, &m);
+    TEST(m == k && 0 == memcmp(top, best, k*sizeof(int)));
+    free(top);
+
+    int spread = covered_cells(best, k, im.w, im.h);
+    select_method methods[] = {SELECT_GRID, SELECT_ANMS};
+    for(j = 0; j < 2; ++j){
+        int *sel = select_corners(c, v, n, im.w, im.h, k, methods[j], &m);
+        int valid = m == k;
+        for(i = 0; i < m; ++i){
+            int *at = bsearch(&sel[i], c, n, sizeof(int), compare_int);
+            valid &= at != 0;
+        }
+        qsort(sel, m, sizeof(int), compare_int);
+        for(i = 1; i < m; ++i) valid &= sel[i] != sel[i-1];
+        TEST(valid && covered_cells(sel, m, im.w, im.h) > spread);
+        free(sel);
+    }
 
+    int *all = select_corners(c, v, n, im.w, im.h, n + 10, SELECT_GRID, &m);
+    TEST(m == n);
+    free(all);
+    // k far past n mustn't overflow the ANMS pool or the grid's buffers
+    all = select_corners(c, v, n, im.w, im.h, INT_MAX, SELECT_ANMS, &m);
+    TEST(m == n);
+    free(all);
+    all = select_corners(c, v, n, im.w, im.h, INT_MAX, SELECT_GRID, &m);
+    TEST(m == n);
+    free(all);
+    free(best);
+    free(c);
+    free(v);
+    free_image(im);
+    free_image(S);
+    free_image(R);
+}
 
 void test_projection()
 {
@@ -589,6 +949,81 @@ void test_gradient_matrix()
     free_matrix(truth_gsoft);
 }
 
+// Plain triple loop to check the blocked matrix products against.
+matrix reference_mult(matrix a, matrix b)
+{
+    matrix p = make_matrix(a.rows, b.cols);
+    int i, j, k;
+    for(i = 0; i < p.rows; ++i){
+        for(j = 0; j < p.cols; ++j){
+            for(k = 0; k < a.cols; ++k){
+                p.data[i][j] += a.data[i][k]*b.data[k][j];
+            }
+        }
+    }
+    return p;
+}
+
+// Compares a float matrix against a double one with same_matrix.
+int same_fmatrix(matrix m, fmatrix f)
+{
+    matrix d = fmatrix_to_matrix(f);
+    int same = same_matrix(m, d);
+    free_matrix(d);
+    return same;
+}
+
+// Sizes straddle the packing block and panel edges.
+void test_matrix_mult()
+{
+    srand(1);
+    matrix a = random_matrix(101, 300, 1);
+    matrix b = random_matrix(300, 53, 1);
+    matrix at = transpose_matrix(a);
+    matrix bt = transpose_matrix(b);
+    matrix truth = reference_mult(a, b);
+
+    matrix p = matrix_mult_matrix(a, b);
+    TEST(same_matrix(truth, p));
+    free_matrix(p);
+    p = matrix_mult_transpose(a, bt);
+    TEST(same_matrix(truth, p));
+    free_matrix(p);
+    p = transpose_mult_matrix(at, b);
+    TEST(same_matrix(truth, p));
+    free_matrix(p);
+
+    fmatrix fa = matrix_to_fmatrix(a);
+    fmatrix fb = matrix_to_fmatrix(b);
+    fmatrix fp = fmatrix_mult_fmatrix(fa, fb);
+    TEST(same_fmatrix(truth, fp));
+    free_fmatrix(fa); free_fmatrix(fb); free_fmatrix(fp);
+
+    // shallow operand with rows out of order, like random_batch makes
+    matrix s = {0};
+    s.shallow = 1;
+    s.rows = a.rows;
+    s.cols = a.cols;
+    s.data = calloc(s.rows, sizeof(double *));
+    int i;
+    for(i = 0; i < s.rows; ++i) s.data[i] = a.data[s.rows-1-i];
+    p = matrix_mult_matrix(s, b);
+    matrix row = {0};
+    row.shallow = 1;
+    row.rows = 1;
+    row.cols = truth.cols;
+    row.data = truth.data + s.rows-1;
+    matrix prow = row;
+    prow.data = p.data;
+    TEST(same_matrix(row, prow));
+    free_matrix(p);
+    free_matrix(s);
+
+    free_matrix(a); free_matrix(b);
+    free_matrix(at); free_matrix(bt);
+    free_matrix(truth);
+}
+
 void test_layer()
 {
     matrix a = load_matrix("data/test/a.matrix");
@@ -624,6 +1059,173 @@ void test_layer()
     TEST(same_matrix(updated_v, l.v));
 }
 
+// The single precision layer should land on the same answers as the
+// double one, to test tolerance.
+void test_flayer()
+{
+    matrix a = load_matrix("data/test/a.matrix");
+    matrix w = load_matrix("data/test/w.matrix");
+    matrix dw = load_matrix("data/test/dw.matrix");
+    matrix v = load_matrix("data/test/v.matrix");
+    matrix delta = load_matrix("data/test/delta.matrix");
+
+    matrix truth_dx = load_matrix("data/test/truth_dx.matrix");
+    matrix truth_v = load_matrix("data/test/truth_v.matrix");
+    matrix truth_dw = load_matrix("data/test/truth_dw.matrix");
+
+    matrix updated_dw = load_matrix("data/test/updated_dw.matrix");
+    matrix updated_w = load_matrix("data/test/updated_w.matrix");
+    matrix updated_v = load_matrix("data/test/updated_v.matrix");
+
+    matrix truth_out = load_matrix("data/test/out.matrix");
+    flayer l = make_flayer(64, 16, LRELU);
+    free_fmatrix(l.w);
+    free_fmatrix(l.dw);
+    free_fmatrix(l.v);
+    l.w = matrix_to_fmatrix(w);
+    l.dw = matrix_to_fmatrix(dw);
+    l.v = matrix_to_fmatrix(v);
+    fmatrix fa = matrix_to_fmatrix(a);
+    fmatrix fdelta = matrix_to_fmatrix(delta);
+    fmatrix out = forward_flayer(&l, fa);
+    TEST(same_fmatrix(truth_out, out));
+
+    fmatrix dx = backward_flayer(&l, fdelta);
+    TEST(same_fmatrix(truth_v, l.v));
+    TEST(same_fmatrix(truth_dw, l.dw));
+    TEST(same_fmatrix(truth_dx, dx));
+
+    update_flayer(&l, .01, .9, .01);
+    TEST(same_fmatrix(updated_dw, l.dw));
+    TEST(same_fmatrix(updated_w, l.w));
+    TEST(same_fmatrix(updated_v, l.v));
+}
+
+// Pulls n batches of a small on-disk dataset into one X and y.
+static data stream_rows(const char *dir, dataset_opts opts, int n)
+{
+    char list[512], labels[512];
+    sprintf(list, "%s/ds.list", dir);
+    sprintf(labels, "%s/ds.labels", dir);
+    dataset *d = open_dataset(list, labels, 1, opts);
+    data all;
+    all.X = make_matrix(n*opts.batch, 5);
+    all.y = make_matrix(n*opts.batch, 2);
+    int i, j;
+    for(i = 0; i < n; ++i){
+        data b = next_batch(d);
+        for(j = 0; j < b.X.rows; ++j){
+            memcpy(all.X.data[i*opts.batch + j], b.X.data[j], 5*sizeof(double));
+            memcpy(all.y.data[i*opts.batch + j], b.y.data[j], 2*sizeof(double));
+        }
+        free_data(b);
+    }
+    close_dataset(d);
+    return all;
+}
+
+// Names of the images in test_dataset_stream's dataset, without .png.
+static void stream_image_name(char *name, const char *dir, int i)
+{
+    // The last name has no _label suffix, so it is matched by search.
+    if(i == 6) sprintf(name, "%s/ds_even%d", dir, i);
+    else sprintf(name, "%s/ds_%d_%s", dir, i, i%2 ? "odd" : "even");
+}
+
+void test_dataset_stream()
+{
+    const char *tmp = getenv("TMPDIR");
+    char dir[256], name[512];
+    snprintf(dir, sizeof(dir), "%s/uwimg_ds_XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if(!mkdtemp(dir)){
+        fprintf(stderr, "Couldn't make a directory for the test dataset\n");
+        TEST(0);
+        return;
+    }
+    sprintf(name, "%s/ds.labels", dir);
+    FILE *labels = fopen(name, "w");
+    fprintf(labels, "even\nodd\n");
+    fclose(labels);
+    sprintf(name, "%s/ds.list", dir);
+    FILE *list = fopen(name, "w");
+    int i, j;
+    for(i = 0; i < 7; ++i){
+        image im = make_image(2, 2, 1);
+        for(j = 0; j < 4; ++j) im.data[j] = (i*10 + j)/255.;
+        stream_image_name(name, dir, i);
+        save_png(im, name);
+        fprintf(list, "%s.png\n", name);
+        free_image(im);
+    }
+    fclose(list);
+
+    dataset_opts opts = default_dataset_opts(3);
+    opts.ring = 2;
+    opts.seed = 5;
+    data a = stream_rows(dir, opts, 5);
+    int ok = 1;
+    int e;
+    for(e = 0; e < 2; ++e){
+        int seen[7] = {0};
+        for(i = 7*e; i < 7*e + 7; ++i){
+            int id = (int)roundf(a.X.data[i][0]*255)/10;
+            ++seen[id];
+            ok &= a.y.data[i][id%2] == 1 && a.y.data[i][1-id%2] == 0;
+            ok &= a.X.data[i][3] == (float)((id*10 + 3)/255.) && a.X.data[i][4] == 1;
+        }
+        for(i = 0; i < 7; ++i) ok &= seen[i] == 1;
+    }
+    TEST(ok);
+
+    opts.threads = 1;
+    opts.cache_u8 = 1;
+    data b = stream_rows(dir, opts, 5);
+    int same = 1;
+    for(i = 0; i < a.X.rows; ++i){
+        same &= !memcmp(a.X.data[i], b.X.data[i], 5*sizeof(double));
+        same &= !memcmp(a.y.data[i], b.y.data[i], 2*sizeof(double));
+    }
+    TEST(same);
+    free_data(b);
+
+    opts.seed = 6;
+    b = stream_rows(dir, opts, 5);
+    same = 1;
+    for(i = 0; i < a.X.rows; ++i) same &= a.X.data[i][0] == b.X.data[i][0];
+    TEST(!same);
+    free_data(b);
+    free_data(a);
+
+    // A missing file is logged and gives a zero row, it doesn't end the run
+    sprintf(name, "%s/ds.list", dir);
+    list = fopen(name, "w");
+    fprintf(list, "%s/ds_missing_odd.png\n", dir);
+    stream_image_name(name, dir, 0);
+    fprintf(list, "%s.png\n", name);
+    fclose(list);
+    opts = default_dataset_opts(2);
+    opts.shuffle = 0;
+    b = stream_rows(dir, opts, 1);
+    ok = b.X.data[0][4] == 1 && b.y.data[0][1] == 1;
+    for(j = 0; j < 4; ++j){
+        ok &= b.X.data[0][j] == 0;
+        ok &= b.X.data[1][j] == (float)(j/255.);
+    }
+    TEST(ok);
+    free_data(b);
+
+    for(i = 0; i < 7; ++i){
+        stream_image_name(name, dir, i);
+        strcat(name, ".png");
+        remove(name);
+    }
+    sprintf(name, "%s/ds.list", dir);
+    remove(name);
+    sprintf(name, "%s/ds.labels", dir);
+    remove(name);
+    rmdir(dir);
+}
+
 void make_matrix_test()
 {
     srand(1);
@@ -704,6 +1306,8 @@ void test_hw0()
     test_grayscale();
     test_rgb_to_hsv();
     test_hsv_to_rgb();
+    test_load_images();
+    test_image_u8();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw1()
@@ -725,15 +1329,398 @@ void test_hw2()
     test_gaussian_blur();
     test_hybrid_image();
     test_frequency_image();
+    test_separable_convolution();
+    test_parallel_determinism();
     test_sobel();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
+// Matches that follow a known homography plus random outliers. RANSAC
+// should recover it, and give the same answer on any number of threads.
+void test_ransac()
+{
+    matrix truth = make_identity_homography();
+    truth.data[0][0] = 1.1;   truth.data[0][1] = .05;    truth.data[0][2] = 20;
+    truth.data[1][0] = -.03;  truth.data[1][1] = .95;    truth.data[1][2] = -10;
+    truth.data[2][0] = .0001; truth.data[2][1] = -.00005;
+    int n = 120;
+    match *m = calloc(n, sizeof(match));
+    srand(3);
+    int i;
+    for(i = 0; i < n; ++i){
+        m[i].p = make_point(rand()%400, rand()%300);
+        if(i % 3 == 2) m[i].q = make_point(rand()%400, rand()%300);
+        else m[i].q = project_point(truth, m[i].p);
+    }
+    match *m2 = calloc(n, sizeof(match));
+    memcpy(m2, m, n*sizeof(match));
+
+    set_num_threads(1);
+    matrix H = RANSAC_seeded(m, n, 1, 5000, n, 7);
+    set_num_threads(4);
+    matrix H2 = RANSAC_seeded(m2, n, 1, 5000, n, 7);
+    set_num_threads(0);
+
+    TEST(same_matrix(H, truth));
+    TEST(model_inliers(H, m, n, 1) == 80);
+    int same = 1;
+    for(i = 0; i < 3; ++i) same &= !memcmp(H.data[i], H2.data[i], 3*sizeof(double));
+    TEST(same);
+    free_matrix(H);
+    free_matrix(H2);
+    free_matrix(truth);
+    free(m);
+    free(m2);
+}
+
+// The exact index should agree with a plain scan, and the k-d forest
+// should find the true nearest neighbour for most queries.
+void test_descriptor_index()
+{
+    image a = load_image("data/Rainier1.png");
+    image b = load_image("data/Rainier2.png");
+    int an = 0, bn = 0;
+    descriptor *ad = harris_corner_detector(a, 2, 5, 3, &an);
+    descriptor *bd = harris_corner_detector(b, 2, 5, 3, &bn);
+    neighbors *exact = calloc(an, sizeof(neighbors));
+    neighbors *approx = calloc(an, sizeof(neighbors));
+    descriptor_index *ix = make_descriptor_index(bd, bn, INDEX_EXACT);
+    descriptor_index *kd = make_descriptor_index(bd, bn, INDEX_KDFOREST);
+    query_descriptor_index(ix, ad, an, exact);
+    query_descriptor_index(kd, ad, an, approx);
+
+    int i, j, k;
+    int agree = 1, found = 0;
+    for(i = 0; i < an; ++i){
+        float best = INFINITY;
+        for(j = 0; j < bn; ++j){
+            float d = 0;
+            for(k = 0; k < ad[i].n; ++k) d += fabsf(ad[i].data[k] - bd[j].data[k]);
+            if(d < best) best = d;
+        }
+        agree &= fabsf(exact[i].d1 - best) <= 1e-4*best && exact[i].d1 <= exact[i].d2;
+        found += approx[i].i1 == exact[i].i1;
+    }
+    TEST(an > 100 && agree);
+    TEST(found > .8*an);
+
+    int mn = 0;
+    match *m = match_descriptors_index(ad, an, ix, .8, &mn);
+    int ok = mn > 0;
+    unsigned char *used = calloc(bn, 1);
+    for(i = 0; i < mn; ++i){
+        ok &= !used[m[i].bi] && (i == 0 || m[i-1].distance <= m[i].distance);
+        used[m[i].bi] = 1;
+    }
+    TEST(ok);
+
+    // Descriptors of different lengths don't make an index
+    int len = bd[1].n;
+    bd[1].n = len - 1;
+    descriptor_index *bad = make_descriptor_index(bd, bn, INDEX_EXACT);
+    bd[1].n = len;
+    free(match_descriptors_index(ad, an, bad, .8, &mn));
+    TEST(!bad && mn == 0);
+
+    // Nor can a query of another length be matched against one
+    len = ad[1].n;
+    ad[1].n = len - 1;
+    free(match_descriptors_index(ad, an, ix, .8, &mn));
+    ad[1].n = len;
+    TEST(mn == 0);
+
+    free(used);
+    free(m);
+    free(exact);
+    free(approx);
+    free_descriptor_index(ix);
+    free_descriptor_index(kd);
+    free_descriptors(ad, an);
+    free_descriptors(bd, bn);
+    free_image(a);
+    free_image(b);
+}
+
+// The batched describe_corners should give exactly what describe_index
+// does, including windows that hang over the border.
+void test_describe_corners()
+{
+    image im = load_image("data/dogsmall.jpg");
+    int indexes[] = {0, 1, im.w-1, im.w + 3, im.w*im.h/2 + 7, im.w*im.h - 1, 5*im.w + 5};
+    int n = sizeof(indexes)/sizeof(int);
+    descriptor_set s = describe_corners(im, indexes, n);
+    int i, k, same = s.n == n && s.d == 5*5*im.c && ((size_t)s.data & 31) == 0;
+    for(i = 0; i < n; ++i){
+        descriptor d = describe_index(im, indexes[i]);
+        same &= d.p.x == s.p[i].x && d.p.y == s.p[i].y;
+        same &= !memcmp(d.data, s.data + (size_t)i*s.stride, d.n*sizeof(float));
+        for(k = d.n; k < s.stride; ++k) same &= s.data[(size_t)i*s.stride + k] == 0;
+        free(d.data);
+    }
+    TEST(same);
+    descriptor *view = descriptor_set_view(s);
+    TEST(view[2].data == s.data + 2*s.stride && view[2].n == s.d);
+    free_descriptors(view, n);
+    free_image(im);
+}
+
+// combine_images the slow way: project every pixel of the bounding box
+// and sample each channel separately.
+image reference_combine(image a, image b, matrix H)
+{
+    matrix Hinv = matrix_invert(H);
+    point c1 = project_point(Hinv, make_point(0,0));
+    point c2 = project_point(Hinv, make_point(b.w-1, 0));
+    point c3 = project_point(Hinv, make_point(0, b.h-1));
+    point c4 = project_point(Hinv, make_point(b.w-1, b.h-1));
+    point topleft, botright;
+    botright.x = MAX(c1.x, MAX(c2.x, MAX(c3.x, c4.x)));
+    botright.y = MAX(c1.y, MAX(c2.y, MAX(c3.y, c4.y)));
+    topleft.x = MIN(c1.x, MIN(c2.x, MIN(c3.x, c4.x)));
+    topleft.y = MIN(c1.y, MIN(c2.y, MIN(c3.y, c4.y)));
+    int dx = MIN(0, topleft.x);
+    int dy = MIN(0, topleft.y);
+    int w = MAX(a.w, botright.x) - dx;
+    int h = MAX(a.h, botright.y) - dy;
+    image c = make_image(w, h, a.c);
+    int i, j, k;
+    for(k = 0; k < a.c; ++k){
+        for(j = 0; j < a.h; ++j){
+            for(i = 0; i < a.w; ++i){
+                set_pixel(c, i - dx, j - dy, k, get_pixel(a, i, j, k));
+            }
+        }
+    }
+    for(k = 0; k < c.c; ++k){
+        for(j = topleft.y; j < botright.y; ++j){
+            for(i = topleft.x; i < botright.x; ++i){
+                point p = project_point(H, make_point(i, j));
+                if(p.x >= 0 && p.x < b.w && p.y >= 0 && p.y < b.h){
+                    set_pixel(c, i - dx, j - dy, k, bilinear_interpolate(b, p.x, p.y, k));
+                }
+            }
+        }
+    }
+    free_matrix(Hinv);
+    return c;
+}
+
+void test_combine_images()
+{
+    image a = load_image("data/Rainier1.png");
+    image b = load_image("data/Rainier2.png");
+    matrix H = make_identity_homography();
+    H.data[0][0] = 1.05;    H.data[0][1] = .04;     H.data[0][2] = -250;
+    H.data[1][0] = -.02;    H.data[1][1] = .98;     H.data[1][2] = 30;
+    H.data[2][0] = .0002;   H.data[2][1] = -.0001;
+    image fast = combine_images(a, b, H);
+    image slow = reference_combine(a, b, H);
+    // Pixels that project exactly onto b's border can round either way.
+    int i, off = 0;
+    for(i = 0; i < fast.w*fast.h*fast.c; ++i) off += !within_eps(fast.data[i], slow.data[i], 1e-4);
+    TEST(fast.w == slow.w && fast.h == slow.h && off < 20);
+    TEST(avg_abs_diff(fast, slow) < 1e-5);
+    free_image(fast);
+    free_image(slow);
+    free_matrix(H);
+    free_image(a);
+    free_image(b);
+}
+
+void test_blend_images()
+{
+    image a = load_image("data/Rainier1.png");
+    image b = load_image("data/Rainier2.png");
+    matrix H = make_identity_homography();
+    H.data[0][0] = 1.05;    H.data[0][1] = .04;     H.data[0][2] = -250;
+    H.data[1][0] = -.02;    H.data[1][1] = .98;     H.data[1][2] = 30;
+    H.data[2][0] = .0002;   H.data[2][1] = -.0001;
+    image none = combine_images_blend(a, b, H, BLEND_NONE);
+    image feather = combine_images_blend(a, b, H, BLEND_FEATHER);
+    image multi = combine_images_blend(a, b, H, BLEND_MULTIBAND);
+    TEST(none.w == feather.w && none.h == feather.h && none.w == multi.w && none.h == multi.h);
+    // a sits at (ox, oy) in the canvas, pushed over by b's corners.
+    matrix Hinv = matrix_invert(H);
+    point corners[4] = {make_point(0, 0), make_point(b.w-1, 0), make_point(0, b.h-1), make_point(b.w-1, b.h-1)};
+    float left = 0, top = 0;
+    int n;
+    for(n = 0; n < 4; ++n){
+        point p = project_point(Hinv, corners[n]);
+        left = MIN(left, p.x);
+        top = MIN(top, p.y);
+    }
+    int ox = -(int)left, oy = -(int)top;
+    free_matrix(Hinv);
+    int i, j, k, inside = 1, away = 1;
+    for(k = 0; k < a.c; ++k){
+        for(j = 0; j < a.h; ++j){
+            for(i = 0; i < a.w; ++i){
+                // Feathering mixes a with b, never overshooting either.
+                float va = PIXEL(a, i, j, k), vb = PIXEL(none, i+ox, j+oy, k);
+                float v = PIXEL(feather, i+ox, j+oy, k);
+                inside &= v >= MIN(va, vb) - 1e-4 && v <= MAX(va, vb) + 1e-4;
+            }
+        }
+        // Far from b both blends leave a alone.
+        for(j = 0; j < 40; ++j){
+            for(i = 0; i < 40; ++i){
+                away &= PIXEL(feather, i+ox, j+oy, k) == PIXEL(a, i, j, k);
+                away &= within_eps(PIXEL(multi, i+ox, j+oy, k), PIXEL(a, i, j, k), 1e-4);
+            }
+        }
+    }
+    TEST(inside);
+    TEST(away);
+    TEST(avg_abs_diff(multi, feather) < .02);
+    free_image(none);
+    free_image(feather);
+    free_image(multi);
+    free_matrix(H);
+    free_image(a);
+    free_image(b);
+
+    image d = make_image_disk(64, 48, 3);
+    TEST(d.data && d.w == 64 && d.h == 48 && d.c == 3);
+    float sum = 0;
+    for(i = 0; i < d.w*d.h*d.c; ++i) sum += d.data[i];
+    for(i = 0; i < d.w*d.h*d.c; ++i) d.data[i] = i;
+    image m = copy_image(d);
+    TEST(sum == 0 && identical_image(d, m));
+    free_image(m);
+    release_image(d);
+}
+
+void test_panorama_images()
+{
+    // Overlapping crops of one image put back together give the image,
+    // however they are blended.
+    image im = load_image("data/Rainier1.png");
+    image ims[3] = {crop_image(im, 0, 0, 300, 250), crop_image(im, 200, 40, 317, 300), crop_image(im, 20, 200, 280, 188)};
+    matrix H[3] = {make_identity_homography(), make_translation_homography(-200, -40), make_translation_homography(-20, -200)};
+    int rect[3][4] = {{0, 0, 300, 250}, {200, 40, 517, 340}, {20, 200, 300, 388}};
+    int b, i, j, k, t;
+    for(b = BLEND_NONE; b <= BLEND_MULTIBAND; ++b){
+        image pan = composite_images(ims, H, 3, b);
+        TEST(pan.w == im.w && pan.h == im.h);
+        // Pixels no crop covers stay black.
+        float diff = 0;
+        for(k = 0; k < pan.c; ++k){
+            for(j = 0; j < pan.h; ++j){
+                for(i = 0; i < pan.w; ++i){
+                    int n, covered = 0;
+                    for(n = 0; n < 3; ++n) covered |= i >= rect[n][0] && i < rect[n][2] && j >= rect[n][1] && j < rect[n][3];
+                    diff = MAX(diff, fabsf(PIXEL(pan, i, j, k) - (covered ? PIXEL(im, i, j, k) : 0)));
+                }
+            }
+        }
+        TEST(diff < 1e-4);
+        free_image(pan);
+    }
+    for(i = 0; i < 3; ++i){
+        free_image(ims[i]);
+        free_matrix(H[i]);
+    }
+    free_image(im);
+
+    // Rainier out of order: every image joins the graph, with the same
+    // homographies on any number of threads.
+    const char *names[6] = {"data/Rainier1.png", "data/Rainier2.png", "data/Rainier5.png",
+        "data/Rainier6.png", "data/Rainier3.png", "data/Rainier4.png"};
+    image rain[6];
+    matrix Ht[2][6];
+    int ref[2];
+    for(i = 0; i < 6; ++i) rain[i] = load_image((char *)names[i]);
+    for(t = 0; t < 2; ++t){
+        set_num_threads(t ? 4 : 1);
+        ref[t] = panorama_homographies(rain, 6, 2, 5, 3, 2, 10000, 30, 0, Ht[t]);
+    }
+    set_num_threads(0);
+    int connected = 1, same = ref[0] == ref[1];
+    for(i = 0; i < 6; ++i){
+        connected &= Ht[0][i].data != 0;
+        same &= Ht[0][i].data && Ht[1][i].data && same_matrix(Ht[0][i], Ht[1][i]);
+    }
+    TEST(connected);
+    TEST(same);
+    matrix I = make_identity_homography();
+    TEST(same_matrix(Ht[0][ref[0]], I));
+    free_matrix(I);
+    for(i = 0; i < 6; ++i){
+        free_matrix(Ht[0][i]);
+        free_matrix(Ht[1][i]);
+        free_image(rain[i]);
+    }
+}
+
+// Projects onto a cylinder one pixel at a time, the slow way.
+image reference_cylindrical(image im, float f)
+{
+    image c = make_image(im.w, im.h, im.c);
+    int xc = im.w/2, yc = im.h/2;
+    int i, j, k;
+    for(j = 0; j < im.h; ++j){
+        for(i = 0; i < im.w; ++i){
+            double theta = (i - xc)/f, h = (j - yc)/f;
+            double x = f*tan(theta) + xc, y = f*h/cos(theta) + yc;
+            if(x < 0 || x > im.w - 1 || y < 0 || y > im.h - 1) continue;
+            for(k = 0; k < im.c; ++k) set_pixel(c, i, j, k, bilinear_interpolate(im, x, y, k));
+        }
+    }
+    return c;
+}
+
+void test_remap()
+{
+    image im = load_image("data/Rainier1.png");
+    image cyl = cylindrical_project(im, 300);
+    image slow = reference_cylindrical(im, 300);
+    // Pixels that project exactly onto the border can round either way.
+    int i, off = 0;
+    for(i = 0; i < cyl.w*cyl.h*cyl.c; ++i) off += !within_eps(cyl.data[i], slow.data[i], 1e-4);
+    TEST(off < 20 && avg_abs_diff(cyl, slow) < 1e-5);
+    // Cached tables give the same result.
+    image again = cylindrical_project(im, 300);
+    TEST(identical_image(cyl, again));
+
+    // No distortion is no change, and the centre stays put on a sphere.
+    image same = undistort_image(im, 500, 0, 0);
+    TEST(close_image(same, im, 1e-4));
+    image sph = spherical_project(im, 400);
+    int k, centre = 1;
+    for(k = 0; k < im.c; ++k) centre &= within_eps(PIXEL(sph, im.w/2, im.h/2, k), PIXEL(im, im.w/2, im.h/2, k), 1e-5);
+    TEST(centre);
+
+    // Barrel distortion pulls the corners in, so undistorting reads from
+    // further out and the corners go black.
+    image flat = undistort_image(im, 500, .3, 0);
+    TEST(PIXEL(flat, 0, 0, 0) == 0 && PIXEL(flat, im.w-1, im.h-1, 0) == 0);
+    TEST(within_eps(PIXEL(flat, im.w/2, im.h/2, 0), PIXEL(im, im.w/2, im.h/2, 0), 1e-5));
+
+    free_image(cyl);
+    free_image(slow);
+    free_image(again);
+    free_image(same);
+    free_image(sph);
+    free_image(flat);
+    free_image(im);
+}
+
 void test_hw3()
 {
     test_structure();
     test_cornerness();
+    test_nms_image();
+    test_harris_corners();
+    test_select_corners();
+    test_smooth_methods();
     test_projection();
     test_compute_homography();
+    test_ransac();
+    test_combine_images();
+    test_blend_images();
+    test_panorama_images();
+    test_remap();
+    test_describe_corners();
+    test_descriptor_index();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void make_hw4_tests()
@@ -807,6 +1794,128 @@ void test_velocity_image()
     image velocity = velocity_image(structure, 5);
     image velocity_t = load_image_binary("data/velocity.bin");
     TEST(same_image(velocity, velocity_t, EPS));
+
+    image vc = velocity_confidence_image(structure, 5);
+    int i, n = vc.w*vc.h, ok = 1;
+    for(i = 0; i < 2*n; ++i) ok &= vc.data[i] == velocity.data[i];
+    // The smaller eigenvalue of a sum of outer products is never negative
+    for(i = 2*n; i < 3*n; ++i) ok &= vc.data[i] > -EPS;
+    TEST(ok);
+    free_image(vc);
+}
+// A shift several times the window should still be found once the
+// pyramid brings it down to a pixel or two.
+void test_pyramid_flow()
+{
+    image dog = load_image("data/dog_a_small.jpg");
+    image prev = rgb_to_grayscale(dog);
+    image cur = make_image(prev.w, prev.h, 1);
+    float dx = 9.5, dy = -6.25;
+    int x, y;
+    for(y = 0; y < cur.h; ++y){
+        for(x = 0; x < cur.w; ++x){
+            set_pixel(cur, x, y, 0, bilinear_interpolate(prev, x - dx, y - dy, 0));
+        }
+    }
+    flow_pyramid a = make_flow_pyramid(cur, 0);
+    flow_pyramid b = make_flow_pyramid(prev, 0);
+    TEST(a.levels > 1 && a.levels == b.levels);
+    TEST(a.im[1].w == (prev.w + 1)/2 && a.im[1].h == (prev.h + 1)/2);
+    image flow = pyramid_flow(a, b, 15, 3);
+    TEST(flow.w == prev.w && flow.h == prev.h && flow.c == 2);
+    double err = 0;
+    int n = 0, margin = 24;
+    for(y = margin; y < flow.h - margin; ++y){
+        for(x = margin; x < flow.w - margin; ++x){
+            err += fabs(PIXEL(flow, x, y, 0) - dx) + fabs(PIXEL(flow, x, y, 1) - dy);
+            ++n;
+        }
+    }
+    TEST(err/n < .25);
+    image v = optical_flow_pyramid(cur, prev, 0, 15, 8);
+    TEST(v.w == prev.w/8 && v.h == prev.h/8 && v.c == 3);
+    TEST(within_eps(get_pixel(v, v.w/2, v.h/2, 0), dx, .5) && within_eps(get_pixel(v, v.w/2, v.h/2, 1), dy, .5));
+    free_image(v);
+
+    // A session over prev then cur gives the same flow as the pair
+    flow_session *s = make_flow_session(prev.w, prev.h, 0, 15, 3);
+    image first = flow_session_next(s, prev, 8);
+    TEST(first.w == prev.w/8 && first.data[0] == 0);
+    v = flow_session_next(s, cur, 8);
+    image vp = sample_flow(flow, 8);
+    TEST(identical_image(v, vp));
+    free_image(vp);
+    free_image(v);
+    free_image(first);
+    free_flow_session(s);
+
+    free_image(flow);
+    free_flow_pyramid(a);
+    free_flow_pyramid(b);
+    free_image(cur);
+    free_image(prev);
+    free_image(dog);
+}
+// Legacy dumps and the versioned format should load and map to the same
+// pixels, and mapped views should free cleanly.
+void test_binary_format()
+{
+    image legacy = load_image_binary("data/dogintegral.bin");
+    image view = map_image_binary("data/dogintegral.bin");
+    TEST(identical_image(legacy, view));
+    release_image(view);
+
+    save_image_binary(legacy, "uwimg_test.bin");
+    image loaded = load_image_binary("uwimg_test.bin");
+    TEST(identical_image(legacy, loaded));
+    view = map_image_binary("uwimg_test.bin");
+    TEST(identical_image(legacy, view));
+    view.data[0] = -1; // private mapping, the file keeps its value
+    release_image(view);
+    view = map_image_binary("uwimg_test.bin");
+    TEST(view.data[0] == legacy.data[0]);
+    release_image(view);
+    free_image(loaded);
+    free_image(legacy);
+
+    matrix m = random_matrix(7, 5, 10);
+    double *swap = m.data[0];
+    m.data[0] = m.data[6];
+    m.data[6] = swap;
+    save_matrix(m, "uwimg_test.bin");
+    matrix ml = load_matrix("uwimg_test.bin");
+    matrix mm = map_matrix("uwimg_test.bin");
+    TEST(same_matrix(m, ml) && same_matrix(m, mm));
+    release_matrix(mm);
+    free_matrix(ml);
+    free_matrix(m);
+
+    matrix old = load_matrix("data/test/a.matrix");
+    mm = map_matrix("data/test/a.matrix");
+    TEST(same_matrix(old, mm));
+    release_matrix(mm);
+    free_matrix(old);
+
+    // A payload that fails its checksum doesn't load
+    image im = make_image(4, 4, 1);
+    save_image_binary(im, "uwimg_test.bin");
+    FILE *fp = fopen("uwimg_test.bin", "r+b");
+    fseek(fp, -1, SEEK_END);
+    fputc(0x7f, fp);
+    fclose(fp);
+    loaded = load_image_binary("uwimg_test.bin");
+    TEST(!loaded.data);
+    m = make_matrix(4, 4);
+    save_matrix(m, "uwimg_test.bin");
+    fp = fopen("uwimg_test.bin", "r+b");
+    fseek(fp, -1, SEEK_END);
+    fputc(0x7f, fp);
+    fclose(fp);
+    ml = load_matrix("uwimg_test.bin");
+    TEST(!ml.data);
+    free_matrix(m);
+    free_image(im);
+    remove("uwimg_test.bin");
 }
 void test_hw4()
 {
@@ -815,13 +1924,19 @@ void test_hw4()
     test_good_enough_box_filter_image();
     test_structure_image();
     test_velocity_image();
+    test_pyramid_flow();
+    test_binary_format();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
+
 void test_hw5()
 {
     test_activate_matrix();
     test_gradient_matrix();
+    test_matrix_mult();
     test_layer();
+    test_flayer();
+    test_dataset_stream();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 
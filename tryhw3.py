@@ -5,6 +5,13 @@ def draw_corners():
     detect_and_draw_corners(im, 2, 50, 3)
     save_image(im, "corners")
 
+def draw_top_corners():
+    im = load_image("data/Rainier1.png")
+    n = c_int()
+    d = harris_corner_detector_top(im, 2, 3, 500, SELECT_ANMS, byref(n))
+    mark_corners(im, d, n.value)
+    save_image(im, "top_corners")
+
 def draw_matches():
     a = load_image("data/Rainier1.png")
     b = load_image("data/Rainier2.png")
@@ -35,6 +42,10 @@ def rainier_panorama():
     pan5 = panorama_image(pan4, im4, thresh=5)
     save_image(pan5, "rainier_panorama_5")
 
+def rainier_panorama_all():
+    ims = [load_image("data/Rainier%d.png" % i) for i in range(1, 7)]
+    pan = panorama_images(ims, thresh=5, blend=BLEND_MULTIBAND)
+    save_image(pan, "rainier_panorama_all")
 
 def field_panorama():
     im1 = load_image("data/field1.jpg")
@@ -67,14 +78,25 @@ def field_panorama():
     pan5 = panorama_image(pan4, im3, thresh=2, iters=50000, inlier_thresh=3)
     save_image(pan5, "field_panorama_5")
 
+def field_panorama_all():
+    ims = [cylindrical_project(load_image("data/field%d.jpg" % i), 1200) for i in range(1, 9)]
+    pan = panorama_images(ims, thresh=2, iters=50000, inlier_thresh=3, window=2, blend=BLEND_MULTIBAND)
+    save_image(pan, "field_panorama_all")
+
 # print("Drawing Corners\n")
 # draw_corners()
+# print("Drawing the 500 best spread out corners\n")
+# draw_top_corners()
 # print("Drawing Matches")
 # draw_matches()
 print("Drawing Easy Panorama")
 easy_panorama()
 # print("Drawing Rainier Panorama")
 # rainier_panorama()
+# print("Drawing Rainier Panorama in one pass")
+# rainier_panorama_all()
 # print("Drawing Field Panorama\n")
 # field_panorama()
+# print("Drawing Field Panorama in one pass\n")
+# field_panorama_all()
 
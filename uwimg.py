@@ -10,6 +10,46 @@ def c_array(ctype, values):
     arr[:] = values
     return arr
 
+# NumPy interop without copies. Images and matrices publish
+# __array_interface__, so numpy.asarray(im) is a view of the C buffer that
+# is only good until the image is freed. image_from_array and friends go
+# the other way, wrapping any C contiguous buffer that publishes
+# __array_interface__ (numpy arrays do). The view keeps the buffer alive
+# and the free_* wrappers below leave its memory alone.
+
+def _address(p):
+    return cast(p, c_void_p).value or 0
+
+def _interface(shape, typestr, data):
+    return {"shape": shape, "typestr": typestr, "data": (data, False), "version": 3}
+
+# Matrices are arrays of row pointers; NumPy can only view them when the
+# rows are back to back. Matrices from make_matrix, load_matrix and
+# map_matrix have them in one block, base, which is viewed in place.
+# Others have their rows checked one by one.
+def _rows_interface(m, typestr, size):
+    base = _address(m.base)
+    if base:
+        return _interface((m.rows, m.cols), typestr, base)
+    first = _address(m.data[0]) if m.rows else 0
+    for i in range(1, m.rows):
+        if _address(m.data[i]) != first + i*m.cols*size:
+            raise ValueError("matrix rows are not contiguous, copy it first")
+    return _interface((m.rows, m.cols), typestr, first)
+
+def _buffer(a, typestr, dims):
+    ai = a.__array_interface__
+    if ai["typestr"] != typestr:
+        raise TypeError("need %s data, got %s" % (typestr, ai["typestr"]))
+    if ai.get("strides") is not None:
+        raise ValueError("need a C contiguous buffer")
+    if len(ai["shape"]) not in dims:
+        raise ValueError("can't view a %d dimensional buffer" % len(ai["shape"]))
+    ptr, readonly = ai["data"]
+    if readonly:
+        raise ValueError("buffer is read only")
+    return ptr, ai["shape"]
+
 class IMAGE(Structure):
     _fields_ = [("w", c_int),
                 ("h", c_int),
@@ -19,6 +59,18 @@ class IMAGE(Structure):
         return add_image(self, other)
     def __sub__(self, other):
         return sub_image(self, other)
+    @property
+    def __array_interface__(self):
+        return _interface((self.c, self.h, self.w), "<f4", _address(self.data))
+
+class IMAGE_U8(Structure):
+    _fields_ = [("w", c_int),
+                ("h", c_int),
+                ("c", c_int),
+                ("data", POINTER(c_ubyte))]
+    @property
+    def __array_interface__(self):
+        return _interface((self.c, self.h, self.w), "|u1", _address(self.data))
 
 class POINT(Structure):
     _fields_ = [("x", c_float),
@@ -33,12 +85,34 @@ class MATRIX(Structure):
     _fields_ = [("rows", c_int),
                 ("cols", c_int),
                 ("data", POINTER(POINTER(c_double))),
-                ("shallow", c_int)]
+                ("shallow", c_int),
+                ("base", POINTER(c_double))]
+    @property
+    def __array_interface__(self):
+        return _rows_interface(self, "<f8", sizeof(c_double))
+
+class FMATRIX(Structure):
+    _fields_ = [("rows", c_int),
+                ("cols", c_int),
+                ("data", POINTER(POINTER(c_float))),
+                ("shallow", c_int),
+                ("base", POINTER(c_float))]
+    @property
+    def __array_interface__(self):
+        return _rows_interface(self, "<f4", sizeof(c_float))
 
 class DATA(Structure):
     _fields_ = [("X", MATRIX),
                 ("y", MATRIX)]
 
+class DATASET_OPTS(Structure):
+    _fields_ = [("batch", c_int),
+                ("ring", c_int),
+                ("threads", c_int),
+                ("shuffle", c_int),
+                ("seed", c_uint),
+                ("cache_u8", c_int)]
+
 class LAYER(Structure):
     _fields_ = [("in", MATRIX),
                 ("dw", MATRIX),
@@ -51,10 +125,34 @@ class MODEL(Structure):
     _fields_ = [("layers", POINTER(LAYER)),
                 ("n", c_int)]
 
+class FLAYER(Structure):
+    _fields_ = [("in", FMATRIX),
+                ("w", FMATRIX),
+                ("dw", FMATRIX),
+                ("v", FMATRIX),
+                ("out", FMATRIX),
+                ("activation", c_int)]
+
+class FMODEL(Structure):
+    _fields_ = [("layers", POINTER(FLAYER)),
+                ("n", c_int)]
+
 
 (LINEAR, LOGISTIC, RELU, LRELU, SOFTMAX) = range(5)
 
 
+set_num_threads = lib.set_num_threads
+set_num_threads.argtypes = [c_int]
+set_num_threads.restype = None
+
+get_num_threads = lib.get_num_threads
+get_num_threads.argtypes = []
+get_num_threads.restype = c_int
+
+set_tile_size = lib.set_tile_size
+set_tile_size.argtypes = [c_int]
+set_tile_size.restype = None
+
 add_image = lib.add_image
 add_image.argtypes = [IMAGE, IMAGE]
 add_image.restype = IMAGE
@@ -67,8 +165,53 @@ make_image = lib.make_image
 make_image.argtypes = [c_int, c_int, c_int]
 make_image.restype = IMAGE
 
-free_image = lib.free_image
-free_image.argtypes = [IMAGE]
+free_image_lib = lib.free_image
+free_image_lib.argtypes = [IMAGE]
+
+def free_image(im):
+    if getattr(im, "_owner", None) is None:
+        free_image_lib(im)
+
+free_matrix_lib = lib.free_matrix
+free_matrix_lib.argtypes = [MATRIX]
+free_matrix_lib.restype = None
+
+def free_matrix(m):
+    if getattr(m, "_owner", None) is None:
+        free_matrix_lib(m)
+
+free_fmatrix_lib = lib.free_fmatrix
+free_fmatrix_lib.argtypes = [FMATRIX]
+free_fmatrix_lib.restype = None
+
+def free_fmatrix(m):
+    if getattr(m, "_owner", None) is None:
+        free_fmatrix_lib(m)
+
+# a: float32 buffer, c x h x w or h x w for one channel.
+def image_from_array(a):
+    ptr, shape = _buffer(a, "<f4", (2, 3))
+    c, h, w = shape if len(shape) == 3 else (1,) + tuple(shape)
+    im = IMAGE(w, h, c, cast(c_void_p(ptr), POINTER(c_float)))
+    im._owner = a
+    return im
+
+def _matrix_from_array(a, typestr, ctype, mtype):
+    ptr, (rows, cols) = _buffer(a, typestr, (2,))
+    size = sizeof(ctype)
+    row_ptrs = (POINTER(ctype)*rows)(*[cast(c_void_p(ptr + i*cols*size), POINTER(ctype)) for i in range(rows)])
+    # shallow: the rows belong to the buffer
+    m = mtype(rows, cols, cast(row_ptrs, POINTER(POINTER(ctype))), 1, cast(c_void_p(ptr), POINTER(ctype)))
+    m._owner = (a, row_ptrs)
+    return m
+
+# a: float64 rows x cols buffer.
+def matrix_from_array(a):
+    return _matrix_from_array(a, "<f8", c_double, MATRIX)
+
+# a: float32 rows x cols buffer.
+def fmatrix_from_array(a):
+    return _matrix_from_array(a, "<f4", c_float, FMATRIX)
 
 get_pixel = lib.get_pixel
 get_pixel.argtypes = [IMAGE, c_int, c_int, c_int]
@@ -106,6 +249,23 @@ shift_image = lib.shift_image
 shift_image.argtypes = [IMAGE, c_int, c_float]
 shift_image.restype = None
 
+save_image_binary = lib.save_image_binary
+save_image_binary.argtypes = [IMAGE, c_char_p]
+save_image_binary.restype = None
+
+load_image_binary = lib.load_image_binary
+load_image_binary.argtypes = [c_char_p]
+load_image_binary.restype = IMAGE
+
+# Zero-copy view of a binary image file, free it with release_image.
+map_image_binary = lib.map_image_binary
+map_image_binary.argtypes = [c_char_p]
+map_image_binary.restype = IMAGE
+
+release_image = lib.release_image
+release_image.argtypes = [IMAGE]
+release_image.restype = None
+
 load_image_lib = lib.load_image
 load_image_lib.argtypes = [c_char_p]
 load_image_lib.restype = IMAGE
@@ -127,6 +287,91 @@ save_image_lib.restype = None
 def save_image(im, f):
     return save_image_lib(im, f.encode('ascii'))
 
+load_images_lib = lib.load_images
+load_images_lib.argtypes = [POINTER(c_char_p), c_int, c_int, POINTER(IMAGE)]
+load_images_lib.restype = c_int
+
+# Decodes the files on the thread pool. Files that can't be read come back
+# as empty images (data is None) rather than stopping the program.
+def load_images(paths, channels=0):
+    names = (c_char_p*len(paths))(*[p.encode('ascii') for p in paths])
+    ims = (IMAGE*len(paths))()
+    load_images_lib(names, len(paths), channels, ims)
+    return list(ims)
+
+save_images_lib = lib.save_images
+save_images_lib.argtypes = [POINTER(IMAGE), POINTER(c_char_p), c_int, c_int]
+save_images_lib.restype = c_int
+
+# returns: how many images couldn't be written.
+def save_images(ims, names, png=False):
+    arr = (IMAGE*len(ims))(*ims)
+    cnames = (c_char_p*len(names))(*[n.encode('ascii') for n in names])
+    return save_images_lib(arr, cnames, len(ims), 1 if png else 0)
+
+make_image_u8 = lib.make_image_u8
+make_image_u8.argtypes = [c_int, c_int, c_int]
+make_image_u8.restype = IMAGE_U8
+
+free_image_u8 = lib.free_image_u8
+free_image_u8.argtypes = [IMAGE_U8]
+free_image_u8.restype = None
+
+load_image_u8_lib = lib.load_image_u8
+load_image_u8_lib.argtypes = [c_char_p]
+load_image_u8_lib.restype = IMAGE_U8
+
+def load_image_u8(f):
+    return load_image_u8_lib(f.encode('ascii'))
+
+load_images_u8_lib = lib.load_images_u8
+load_images_u8_lib.argtypes = [POINTER(c_char_p), c_int, POINTER(IMAGE_U8)]
+load_images_u8_lib.restype = c_int
+
+def load_images_u8(paths):
+    names = (c_char_p*len(paths))(*[p.encode('ascii') for p in paths])
+    ims = (IMAGE_U8*len(paths))()
+    load_images_u8_lib(names, len(paths), ims)
+    return list(ims)
+
+save_png_u8_lib = lib.save_png_u8
+save_png_u8_lib.argtypes = [IMAGE_U8, c_char_p]
+save_png_u8_lib.restype = None
+
+def save_png_u8(im, f):
+    return save_png_u8_lib(im, f.encode('ascii'))
+
+save_image_u8_lib = lib.save_image_u8
+save_image_u8_lib.argtypes = [IMAGE_U8, c_char_p]
+save_image_u8_lib.restype = None
+
+def save_image_u8(im, f):
+    return save_image_u8_lib(im, f.encode('ascii'))
+
+image_u8_to_float = lib.image_u8_to_float
+image_u8_to_float.argtypes = [IMAGE_U8]
+image_u8_to_float.restype = IMAGE
+
+image_to_u8 = lib.image_to_u8
+image_to_u8.argtypes = [IMAGE]
+image_to_u8.restype = IMAGE_U8
+
+nn_resize_u8 = lib.nn_resize_u8
+nn_resize_u8.argtypes = [IMAGE_U8, c_int, c_int]
+nn_resize_u8.restype = IMAGE_U8
+
+bilinear_resize_u8 = lib.bilinear_resize_u8
+bilinear_resize_u8.argtypes = [IMAGE_U8, c_int, c_int]
+bilinear_resize_u8.restype = IMAGE_U8
+
+rgb_to_grayscale_u8 = lib.rgb_to_grayscale_u8
+rgb_to_grayscale_u8.argtypes = [IMAGE_U8]
+rgb_to_grayscale_u8.restype = IMAGE_U8
+
+box_filter_image_u8 = lib.box_filter_image_u8
+box_filter_image_u8.argtypes = [IMAGE_U8, c_int]
+box_filter_image_u8.restype = IMAGE_U8
+
 same_image = lib.same_image
 same_image.argtypes = [IMAGE, IMAGE]
 same_image.restype = c_int
@@ -179,10 +424,26 @@ convolve_image = lib.convolve_image
 convolve_image.argtypes = [IMAGE, IMAGE, c_int]
 convolve_image.restype = IMAGE
 
+SMOOTH_EXACT, SMOOTH_BOX, SMOOTH_IIR = range(3)
+
+smooth_image = lib.smooth_image
+smooth_image.argtypes = [IMAGE, c_float]
+smooth_image.restype = IMAGE
+
+smooth_image_method = lib.smooth_image_method
+smooth_image_method.argtypes = [IMAGE, c_float, c_int]
+smooth_image_method.restype = IMAGE
+
 harris_corner_detector = lib.harris_corner_detector
 harris_corner_detector.argtypes = [IMAGE, c_float, c_float, c_int, POINTER(c_int)]
 harris_corner_detector.restype = POINTER(DESCRIPTOR)
 
+SELECT_BEST, SELECT_GRID, SELECT_ANMS = range(3)
+
+harris_corner_detector_top = lib.harris_corner_detector_top
+harris_corner_detector_top.argtypes = [IMAGE, c_float, c_int, c_int, c_int, POINTER(c_int)]
+harris_corner_detector_top.restype = POINTER(DESCRIPTOR)
+
 mark_corners = lib.mark_corners
 mark_corners.argtypes = [IMAGE, POINTER(DESCRIPTOR), c_int]
 mark_corners.restype = None
@@ -195,6 +456,14 @@ cylindrical_project = lib.cylindrical_project
 cylindrical_project.argtypes = [IMAGE, c_float]
 cylindrical_project.restype = IMAGE
 
+spherical_project = lib.spherical_project
+spherical_project.argtypes = [IMAGE, c_float]
+spherical_project.restype = IMAGE
+
+undistort_image = lib.undistort_image
+undistort_image.argtypes = [IMAGE, c_float, c_float, c_float]
+undistort_image.restype = IMAGE
+
 structure_matrix = lib.structure_matrix
 structure_matrix.argtypes = [IMAGE, c_float]
 structure_matrix.restype = IMAGE
@@ -203,10 +472,12 @@ find_and_draw_matches = lib.find_and_draw_matches
 find_and_draw_matches.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int]
 find_and_draw_matches.restype = IMAGE
 
-panorama_image_lib = lib.panorama_image
-panorama_image_lib.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int, c_float, c_int, c_int]
+panorama_image_lib = lib.panorama_image_blend
+panorama_image_lib.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int, c_float, c_int, c_int, c_int]
 panorama_image_lib.restype = IMAGE
 
+BLEND_NONE, BLEND_FEATHER, BLEND_MULTIBAND = range(3)
+
 draw_flow = lib.draw_flow
 draw_flow.argtypes = [IMAGE, IMAGE, c_float]
 draw_flow.restype = None
@@ -223,17 +494,53 @@ optical_flow_webcam = lib.optical_flow_webcam
 optical_flow_webcam.argtypes = [c_int, c_int, c_int]
 optical_flow_webcam.restype = None
 
-def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
-    return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff)
+optical_flow_pyramid = lib.optical_flow_pyramid
+optical_flow_pyramid.argtypes = [IMAGE, IMAGE, c_int, c_int, c_int]
+optical_flow_pyramid.restype = IMAGE
+
+make_flow_session = lib.make_flow_session
+make_flow_session.argtypes = [c_int, c_int, c_int, c_int, c_int]
+make_flow_session.restype = c_void_p
+
+flow_session_next = lib.flow_session_next
+flow_session_next.argtypes = [c_void_p, IMAGE, c_int]
+flow_session_next.restype = IMAGE
+
+free_flow_session = lib.free_flow_session
+free_flow_session.argtypes = [c_void_p]
+free_flow_session.restype = None
 
+optical_flow_webcam_pyramid = lib.optical_flow_webcam_pyramid
+optical_flow_webcam_pyramid.argtypes = [c_int, c_int, c_int]
+optical_flow_webcam_pyramid.restype = None
 
-train_model = lib.train_model
-train_model.argtypes = [MODEL, DATA, c_int, c_int, c_double, c_double, c_double]
-train_model.restype = None
+def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30, blend=BLEND_NONE):
+    return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff, blend)
 
-accuracy_model = lib.accuracy_model
-accuracy_model.argtypes = [MODEL, DATA]
-accuracy_model.restype = c_double
+panorama_images_lib = lib.panorama_images
+panorama_images_lib.argtypes = [POINTER(IMAGE), c_int, c_float, c_float, c_int, c_float, c_int, c_int, c_int, c_int]
+panorama_images_lib.restype = IMAGE
+
+def panorama_images(ims, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30, window=0, blend=BLEND_NONE):
+    arr = (IMAGE*len(ims))(*ims)
+    return panorama_images_lib(arr, len(ims), sigma, thresh, nms, inlier_thresh, iters, cutoff, window, blend)
+
+
+train_model_lib = lib.train_model
+train_model_lib.argtypes = [MODEL, DATA, c_int, c_int, c_double, c_double, c_double]
+train_model_lib.restype = None
+
+train_fmodel = lib.train_fmodel
+train_fmodel.argtypes = [FMODEL, DATA, c_int, c_int, c_double, c_double, c_double]
+train_fmodel.restype = None
+
+accuracy_model_lib = lib.accuracy_model
+accuracy_model_lib.argtypes = [MODEL, DATA]
+accuracy_model_lib.restype = c_double
+
+accuracy_fmodel = lib.accuracy_fmodel
+accuracy_fmodel.argtypes = [FMODEL, DATA]
+accuracy_fmodel.restype = c_double
 
 forward_model = lib.forward_model
 forward_model.argtypes = [MODEL, MATRIX]
@@ -243,16 +550,66 @@ load_classification_data = lib.load_classification_data
 load_classification_data.argtypes = [c_char_p, c_char_p, c_int]
 load_classification_data.restype = DATA
 
-make_layer = lib.make_layer
-make_layer.argtypes = [c_int, c_int, c_int]
-make_layer.restype = LAYER
+default_dataset_opts = lib.default_dataset_opts
+default_dataset_opts.argtypes = [c_int]
+default_dataset_opts.restype = DATASET_OPTS
+
+open_dataset = lib.open_dataset
+open_dataset.argtypes = [c_char_p, c_char_p, c_int, DATASET_OPTS]
+open_dataset.restype = c_void_p
+
+close_dataset = lib.close_dataset
+close_dataset.argtypes = [c_void_p]
+close_dataset.restype = None
+
+train_model_stream = lib.train_model_stream
+train_model_stream.argtypes = [MODEL, c_void_p, c_int, c_double, c_double, c_double]
+train_model_stream.restype = None
+
+train_fmodel_stream = lib.train_fmodel_stream
+train_fmodel_stream.argtypes = [FMODEL, c_void_p, c_int, c_double, c_double, c_double]
+train_fmodel_stream.restype = None
+
+accuracy_model_stream = lib.accuracy_model_stream
+accuracy_model_stream.argtypes = [MODEL, c_void_p]
+accuracy_model_stream.restype = c_double
+
+accuracy_fmodel_stream = lib.accuracy_fmodel_stream
+accuracy_fmodel_stream.argtypes = [FMODEL, c_void_p]
+accuracy_fmodel_stream.restype = c_double
+
+make_layer_lib = lib.make_layer
+make_layer_lib.argtypes = [c_int, c_int, c_int]
+make_layer_lib.restype = LAYER
+
+make_flayer = lib.make_flayer
+make_flayer.argtypes = [c_int, c_int, c_int]
+make_flayer.restype = FLAYER
+
+# single=True builds a float32 layer; a model is single precision when its
+# layers are, and train_model/accuracy_model follow the model.
+def make_layer(inputs, outputs, activation, single=False):
+    if single:
+        return make_flayer(inputs, outputs, activation)
+    return make_layer_lib(inputs, outputs, activation)
 
 def make_model(layers):
-    m = MODEL()
+    single = isinstance(layers[0], FLAYER)
+    m = FMODEL() if single else MODEL()
     m.n = len(layers)
-    m.layers = (LAYER*m.n) (*layers)
+    m.layers = ((FLAYER if single else LAYER)*m.n) (*layers)
     return m
 
+def train_model(m, d, batch, iters, rate, momentum, decay):
+    if isinstance(m, FMODEL):
+        return train_fmodel(m, d, batch, iters, rate, momentum, decay)
+    return train_model_lib(m, d, batch, iters, rate, momentum, decay)
+
+def accuracy_model(m, d):
+    if isinstance(m, FMODEL):
+        return accuracy_fmodel(m, d)
+    return accuracy_model_lib(m, d)
+
 if __name__ == "__main__":
     im = load_image("data/dog.jpg")
     save_image(im, "hey")